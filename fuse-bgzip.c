@@ -23,21 +23,33 @@
  */
 
 #define _GNU_SOURCE
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 312
 #define _FILE_OFFSET_BITS 64
 
 #include <dirent.h>
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
+#include <ftw.h>
+#include <fuse_lowlevel.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/vfs.h>
 #include <time.h>
@@ -47,493 +59,9707 @@
 #include <htslib/hfile.h>
 #include <htslib/hts.h>
 #include <tdb.h>
+#include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef HAVE_ISAL
+#include <isa-l/igzip_lib.h>
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
 
 #define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 
-#define LOG(...) {                                              \
-        if (logfile) {                                          \
-                FILE *fh = fopen(logfile, "a+");                \
-                time_t t = time(NULL);                          \
-                char tmp[256];                                  \
-                strftime(tmp, sizeof(tmp), "%T", localtime(&t));\
-                fprintf(fh, "[BGZIP] %s ", tmp);                \
-                fprintf(fh, __VA_ARGS__);                       \
-                fclose(fh);                                     \
-        }                                                       \
+/* Messages are formatted into a ring buffer owned by the thread that logs
+ * them and written to the log file by a background thread, so logging
+ * never does any I/O or takes a lock in the threads that serve requests.
+ * When a ring is full the message is dropped and counted instead.
+ * Messages above MAX_LOG_LEVEL are compiled out, build with
+ * -DMAX_LOG_LEVEL=0 to only keep the errors.
+ */
+enum {
+        LOG_LEVEL_ERROR,
+        LOG_LEVEL_INFO,
+        LOG_LEVEL_DEBUG,
+};
+
+#ifndef MAX_LOG_LEVEL
+#define MAX_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_AT(level, ...) do {                                         \
+        if ((level) <= MAX_LOG_LEVEL && (level) <= log_level) {         \
+                log_message(level, __VA_ARGS__);                        \
+        }                                                               \
+} while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#define LOG_RING_SIZE 256               /* records, a power of two */
+#define LOG_MSG_SIZE 256
+#define LOG_FLUSH_INTERVAL_MS 50
+
+struct log_record {
+        struct timespec ts;
+        int level;
+        char msg[LOG_MSG_SIZE];
+};
+
+/* Written by one thread only, read by the log writer */
+struct log_ring {
+        struct log_ring *next;
+        uint64_t head;          /* next record to fill */
+        uint64_t tail;          /* next record to write out */
+        uint64_t dropped;
+        int dead;               /* the thread exited, free once drained */
+        struct log_record records[LOG_RING_SIZE];
+};
+
+/* -1 while there is no log file */
+static int log_level = -1;
+static FILE *log_fh;
+static pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *log_rings;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+
+static const char *log_level_names[] = { "ERROR", "INFO", "DEBUG" };
+
+static void log_ring_exit(void *ptr)
+{
+        struct log_ring *ring = ptr;
+
+        __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void create_log_ring_key(void)
+{
+        pthread_key_create(&log_ring_key, log_ring_exit);
+}
+
+static struct log_ring *get_log_ring(void)
+{
+        struct log_ring *ring;
+
+        pthread_once(&log_ring_once, create_log_ring_key);
+        ring = pthread_getspecific(log_ring_key);
+        if (ring) {
+                return ring;
+        }
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL) {
+                return NULL;
+        }
+        pthread_mutex_lock(&log_rings_mutex);
+        ring->next = log_rings;
+        log_rings = ring;
+        pthread_mutex_unlock(&log_rings_mutex);
+        pthread_setspecific(log_ring_key, ring);
+        return ring;
+}
+
+static void log_message(int level, const char *fmt, ...)
+        __attribute__ ((format (printf, 2, 3)));
+
+static void log_message(int level, const char *fmt, ...)
+{
+        struct log_ring *ring = get_log_ring();
+        struct log_record *rec;
+        uint64_t head;
+        va_list ap;
+
+        if (ring == NULL) {
+                return;
+        }
+        head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+            LOG_RING_SIZE) {
+                __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+                return;
+        }
+        rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+        clock_gettime(CLOCK_REALTIME, &rec->ts);
+        rec->level = level;
+        va_start(ap, fmt);
+        vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+        va_end(ap);
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_log_ring(struct log_ring *ring)
+{
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        uint64_t dropped;
+
+        for (; tail != head; tail++) {
+                struct log_record *rec;
+                struct tm tm;
+                char tmp[32];
+                size_t len;
+
+                rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+                localtime_r(&rec->ts.tv_sec, &tm);
+                strftime(tmp, sizeof(tmp), "%T", &tm);
+                len = strlen(rec->msg);
+                fprintf(log_fh, "[BGZIP] %s.%06ld %s %s%s", tmp,
+                        rec->ts.tv_nsec / 1000, log_level_names[rec->level],
+                        rec->msg,
+                        len && rec->msg[len - 1] == '\n' ? "" : "\n");
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+                fprintf(log_fh, "[BGZIP] %" PRIu64 " messages dropped\n",
+                        dropped);
+        }
+}
+
+/* Write out everything that has been logged so far */
+static void flush_log(void)
+{
+        struct log_ring **ptr, *ring;
+
+        if (log_fh == NULL) {
+                return;
+        }
+        pthread_mutex_lock(&log_rings_mutex);
+        for (ptr = &log_rings; (ring = *ptr) != NULL;) {
+                int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+
+                write_log_ring(ring);
+                if (dead) {
+                        *ptr = ring->next;
+                        free(ring);
+                        continue;
+                }
+                ptr = &ring->next;
+        }
+        pthread_mutex_unlock(&log_rings_mutex);
+        fflush(log_fh);
+}
+
+static void *log_writer(void *arg)
+{
+        struct timespec ts = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+
+        for (;;) {
+                flush_log();
+                nanosleep(&ts, NULL);
+        }
+        return NULL;
+}
+
+static void start_log_writer(void)
+{
+        pthread_t thread;
+
+        if (log_fh == NULL) {
+                return;
+        }
+        if (pthread_create(&thread, NULL, log_writer, NULL) == 0) {
+                pthread_detach(thread);
+        }
+}
+
+/* Statistics, reported through the virtual file /.fuse-bgzip/stats.
+ * Every thread counts into its own struct thread_stats without any
+ * locking, and the structs are only summed up when the file is opened.
+ * The counters of threads that exit are folded into retired_stats.
+ */
+enum {
+        OP_LOOKUP,
+        OP_GETATTR,
+        OP_OPEN,
+        OP_READ,
+        OP_OPENDIR,
+        OP_READDIR,
+        NUM_OPS
+};
+
+static const char *op_names[NUM_OPS] = {
+        "lookup", "getattr", "open", "read", "opendir", "readdir",
+};
+
+enum {
+        STAT_BYTES_INFLATED,
+        STAT_BYTES_SERVED,
+        STAT_BLOCKS_INFLATED,
+        STAT_INFLATE_NS,
+        STAT_BLOCK_HITS,
+        STAT_BLOCK_MISSES,
+        STAT_INDEX_HITS,
+        STAT_INDEX_MISSES,
+        STAT_CLASSIFY_HITS,
+        STAT_CLASSIFY_SLOW,
+        STAT_SIZE_HITS,
+        STAT_SIZE_SLOW,
+        STAT_READAHEAD_ENTRIES,
+        STAT_FLIGHT_WAITS,
+        STAT_IO_READS,
+        STAT_IO_BYTES,
+        STAT_IO_SUBMITS,
+        STAT_REMOTE_READS,
+        STAT_DISK_HITS,
+        STAT_DISK_MISSES,
+        STAT_DISK_WRITES,
+        STAT_DISK_DROPS,
+        STAT_SNAPSHOT_HITS,
+        STAT_SOURCE_REOPENS,
+        STAT_READAHEAD_CANCELLED,
+        STAT_CRC_ERRORS,
+        STAT_ATTR_HITS,
+        NUM_STATS
+};
+
+static const char *stat_names[NUM_STATS] = {
+        "bytes_inflated", "bytes_served", "blocks_inflated",
+        "inflate_time_ns", "block_cache_hits", "block_cache_misses",
+        "index_cache_hits", "index_cache_misses", "classify_cache_hits",
+        "classify_slow_path", "size_cache_hits", "size_slow_path",
+        "readahead_entries", "single_flight_waits", "compressed_reads",
+        "compressed_bytes_read", "compressed_read_submits",
+        "remote_reads", "disk_cache_hits", "disk_cache_misses",
+        "disk_cache_writes", "disk_cache_dropped", "classify_snapshot_hits",
+        "source_reopens", "readahead_cancelled",
+        "crc_errors", "attr_cache_hits",
+};
+
+/* Latencies are counted in power of two buckets of microseconds, bucket
+ * i holding the operations that took less than 2^i us.
+ */
+#define LATENCY_BUCKETS 24
+
+struct op_stats {
+        uint64_t count;
+        uint64_t total_ns;
+        uint64_t buckets[LATENCY_BUCKETS];
+};
+
+struct thread_stats {
+        struct thread_stats *next;
+        uint64_t counters[NUM_STATS];
+        struct op_stats ops[NUM_OPS];
+        unsigned heat_tick;     /* see count_heat() */
+};
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats *all_stats;
+static struct thread_stats retired_stats;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static struct timespec start_time;
+static uint64_t start_ns;
+
+/* readahead batches that have not finished yet */
+static int readahead_inflight;
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Only the owning thread writes its counters, but they are read by the
+ * thread that sums them, so the updates are relaxed atomic stores rather
+ * than locked increments.
+ */
+static void stats_inc(uint64_t *counter, uint64_t val)
+{
+        __atomic_store_n(counter,
+                         __atomic_load_n(counter, __ATOMIC_RELAXED) + val,
+                         __ATOMIC_RELAXED);
+}
+
+static void add_stats(struct thread_stats *to, struct thread_stats *from)
+{
+        int i, j;
+
+        for (i = 0; i < NUM_STATS; i++) {
+                to->counters[i] += __atomic_load_n(&from->counters[i],
+                                                   __ATOMIC_RELAXED);
+        }
+        for (i = 0; i < NUM_OPS; i++) {
+                struct op_stats *o = &from->ops[i];
+
+                to->ops[i].count += __atomic_load_n(&o->count,
+                                                    __ATOMIC_RELAXED);
+                to->ops[i].total_ns += __atomic_load_n(&o->total_ns,
+                                                       __ATOMIC_RELAXED);
+                for (j = 0; j < LATENCY_BUCKETS; j++) {
+                        to->ops[i].buckets[j] +=
+                                __atomic_load_n(&o->buckets[j],
+                                                __ATOMIC_RELAXED);
+                }
+        }
+}
+
+static void thread_stats_exit(void *ptr)
+{
+        struct thread_stats *stats = ptr, **p;
+
+        pthread_mutex_lock(&stats_mutex);
+        for (p = &all_stats; *p != stats; p = &(*p)->next) {
+        }
+        *p = stats->next;
+        add_stats(&retired_stats, stats);
+        pthread_mutex_unlock(&stats_mutex);
+        free(stats);
+}
+
+static void create_stats_key(void)
+{
+        pthread_key_create(&stats_key, thread_stats_exit);
+}
+
+static struct thread_stats *get_thread_stats(void)
+{
+        struct thread_stats *stats;
+
+        pthread_once(&stats_once, create_stats_key);
+        stats = pthread_getspecific(stats_key);
+        if (stats) {
+                return stats;
+        }
+        stats = calloc(1, sizeof(*stats));
+        if (stats == NULL) {
+                return NULL;
+        }
+        pthread_mutex_lock(&stats_mutex);
+        stats->next = all_stats;
+        all_stats = stats;
+        pthread_mutex_unlock(&stats_mutex);
+        pthread_setspecific(stats_key, stats);
+        return stats;
+}
+
+static void count_stat(int stat, uint64_t val)
+{
+        struct thread_stats *stats = get_thread_stats();
+
+        if (stats) {
+                stats_inc(&stats->counters[stat], val);
+        }
+}
+
+/* Record an operation that started at start, as returned by now_ns() */
+static void count_op(int op, uint64_t start)
+{
+        struct thread_stats *stats = get_thread_stats();
+        uint64_t ns = now_ns() - start;
+        uint64_t us = ns / 1000;
+        int bucket = 0;
+
+        if (stats == NULL) {
+                return;
+        }
+        while (bucket < LATENCY_BUCKETS - 1 && us >= (1ULL << bucket)) {
+                bucket++;
+        }
+        stats_inc(&stats->ops[op].count, 1);
+        stats_inc(&stats->ops[op].total_ns, ns);
+        stats_inc(&stats->ops[op].buckets[bucket], 1);
+}
+
+/* Upper bound in us of the bucket that holds fraction of all operations */
+static uint64_t latency_percentile(const struct op_stats *o, double fraction)
+{
+        uint64_t want = o->count * fraction, seen = 0;
+        int i;
+
+        for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+                seen += o->buckets[i];
+                if (seen > want) {
+                        break;
+                }
+        }
+        return 1ULL << i;
+}
+
+/* From bgzf.c */
+typedef struct
+{
+    uint64_t uaddr;  // offset w.r.t. uncompressed data
+    uint64_t caddr;  // offset w.r.t. compressed data
+}
+bgzidx1_t;
+
+/* Identity of a file. The mtime and size are part of the
+ * identity so that data cached for a .gz file which has been rewritten in
+ * place is never returned.
+ */
+struct file_id {
+        uint64_t dev;
+        uint64_t ino;
+        int64_t mtime;
+        int64_t size;
+};
+
+/* The block index of a compressed file as read from its .gz.gzi file.
+ * Entry 0 is always the implicit first block at offset 0.
+ *
+ * Indexes are immutable once loaded and are shared by every handle that
+ * has the file open. They are kept in the index cache, looked up by the
+ * path of the .gz.gzi file and validated against its identity, so a
+ * changed index file is reloaded on the next open.
+ * Indexes that are no longer used by any handle stay cached, in LRU
+ * order, until the idle indexes exceed index_cache_size bytes.
+ */
+struct bgzf_index {
+        struct bgzf_index *hash_next;
+        struct bgzf_index *lru_prev, *lru_next;
+        char *path;
+        struct file_id id;
+        int refcount;
+        int cached;
+        int noffs;
+        bgzidx1_t *offs;
+
+        /* Only for a plain gzip file, see write_zran_index() */
+        uint64_t usize;         /* size of the uncompressed data */
+        uint8_t *bits;          /* of the byte before caddr to use */
+        unsigned char *windows; /* ZRAN_WINDOW bytes of history each */
+
+        /* Set if the index is read in place from a file in index_dir,
+         * then offs is NULL for a compact index, see
+         * write_compact_index(), and windows points into the map for a
+         * plain gzip file.
+         */
+        void *map;
+        size_t map_len;
+        const unsigned char *samples;
+        const unsigned char *data;
+        size_t data_len;
+
+        /* Sampled reads of each entry, see count_heat() */
+        uint32_t *heat;
+};
+
+/* The compressed formats that files are shown uncompressed from. The
+ * compressed data of <file> is in <file><suffix> and its blocks are
+ * listed in <file><index_suffix>, or in the compressed file itself for a
+ * format that has no index_suffix, from which load_index() makes a
+ * bgzf_index. Everything past that, the block cache, readahead and the
+ * parallel reads, only sees blocks at compressed offsets and works the
+ * same for all of them.
+ * block_size() returns the size of the block at the start of buf, with
+ * *ulen set to the size of its data or to UINT32_MAX if the block does
+ * not say, 0 at the end of the data or -1 if it is not a valid block.
+ * decompress() returns the size of the data, or -EBADMSG if it does not
+ * match its checksum and -EIO if it is corrupt otherwise.
+ * Blocks of every format are at most BGZF_MAX_BLOCK_SIZE, both
+ * compressed and decompressed.
+ */
+struct format {
+        const char *name;
+        const char *suffix;
+        const char *index_suffix;
+        ssize_t (*block_size)(const unsigned char *buf, size_t len,
+                              uint32_t *ulen);
+        ssize_t (*decompress)(const unsigned char *in, size_t in_len,
+                              unsigned char *out, size_t out_len);
+        struct bgzf_index *(*load_index)(const char *path);
+        int (*has_index)(const char *path);
+};
+
+static ssize_t bgzf_block(const unsigned char *buf, size_t len,
+                          uint32_t *ulen);
+static ssize_t bgzf_decompress(const unsigned char *in, size_t in_len,
+                               unsigned char *out, size_t out_len);
+#ifdef HAVE_ZSTD
+static ssize_t zstd_block(const unsigned char *buf, size_t len,
+                          uint32_t *ulen);
+static ssize_t zstd_decompress(const unsigned char *in, size_t in_len,
+                               unsigned char *out, size_t out_len);
+static struct bgzf_index *load_seek_table(const char *path);
+static int has_seek_table(const char *path);
+#endif
+
+static const struct format formats[] = {
+        { "bgzf", ".gz", ".gz.gzi", bgzf_block, bgzf_decompress,
+          NULL, NULL },
+#ifdef HAVE_ZSTD
+        { "zstd", ".zst", NULL, zstd_block, zstd_decompress,
+          load_seek_table, has_seek_table },
+#endif
+        { NULL }
+};
+
+/* Plain gzip files and built indexes are BGZF only */
+#define FORMAT_BGZF (&formats[0])
+
+static int has_suffix(const char *name, const char *suffix)
+{
+        size_t len = strlen(name), slen = strlen(suffix);
+
+        return len > slen && !strcmp(name + len - slen, suffix);
+}
+
+/* The format whose compressed file, or index file if index is set, name
+ * is, or NULL.
+ */
+static const struct format *name_format(const char *name, int index)
+{
+        const struct format *fmt;
+
+        for (fmt = formats; fmt->name; fmt++) {
+                const char *suffix = index ? fmt->index_suffix : fmt->suffix;
+
+                if (suffix && has_suffix(name, suffix)) {
+                        return fmt;
+                }
+        }
+        return NULL;
+}
+
+/* With --build-index every .gz file is shown uncompressed and the files
+ * that have no .gz.gzi get an index built on first access, which is kept
+ * in index_dir. A BGZF file is indexed by walking its block headers. A
+ * plain gzip file is inflated once by a background thread, which saves a
+ * checkpoint every ZRAN_SPAN bytes with the history that inflate needs
+ * to restart from it; until then it is read sequentially.
+ */
+#define ZRAN_SPAN (1024 * 1024)
+#define ZRAN_WINDOW 32768
+#define ZRAN_CHUNK 65536        /* what a span is cached in */
+
+enum {INDEX_BGZF, INDEX_ZRAN};
+
+static int build_indexes;
+static int compact_indexes = 1;
+static char index_dir[PATH_MAX];
+static unsigned index_builds_done;
+
+#define INDEX_CACHE_BUCKETS 4096
+#define DEFAULT_INDEX_CACHE_SIZE (64 * 1024 * 1024)
+
+static size_t index_cache_size = DEFAULT_INDEX_CACHE_SIZE;
+static pthread_mutex_t index_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct bgzf_index *index_cache[INDEX_CACHE_BUCKETS];
+static struct bgzf_index *index_lru_head, *index_lru_tail;
+static size_t index_idle_size;
+
+/* An index that a thread is loading, the others that want it wait for
+ * that, see get_index(). Protected by index_cache_mutex.
+ */
+struct index_load {
+        struct index_load *next;
+        char *path;
+        int done;
+        int waiters;
+        struct bgzf_index *idx;
+};
+
+static struct index_load *index_loads;
+static pthread_cond_t index_load_cond = PTHREAD_COND_INITIALIZER;
+
+/* Inflates a gzip file from the start, for reads before it is indexed */
+#define GZ_STREAM_INPUT 65536
+
+/* The inflate state and the input buffer are only set up by the first
+ * read, and dropped again once the index is there, so a handle that is
+ * not read from costs next to nothing.
+ */
+struct gz_stream {
+        z_stream zs;
+        uint64_t in_pos;        /* offset in the .gz of the next input */
+        uint64_t uaddr;         /* offset of the next byte inflated */
+        int eof;
+        int started;
+        unsigned char *in;      /* GZ_STREAM_INPUT bytes */
+};
+
+/* An open file. For a bgzip file fd is the compressed file in format fmt
+ * and idx is its index, otherwise idx is NULL and fd is the file itself.
+ * Handles get fd from their source, see pin_file(). A gzip file that is
+ * still being indexed has a stream instead, and idx is set once the index
+ * has been built.
+ * Only the readahead state is modified after open, so reads on the same
+ * handle can run in parallel.
+ * Files are refcounted since readahead jobs may still be using the file
+ * after it has been released.
+ */
+struct file {
+        const struct format *fmt;
+        struct bgzf_index *idx;
+        int fd;
+        int refcount;
+        struct source *src;     /* NULL if fd is our own */
+        struct file *next_free; /* in the slab */
+        struct file_id id;
+        int backing_id;         /* kernel passthrough, 0 if not used */
+        struct gz_stream *stream;
+        char *built_index;      /* where the index of stream will be */
+
+        int pool_jobs;          /* jobs running, protected by pool_mutex */
+        int ra_gen;             /* bumped to cancel queued readahead */
+
+        /* readahead and stream state, protected by mutex */
+        pthread_mutex_t mutex;
+        unsigned builds_seen;   /* index_builds_done when last checked */
+        uint64_t ra_last_end;   /* end of the previous read */
+        int ra_window;          /* index entries to prefetch, 0 if random */
+        int ra_next;            /* first index entry not yet prefetched */
+};
+
+/* A block that a thread is decompressing. Others that miss on it wait
+ * for that instead of decompressing it again, and get a reference to the
+ * result, or NULL if it failed.
+ */
+struct inflight_block {
+        struct inflight_block *next;
+        struct file_id id;
+        uint64_t caddr;
+        int done;
+        int waiters;
+        struct cached_block *blk;
+};
+
+/* A decompressed BGZF block in the block cache.
+ * Blocks are refcounted. The cache itself holds one reference for as long
+ * as the block is linked into a shard, and every reader holds one while it
+ * copies data out of the block.
+ */
+struct cached_block {
+        struct cached_block *hash_next;
+        struct cached_block *lru_prev, *lru_next;
+        struct file_id id;
+        uint64_t caddr;     /* offset of the block in the compressed file */
+        uint32_t clen;      /* size of the compressed block */
+        uint32_t ulen;      /* size of the uncompressed data */
+        int refcount;
+        uint8_t disk;       /* written to, or read from, the disk cache */
+        uint8_t pinned;     /* never evicted, see block_pinned() */
+        unsigned char data[];
+};
+
+/* The block cache is split into shards, each with its own lock and LRU
+ * list, so that concurrent FUSE threads rarely contend on the same mutex.
+ * Pinned blocks stay on the LRU list but are moved back to the head when
+ * they reach the tail, and may take up to half of the shard.
+ */
+#define BLOCK_CACHE_SHARDS 16
+
+struct cache_shard {
+        pthread_mutex_t mutex;
+        struct cached_block **buckets;
+        size_t num_buckets;
+        struct cached_block *lru_head, *lru_tail;
+        size_t size;
+        size_t max_size;
+        size_t pinned_size;     /* of the blocks in size that are pinned */
+        struct inflight_block *inflight;
+        pthread_cond_t inflight_cond;
+};
+
+#define DEFAULT_BLOCK_CACHE_SIZE (128 * 1024 * 1024)
+
+static size_t block_cache_size = DEFAULT_BLOCK_CACHE_SIZE;
+static struct cache_shard block_cache[BLOCK_CACHE_SHARDS];
+
+/* A batch of n independent jobs, fn(arg, 0) .. fn(arg, n - 1), shared
+ * between the thread that submits it and any idle inflate workers.
+ * Jobs are handed out through the next counter so whoever is free picks
+ * up the next one, and the submitter always takes part itself so a batch
+ * completes even if all workers are busy.
+ *
+ * Workers take one job at a time. Batches that a read is waiting for are
+ * served before any readahead, and within a class the batch of the file
+ * with the fewest jobs running goes first, so a large scan can not hold
+ * all workers while other readers wait.
+ */
+enum {
+        PRIO_DEMAND,
+        PRIO_BACKGROUND,
+        NUM_PRIOS
+};
+
+struct batch {
+        struct batch *next;     /* on the worker queue */
+        void (*fn)(void *arg, int i);
+        void *arg;
+        int n;
+        int job;                /* next job to hand out */
+        int prio;
+        struct file *owner;     /* for fairness, may be NULL */
+        int users;              /* workers currently running jobs */
+        int queued;
+        int detached;           /* nobody waits, freed by the last worker */
+        void (*destructor)(void *arg);
+        pthread_cond_t done;
+};
+
+/* Reads that span at least this many index entries are inflated in
+ * parallel by the worker pool.
+ */
+#define PARALLEL_MIN_BLOCKS 4
+
+/* Readahead starts with this many index entries once sequential access
+ * is detected and doubles, up to max_readahead, every time a read hits
+ * data that was prefetched.
+ */
+#define MIN_READAHEAD 4
+#define DEFAULT_MAX_READAHEAD 32
+
+static int max_readahead = DEFAULT_MAX_READAHEAD;
+
+/* Workers only look this far down a queue for the fairest batch */
+#define POOL_SCAN 16
+
+static int inflate_threads = -1;
+static cpu_set_t inflate_cpus;  /* empty to not pin the workers */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct batch *pool_head[NUM_PRIOS], *pool_tail[NUM_PRIOS];
+static int background_jobs;     /* readahead jobs the workers are running */
+
+static char *logfile;
+
+/* The results of need_bgzip_uncompress() and the uncompressed file sizes
+ * are looked up on every getattr, open and readdir entry, so they are kept
+ * in read-mostly hash tables with striped rwlocks. A hit only takes a
+ * shared lock and copies the value out, without allocating anything.
+ */
+#define LOOKUP_CACHE_STRIPES 64
+
+struct lookup_entry {
+        struct lookup_entry *next;
+        int64_t value;
+        char key[];
+};
+
+struct lookup_stripe {
+        pthread_rwlock_t lock;
+        struct lookup_entry **buckets;
+        size_t num_buckets;
+        size_t num_entries;
+};
+
+struct lookup_cache {
+        struct lookup_stripe stripes[LOOKUP_CACHE_STRIPES];
+};
+
+static struct lookup_cache nu_cache;
+static struct lookup_cache size_cache;
+
+/* Sizes are persisted in file_size.tdb, together with the rest of a
+ * snapshot of the metadata that is expensive to work out after a restart.
+ * The database is read at startup and updates are written back to it by
+ * a background thread so a getattr never waits for TDB.
+ *
+ * Each kind of record has its own key prefix, all values are int64.
+ */
+#define DB_SIZE "s:"    /* s:<path>:<ino>:<mtime>:<size> of the .gz file */
+#define DB_CLASS "c:"   /* c:<path>, see need_bgzip_uncompress() */
+#define DB_HOT "h:"     /* h:<path>, the minute it was last opened */
+
+#define SIZE_KEY_MAX (PATH_MAX + 64)
+
+/* Recently opened files are forgotten after 30 days */
+#define HOT_EXPIRY_MINUTES (30 * 24 * 60)
+
+struct size_update {
+        struct size_update *next;
+        int64_t size;
+        char key[];
+};
+
+static struct tdb_context *filesize_tdb;
+static pthread_mutex_t size_update_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t size_update_cond = PTHREAD_COND_INITIALIZER;
+static struct size_update *size_updates;
+static int size_writer_running;
+static int use_size_db = 1;
+
+/* The classifications from the snapshot, checked before they are used */
+static struct lookup_cache nu_snapshot;
+
+/* The minute that files were opened, for --prewarm */
+struct hot_file {
+        int64_t minute;
+        char *path;
+};
+
+static struct lookup_cache hot_cache;
+static struct hot_file *hot_files;
+static int num_hot_files, max_hot_files;
+static int prewarm;
+
+static char *mountpoint;
+
+/* descriptor for the underlying directory */
+static int dir_fd;
+
+/* Every inode the kernel knows about. The node ID handed to the kernel is
+ * the address of the inode, except for the root which is FUSE_ROOT_ID.
+ * The kernel holds nlookup references, one for every lookup or readdirplus
+ * entry that returned the inode, and drops them with forget. Inodes are
+ * hashed by path so that looking up the same name again returns the same
+ * node.
+ */
+struct inode {
+        struct inode *hash_next;
+        uint64_t nlookup;
+        int bgzip;              /* 1 if shown uncompressed, -1 if unknown */
+
+        /* The uncompressed size last worked out for the .gz file attr_id,
+         * protected by the attr lock of the inode. attr_gen is bumped
+         * whenever it may have become stale.
+         */
+        unsigned attr_gen;
+        int attr_valid;
+        struct file_id attr_id;
+        off_t attr_size;
+
+        char path[];            /* relative to dir_fd, "." for the root */
+};
+
+#define ATTR_LOCKS 64
+
+static pthread_mutex_t attr_locks[ATTR_LOCKS];
+
+static pthread_mutex_t inode_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct inode **inode_table;
+static size_t inode_table_size;
+static size_t num_inodes;
+static struct inode *root_inode;
+
+static struct fuse_session *session;
+
+/* How long the kernel may cache lookups and attributes */
+static double entry_timeout = 1.0;
+static double attr_timeout = 1.0;
+static double negative_timeout;
+
+static uint32_t hash_path(const char *path)
+{
+        uint32_t h = 2166136261U;
+
+        while (*path) {
+                h ^= (unsigned char)*path++;
+                h *= 16777619;
+        }
+        return h;
+}
+
+static void lookup_cache_init(struct lookup_cache *c)
+{
+        int i;
+
+        for (i = 0; i < LOOKUP_CACHE_STRIPES; i++) {
+                struct lookup_stripe *stripe = &c->stripes[i];
+
+                pthread_rwlock_init(&stripe->lock, NULL);
+                stripe->num_buckets = 256;
+                stripe->buckets = calloc(stripe->num_buckets,
+                                         sizeof(stripe->buckets[0]));
+                if (stripe->buckets == NULL) {
+                        fprintf(stderr, "Failed to allocate lookup cache\n");
+                        exit(1);
+                }
+        }
+}
+
+static struct lookup_entry **lookup_bucket(struct lookup_stripe *stripe,
+                                           uint32_t hash)
+{
+        return &stripe->buckets[(hash / LOOKUP_CACHE_STRIPES) &
+                                (stripe->num_buckets - 1)];
+}
+
+/* Returns 0 and the value for key, or -1 if it is not cached. */
+static int lookup_cache_get(struct lookup_cache *c, const char *key,
+                            int64_t *value)
+{
+        uint32_t hash = hash_path(key);
+        struct lookup_stripe *stripe = &c->stripes[hash % LOOKUP_CACHE_STRIPES];
+        struct lookup_entry *e;
+        int ret = -1;
+
+        pthread_rwlock_rdlock(&stripe->lock);
+        for (e = *lookup_bucket(stripe, hash); e; e = e->next) {
+                if (!strcmp(e->key, key)) {
+                        *value = e->value;
+                        ret = 0;
+                        break;
+                }
+        }
+        pthread_rwlock_unlock(&stripe->lock);
+        return ret;
+}
+
+/* Must be called with the stripe write locked */
+static void lookup_stripe_grow(struct lookup_stripe *stripe)
+{
+        struct lookup_entry **old = stripe->buckets;
+        size_t i, num = stripe->num_buckets;
+
+        stripe->buckets = calloc(num * 2, sizeof(stripe->buckets[0]));
+        if (stripe->buckets == NULL) {
+                /* Keep going with longer chains */
+                stripe->buckets = old;
+                return;
+        }
+        stripe->num_buckets = num * 2;
+        for (i = 0; i < num; i++) {
+                while (old[i]) {
+                        struct lookup_entry *e = old[i];
+                        struct lookup_entry **bucket;
+
+                        old[i] = e->next;
+                        bucket = lookup_bucket(stripe, hash_path(e->key));
+                        e->next = *bucket;
+                        *bucket = e;
+                }
+        }
+        free(old);
+}
+
+static void lookup_cache_set(struct lookup_cache *c, const char *key,
+                             int64_t value)
+{
+        uint32_t hash = hash_path(key);
+        struct lookup_stripe *stripe = &c->stripes[hash % LOOKUP_CACHE_STRIPES];
+        struct lookup_entry *e, **bucket;
+
+        pthread_rwlock_wrlock(&stripe->lock);
+        bucket = lookup_bucket(stripe, hash);
+        for (e = *bucket; e; e = e->next) {
+                if (!strcmp(e->key, key)) {
+                        e->value = value;
+                        pthread_rwlock_unlock(&stripe->lock);
+                        return;
+                }
+        }
+        e = malloc(sizeof(*e) + strlen(key) + 1);
+        if (e == NULL) {
+                pthread_rwlock_unlock(&stripe->lock);
+                return;
+        }
+        strcpy(e->key, key);
+        e->value = value;
+        e->next = *bucket;
+        *bucket = e;
+        if (++stripe->num_entries > 2 * stripe->num_buckets) {
+                lookup_stripe_grow(stripe);
+        }
+        pthread_rwlock_unlock(&stripe->lock);
+}
+
+static void lookup_cache_del(struct lookup_cache *c, const char *key)
+{
+        uint32_t hash = hash_path(key);
+        struct lookup_stripe *stripe = &c->stripes[hash % LOOKUP_CACHE_STRIPES];
+        struct lookup_entry **pp;
+
+        pthread_rwlock_wrlock(&stripe->lock);
+        for (pp = lookup_bucket(stripe, hash); *pp; pp = &(*pp)->next) {
+                if (!strcmp((*pp)->key, key)) {
+                        struct lookup_entry *e = *pp;
+
+                        *pp = e->next;
+                        free(e);
+                        stripe->num_entries--;
+                        break;
+                }
+        }
+        pthread_rwlock_unlock(&stripe->lock);
+}
+
+static void lookup_cache_clear(struct lookup_cache *c)
+{
+        size_t i;
+        int j;
+
+        for (j = 0; j < LOOKUP_CACHE_STRIPES; j++) {
+                struct lookup_stripe *stripe = &c->stripes[j];
+
+                pthread_rwlock_wrlock(&stripe->lock);
+                for (i = 0; i < stripe->num_buckets; i++) {
+                        while (stripe->buckets[i]) {
+                                struct lookup_entry *e = stripe->buckets[i];
+
+                                stripe->buckets[i] = e->next;
+                                free(e);
+                        }
+                }
+                stripe->num_entries = 0;
+                pthread_rwlock_unlock(&stripe->lock);
+        }
+}
+
+static void add_hot_file(const char *path, int64_t minute)
+{
+        struct hot_file *h;
+        int max;
+
+        lookup_cache_set(&hot_cache, path, minute);
+        if (!prewarm) {
+                return;
+        }
+        if (num_hot_files == max_hot_files) {
+                max = max_hot_files ? max_hot_files * 2 : 256;
+                h = realloc(hot_files, max * sizeof(*h));
+                if (h == NULL) {
+                        return;
+                }
+                hot_files = h;
+                max_hot_files = max;
+        }
+        h = &hot_files[num_hot_files];
+        h->path = strdup(path);
+        if (h->path) {
+                h->minute = minute;
+                num_hot_files++;
+        }
+}
+
+static int load_size_entry(struct tdb_context *tdb, TDB_DATA key,
+                           TDB_DATA data, void *private_data)
+{
+        int64_t minute = time(NULL) / 60;
+        char name[SIZE_KEY_MAX];
+        off_t val;
+
+        if (data.dsize != sizeof(off_t) || key.dsize >= sizeof(name)) {
+                return 0;
+        }
+        memcpy(name, key.dptr, key.dsize);
+        name[key.dsize] = 0;
+        val = *(off_t *)data.dptr;
+        if (!strncmp(name, DB_SIZE, 2)) {
+                lookup_cache_set(&size_cache, name, val);
+        } else if (!strncmp(name, DB_CLASS, 2)) {
+                lookup_cache_set(&nu_snapshot, name + 2, val);
+        } else if (!strncmp(name, DB_HOT, 2) &&
+                   val > minute - HOT_EXPIRY_MINUTES) {
+                add_hot_file(name + 2, val);
+        } else {
+                /* Expired, or a size keyed by the basename, which is
+                 * what older versions did.
+                 */
+                tdb_delete(tdb, key);
+        }
+        return 0;
+}
+
+static void load_size_db(void)
+{
+        int count;
+
+        count = tdb_traverse(filesize_tdb, load_size_entry, NULL);
+        LOG_INFO("Loaded %d records from the size database\n", count);
+}
+
+/* Write all queued size updates to the database in one transaction */
+static void flush_size_updates(struct size_update *list)
+{
+        struct size_update *oldest = NULL;
+
+        if (list == NULL) {
+                return;
+        }
+        /* Updates are queued newest first, the last write must win */
+        while (list) {
+                struct size_update *u = list;
+
+                list = u->next;
+                u->next = oldest;
+                oldest = u;
+        }
+        list = oldest;
+        tdb_transaction_start(filesize_tdb);
+        while (list) {
+                struct size_update *u = list;
+                TDB_DATA key, data;
+                off_t size = u->size;
+
+                list = u->next;
+                key.dptr = (uint8_t *)u->key;
+                key.dsize = strlen(u->key);
+                data.dptr = (uint8_t *)&size;
+                data.dsize = sizeof(size);
+                tdb_store(filesize_tdb, key, data, TDB_REPLACE);
+                free(u);
+        }
+        tdb_transaction_commit(filesize_tdb);
+}
+
+static void *size_writer(void *arg)
+{
+        struct size_update *list;
+
+        pthread_mutex_lock(&size_update_mutex);
+        while (1) {
+                while (size_updates == NULL) {
+                        pthread_cond_wait(&size_update_cond,
+                                          &size_update_mutex);
+                }
+                list = size_updates;
+                size_updates = NULL;
+                pthread_mutex_unlock(&size_update_mutex);
+
+                flush_size_updates(list);
+
+                pthread_mutex_lock(&size_update_mutex);
+        }
+        return NULL;
+}
+
+static void start_size_writer(void)
+{
+        pthread_t thread;
+
+        if (filesize_tdb == NULL) {
+                return;
+        }
+        if (pthread_create(&thread, NULL, size_writer, NULL) == 0) {
+                pthread_detach(thread);
+                size_writer_running = 1;
+        }
+}
+
+/* Queue a record to be persisted */
+static void store_db(const char *key, int64_t val)
+{
+        struct size_update *u;
+
+        if (filesize_tdb == NULL) {
+                return;
+        }
+
+        u = malloc(sizeof(*u) + strlen(key) + 1);
+        if (u == NULL) {
+                return;
+        }
+        strcpy(u->key, key);
+        u->size = val;
+        pthread_mutex_lock(&size_update_mutex);
+        u->next = size_updates;
+        size_updates = u;
+        if (!size_writer_running) {
+                /* No writer thread, write it out ourself */
+                size_updates = NULL;
+                pthread_mutex_unlock(&size_update_mutex);
+                flush_size_updates(u);
+                return;
+        }
+        pthread_cond_signal(&size_update_cond);
+        pthread_mutex_unlock(&size_update_mutex);
+}
+
+/* Cache a size and queue it to be persisted */
+static void store_size(const char *key, int64_t size)
+{
+        lookup_cache_set(&size_cache, key, size);
+        store_db(key, size);
+}
+
+/* Remember that path was opened, at most once a minute */
+static void store_hot_file(const char *path)
+{
+        char key[SIZE_KEY_MAX];
+        int64_t minute = time(NULL) / 60, old;
+
+        if (filesize_tdb == NULL ||
+            (lookup_cache_get(&hot_cache, path, &old) == 0 &&
+             old == minute)) {
+                return;
+        }
+        lookup_cache_set(&hot_cache, path, minute);
+        snprintf(key, sizeof(key), DB_HOT "%s", path);
+        store_db(key, minute);
+}
+
+/* Strip a trailing .gzi and then the suffix of a format from file, giving
+ * the name of the uncompressed file that a compressed file or index
+ * belongs to.
+ */
+static void strip_bgzip_suffix(const char *file, char *stripped)
+{
+        const struct format *fmt;
+        size_t len;
+
+        snprintf(stripped, PATH_MAX, "%s", file);
+        len = strlen(stripped);
+        if (len > 4 && !strcmp(stripped + len - 4, ".gzi")) {
+                stripped[len -= 4] = 0;
+        }
+        fmt = name_format(stripped, 0);
+        if (fmt) {
+                stripped[len - strlen(fmt->suffix)] = 0;
+        }
+}
+
+/* Cached lookups only stay valid while the directory they were made in
+ * is watched with inotify. watch_paths maps inotify watch descriptors
+ * back to the directory, relative to dir_fd, and watched_dirs holds the
+ * directories that already have a watch.
+ */
+static int watch_changes = 1;
+static int inotify_fd = -1;
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char **watch_paths;
+static int num_watch_paths;
+static struct lookup_cache watched_dirs;
+
+static void watch_dir(const char *dir)
+{
+        char proc_path[PATH_MAX + 32];
+        int64_t val;
+        int wd;
+
+        if (inotify_fd == -1) {
+                return;
+        }
+        if (lookup_cache_get(&watched_dirs, dir, &val) == 0) {
+                return;
+        }
+
+        /* The directory is hidden under our own mountpoint, so go through
+         * the descriptor we hold for the underlying directory.
+         */
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d/%s",
+                 dir_fd, dir);
+        wd = inotify_add_watch(inotify_fd, proc_path,
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                               IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB |
+                               IN_ONLYDIR);
+        if (wd == -1) {
+                LOG_INFO("WATCH_DIR [%s] %s\n", dir, strerror(errno));
+                return;
+        }
+
+        pthread_mutex_lock(&watch_mutex);
+        if (wd >= num_watch_paths) {
+                int num = (wd + 1) * 2;
+                char **paths = realloc(watch_paths, num * sizeof(char *));
+
+                if (paths == NULL) {
+                        pthread_mutex_unlock(&watch_mutex);
+                        return;
+                }
+                memset(paths + num_watch_paths, 0,
+                       (num - num_watch_paths) * sizeof(char *));
+                watch_paths = paths;
+                num_watch_paths = num;
+        }
+        free(watch_paths[wd]);
+        watch_paths[wd] = strdup(dir);
+        pthread_mutex_unlock(&watch_mutex);
+        lookup_cache_set(&watched_dirs, dir, wd);
+}
+
+static void watch_parent_dir(const char *path)
+{
+        char dir[PATH_MAX];
+        char *ptr;
+
+        snprintf(dir, PATH_MAX, "%s", path);
+        ptr = strrchr(dir, '/');
+        if (ptr == NULL) {
+                watch_dir(".");
+                return;
+        }
+        *ptr = 0;
+        watch_dir(dir);
+}
+
+static void set_file_id(struct file_id *id, const struct stat *st)
+{
+        id->dev = st->st_dev;
+        id->ino = st->st_ino;
+        id->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 +
+                st->st_mtim.tv_nsec;
+        id->size = st->st_size;
+}
+
+static int same_file_id(const struct file_id *a, const struct file_id *b)
+{
+        return a->dev == b->dev && a->ino == b->ino &&
+                a->mtime == b->mtime && a->size == b->size;
+}
+
+static uint64_t hash_block(const struct file_id *id, uint64_t caddr)
+{
+        uint64_t h = id->dev * 0x9e3779b97f4a7c15ULL;
+
+        h ^= id->ino + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h ^= caddr + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+}
+
+static int64_t file_id_digest(const struct file_id *id)
+{
+        uint64_t h = hash_block(id, id->mtime);
+
+        return h ^ ((uint64_t)id->size * 0x9e3779b97f4a7c15ULL);
+}
+
+static void store_need_uncompress(const char *file, uint8_t val)
+{
+        lookup_cache_set(&nu_cache, file, val);
+}
+
+/* A classification only depends on which names exist in the directory of
+ * the file, so the snapshot stores it with a digest of the directory,
+ * whose mtime changes whenever a name is added or removed. Returns the
+ * digest shifted up to make room for the classification, or 0 if the
+ * directory can not be looked at.
+ */
+static uint64_t classify_digest(const char *file)
+{
+        char dir[PATH_MAX];
+        struct file_id id;
+        struct stat st;
+        char *ptr;
+
+        snprintf(dir, PATH_MAX, "%s", file);
+        ptr = strrchr(dir, '/');
+        if (ptr) {
+                *ptr = 0;
+        } else {
+                strcpy(dir, ".");
+        }
+        if (fstatat(dir_fd, dir, &st, AT_NO_AUTOMOUNT) == -1) {
+                return 0;
+        }
+        set_file_id(&id, &st);
+        return ((uint64_t)file_id_digest(&id) + build_indexes) << 1;
+}
+
+/* This function takes a path to a file and returns true if this needs
+ * bgzip unpacking.
+ * For a file <file> we need to unpack the file if
+ *   <file>        does not exist
+ *   <file>.gz     exists
+ *   <file>.gz.gzi exists
+ * In that situation READDIR will just turn a single instance for the name
+ * <file> and hide the entries for <file>.gz and <file>.gz.gzi
+ * With --build-index <file>.gz.gzi does not have to exist.
+ * The same goes for the other formats, where a seekable <file>.zst has its
+ * seek table in the file itself and is shown as <file> on its own.
+ *
+ * IF all three files exist, we do not mutate any of the READDIR data
+ * and return all three names. Then we just redirect all I/O to the unpacked
+ * file. The reason we do not hide the <file>.gz and <file>.gz.gzi is to make
+ * it possible for the user to see that something is odd/wrong and possibly
+ * take action. (action == delete the unpacked file, it is redundant.)
+ */
+static int need_bgzip_uncompress(const char *file) {
+        const struct format *fmt;
+        char stripped[PATH_MAX];
+        char tmp[SIZE_KEY_MAX];
+        uint64_t digest = 0;
+        struct stat st;
+        int64_t val;
+        uint8_t ret;
+
+        LOG("NEED_BGZIP_UNCOMPRESS [%s]\n", file);
+        if (lookup_cache_get(&nu_cache, file, &val) == 0) {
+                count_stat(STAT_CLASSIFY_HITS, 1);
+                return val;
+        }
+
+        watch_parent_dir(file);
+        if (filesize_tdb) {
+                /* Before we look, so a change while we do is noticed */
+                digest = classify_digest(file);
+        }
+        if (digest && lookup_cache_get(&nu_snapshot, file, &val) == 0 &&
+            ((uint64_t)val & ~1ULL) == digest) {
+                count_stat(STAT_SNAPSHOT_HITS, 1);
+                store_need_uncompress(file, val & 1);
+                return val & 1;
+        }
+
+        LOG("NEED_BGZIP_UNCOMPRESS SLOW PATH [%s]\n", file);
+        count_stat(STAT_CLASSIFY_SLOW, 1);
+        strip_bgzip_suffix(file, stripped);
+
+        ret = 0;
+        if (fstatat(dir_fd, stripped, &st, AT_NO_AUTOMOUNT) == 0) {
+                goto finished;
+        }
+        for (fmt = formats; fmt->name && !ret; fmt++) {
+                snprintf(tmp, PATH_MAX, "%s%s", stripped, fmt->suffix);
+                if (fstatat(dir_fd, tmp, &st, AT_NO_AUTOMOUNT) != 0) {
+                        continue;
+                }
+                if (fmt->index_suffix == NULL) {
+                        ret = fmt->has_index(tmp);
+                        continue;
+                }
+                snprintf(tmp, PATH_MAX, "%s%s", stripped, fmt->index_suffix);
+                ret = build_indexes ||
+                      fstatat(dir_fd, tmp, &st, AT_NO_AUTOMOUNT) == 0;
+        }
+
+finished:
+        store_need_uncompress(file, ret);
+        if (digest) {
+                lookup_cache_set(&nu_snapshot, file, digest | ret);
+                snprintf(tmp, sizeof(tmp), DB_CLASS "%s", file);
+                store_db(tmp, digest | ret);
+        }
+        return ret;
+}
+
+/* What an index costs while it is cached. A mapped one only takes page
+ * cache that the kernel can reclaim, plus the mapping itself.
+ */
+static size_t index_size(const struct bgzf_index *idx)
+{
+        size_t size = sizeof(*idx);
+
+        if (idx->offs) {
+                size += idx->noffs * sizeof(bgzidx1_t);
+        }
+        if (idx->bits) {
+                size += idx->noffs;
+        }
+        if (idx->heat) {
+                size += idx->noffs * sizeof(uint32_t);
+        }
+        if (idx->map) {
+                size += 4096;
+        } else if (idx->windows) {
+                size += (size_t)idx->noffs * ZRAN_WINDOW;
+        }
+        return size;
+}
+
+static void free_index(struct bgzf_index *idx)
+{
+        free(idx->path);
+        free(idx->offs);
+        free(idx->bits);
+        free(idx->heat);
+        if (idx->map) {
+                munmap(idx->map, idx->map_len);
+        } else {
+                free(idx->windows);
+        }
+        free(idx);
+}
+
+/* Read the checkpoints of a plain gzip file, as written by
+ * write_zran_index(), into a new, uncached, bgzf_index.
+ *
+ * The file consists of the number of checkpoints and the size of the
+ * uncompressed data, then for each checkpoint its compressed offset,
+ * uncompressed offset and the number of bits of the byte before the
+ * compressed offset that belong to it, and then the ZRAN_WINDOW bytes of
+ * history of each checkpoint. All numbers are 8 bytes little endian.
+ */
+static struct bgzf_index *load_zran_index(const char *path)
+{
+        struct bgzf_index *idx = NULL;
+        uint64_t hdr[2], *buf = NULL;
+        struct stat st;
+        uint64_t count;
+        int fd, i;
+
+        LOG("LOAD_ZRAN_INDEX [%s]\n", path);
+
+        fd = openat(dir_fd, path, O_RDONLY);
+        if (fd == -1) {
+                return NULL;
+        }
+        if (fstat(fd, &st) == -1 ||
+            pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+                goto finished;
+        }
+        count = le64toh(hdr[0]);
+        if (count == 0 || count >= INT32_MAX ||
+            (uint64_t)st.st_size != sizeof(hdr) + count * (24 + ZRAN_WINDOW)) {
+                LOG_ERROR("LOAD_ZRAN_INDEX [%s] invalid index file\n", path);
+                goto finished;
+        }
+        buf = malloc(count * 24);
+        idx = calloc(1, sizeof(*idx));
+        if (buf == NULL || idx == NULL) {
+                free(idx);
+                idx = NULL;
+                goto finished;
+        }
+        idx->path = strdup(path);
+        idx->noffs = count;
+        idx->offs = malloc(count * sizeof(bgzidx1_t));
+        idx->bits = malloc(count);
+        /* The windows are the bulk of it and are only used on a miss */
+        idx->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (idx->map == MAP_FAILED) {
+                idx->map = NULL;
+        } else {
+                idx->map_len = st.st_size;
+                idx->windows = (unsigned char *)idx->map + sizeof(hdr) +
+                        count * 24;
+        }
+        if (idx->path == NULL || idx->offs == NULL || idx->bits == NULL ||
+            idx->map == NULL ||
+            pread(fd, buf, count * 24, sizeof(hdr)) != (ssize_t)(count * 24)) {
+                free_index(idx);
+                idx = NULL;
+                goto finished;
+        }
+        set_file_id(&idx->id, &st);
+        idx->usize = le64toh(hdr[1]);
+        for (i = 0; i < idx->noffs; i++) {
+                idx->offs[i].caddr = le64toh(buf[3 * i]);
+                idx->offs[i].uaddr = le64toh(buf[3 * i + 1]);
+                idx->bits[i] = le64toh(buf[3 * i + 2]);
+        }
+
+finished:
+        free(buf);
+        close(fd);
+        return idx;
+}
+
+/* A .gz.gzi of a huge file takes a long time to read and a lot of memory
+ * to keep, 16 bytes for each 64K of data. Once an index of at least
+ * COMPACT_MIN entries has been read it is also written to index_dir in
+ * a compact form that is mapped, rather than read, the next time:
+ * +------------------------------+
+ * |      "FBGZIX\0\2" magic      | 8 bytes
+ * +------------------------------+
+ * |   number of entries, noffs   | 8 bytes
+ * +------------------------------+
+ * |  number of samples, nsamples | 8 bytes
+ * +------------------------------+
+ * |     size of the data         | 8 bytes
+ * +------------------------------+
+ * |  dev, ino, mtime in ns and   | 4 x 8 bytes
+ * |    size of the .gz.gzi       |
+ * +------------------------------+
+ * followed by nsamples samples, one for every COMPACT_SAMPLE entries, of
+ * +------------------------------+
+ * |     uncompressed offset      | 8 bytes
+ * +------------------------------+
+ * |      compressed offset       | 8 bytes
+ * +------------------------------+
+ * | where the next entry starts  | 8 bytes
+ * |          in the data         |
+ * +------------------------------+
+ * and then the other entries as the difference to the entry before them.
+ * That is a varint of the zigzag encoded difference of the uncompressed
+ * offset to BGZF_BLOCK_DATA, which is 0 for all but the last block that
+ * bgzip writes, and a varint of the difference of the compressed offset,
+ * about 4 bytes per entry. All numbers are little endian.
+ * Finding an entry is a binary search of the samples followed by
+ * decoding at most COMPACT_SAMPLE - 1 entries.
+ */
+#define COMPACT_MIN 4096
+#define COMPACT_SAMPLE 64
+#define COMPACT_HEADER_SIZE 64
+#define COMPACT_SAMPLE_SIZE 24
+
+/* What bgzip puts in a block */
+#define BGZF_BLOCK_DATA 0xff00
+
+static const char compact_magic[8] = "FBGZIX\0\2";
+
+static uint64_t get_le64(const unsigned char *p)
+{
+        uint64_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return le64toh(v);
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return le32toh(v);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+        v = htole64(v);
+        memcpy(p, &v, sizeof(v));
+}
+
+static int put_varint(unsigned char *p, uint64_t v)
+{
+        int len = 0;
+
+        while (v >= 0x80) {
+                p[len++] = v | 0x80;
+                v >>= 7;
+        }
+        p[len++] = v;
+        return len;
+}
+
+/* A truncated or overlong varint reads as what was there. The file is
+ * ours and checked when it is mapped, so this only keeps a damaged one
+ * from reading past the map.
+ */
+static uint64_t get_varint(const unsigned char **p, const unsigned char *end)
+{
+        uint64_t v = 0;
+        int shift = 0;
+
+        while (*p < end && shift < 64) {
+                unsigned char c = *(*p)++;
+
+                v |= (uint64_t)(c & 0x7f) << shift;
+                if (!(c & 0x80)) {
+                        break;
+                }
+                shift += 7;
+        }
+        return v;
+}
+
+static size_t compact_samples(int noffs)
+{
+        return (noffs + COMPACT_SAMPLE - 1) / COMPACT_SAMPLE;
+}
+
+/* The entry at sample s and where the entry after it is in the data */
+static bgzidx1_t compact_sample(const struct bgzf_index *idx, size_t s,
+                                const unsigned char **p)
+{
+        const unsigned char *sample = idx->samples + s * COMPACT_SAMPLE_SIZE;
+        bgzidx1_t ent;
+
+        ent.uaddr = get_le64(sample);
+        ent.caddr = get_le64(sample + 8);
+        *p = idx->data + get_le64(sample + 16);
+        return ent;
+}
+
+static void next_compact_entry(const struct bgzf_index *idx, bgzidx1_t *ent,
+                               const unsigned char **p)
+{
+        const unsigned char *end = idx->data + idx->data_len;
+        uint64_t zz = get_varint(p, end);
+
+        ent->uaddr += BGZF_BLOCK_DATA + (int64_t)((zz >> 1) ^ -(zz & 1));
+        ent->caddr += get_varint(p, end);
+}
+
+/* Entry e of an index, whichever form it is in */
+static bgzidx1_t index_entry(const struct bgzf_index *idx, int e)
+{
+        const unsigned char *p;
+        bgzidx1_t ent;
+        int i;
+
+        if (idx->offs) {
+                return idx->offs[e];
+        }
+        ent = compact_sample(idx, e / COMPACT_SAMPLE, &p);
+        for (i = e % COMPACT_SAMPLE; i > 0; i--) {
+                next_compact_entry(idx, &ent, &p);
+        }
+        return ent;
+}
+
+/* The compact index of the .gz.gzi path, named after its identity so a
+ * changed index is not mistaken for the old one. Returns 0 if the index
+ * is too small to bother.
+ */
+static int compact_index_name(const char *path, const struct stat *st,
+                              char *name)
+{
+        if (!compact_indexes || index_dir[0] == 0 ||
+            (st->st_size - 8) / 16 + 1 < COMPACT_MIN) {
+                return 0;
+        }
+        snprintf(name, PATH_MAX, "%s/%08x-%" PRIx64 "-%" PRIx64 "-%" PRIx64
+                 ".bix", index_dir, hash_path(path), (uint64_t)st->st_ino,
+                 (uint64_t)st->st_mtim.tv_sec * 1000000000 +
+                 st->st_mtim.tv_nsec, (uint64_t)st->st_size);
+        return 1;
+}
+
+/* Map the compact index name in place of the entries of idx, which must
+ * be idx->noffs of them and made from the .gz.gzi of idx->id. idx->offs
+ * is left alone.
+ */
+static int map_compact_index(struct bgzf_index *idx, const char *name)
+{
+        const unsigned char *hdr;
+        struct stat st;
+        uint64_t nsamples, data_len, s;
+        void *map;
+        int fd;
+
+        fd = open(name, O_RDONLY);
+        if (fd == -1) {
+                return -1;
+        }
+        if (fstat(fd, &st) == -1 || st.st_size < COMPACT_HEADER_SIZE) {
+                close(fd);
+                return -1;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                return -1;
+        }
+
+        hdr = map;
+        nsamples = get_le64(hdr + 16);
+        data_len = get_le64(hdr + 24);
+        if (memcmp(hdr, compact_magic, sizeof(compact_magic)) ||
+            get_le64(hdr + 8) != (uint64_t)idx->noffs ||
+            get_le64(hdr + 32) != idx->id.dev ||
+            get_le64(hdr + 40) != idx->id.ino ||
+            get_le64(hdr + 48) != (uint64_t)idx->id.mtime ||
+            get_le64(hdr + 56) != (uint64_t)idx->id.size ||
+            nsamples != compact_samples(idx->noffs) ||
+            (uint64_t)st.st_size != COMPACT_HEADER_SIZE +
+                        nsamples * COMPACT_SAMPLE_SIZE + data_len) {
+                goto invalid;
+        }
+        idx->samples = hdr + COMPACT_HEADER_SIZE;
+        idx->data = idx->samples + nsamples * COMPACT_SAMPLE_SIZE;
+        idx->data_len = data_len;
+        for (s = 0; s < nsamples; s++) {
+                if (get_le64(idx->samples + s * COMPACT_SAMPLE_SIZE + 16) >
+                    data_len) {
+                        goto invalid;
+                }
+        }
+        idx->map = map;
+        idx->map_len = st.st_size;
+        return 0;
+
+invalid:
+        LOG_ERROR("MAP_COMPACT_INDEX [%s] invalid index file\n", name);
+        idx->samples = idx->data = NULL;
+        idx->data_len = 0;
+        munmap(map, st.st_size);
+        return -1;
+}
+
+/* Write the entries of idx as the compact index name. An index whose
+ * compressed offsets go backwards is not something bgzip writes, and is
+ * left as it is.
+ */
+static int write_compact_index(const struct bgzf_index *idx, const char *name)
+{
+        char tmp[PATH_MAX + 48];
+        unsigned char hdr[COMPACT_HEADER_SIZE], *buf, *samples, *data;
+        size_t nsamples = compact_samples(idx->noffs), len = 0;
+        int i, ret = -1, fd;
+
+        samples = malloc(nsamples * COMPACT_SAMPLE_SIZE);
+        data = malloc((size_t)idx->noffs * 20);
+        if (samples == NULL || data == NULL) {
+                goto finished;
+        }
+        for (i = 0; i < idx->noffs; i++) {
+                const bgzidx1_t *e = &idx->offs[i];
+                int64_t udelta;
+
+                if (i % COMPACT_SAMPLE == 0) {
+                        buf = samples + i / COMPACT_SAMPLE *
+                                COMPACT_SAMPLE_SIZE;
+                        put_le64(buf, e->uaddr);
+                        put_le64(buf + 8, e->caddr);
+                        put_le64(buf + 16, len);
+                        continue;
+                }
+                if (e->caddr < e[-1].caddr) {
+                        goto finished;
+                }
+                udelta = e->uaddr - e[-1].uaddr - BGZF_BLOCK_DATA;
+                len += put_varint(data + len,
+                                  ((uint64_t)udelta << 1) ^ (udelta >> 63));
+                len += put_varint(data + len, e->caddr - e[-1].caddr);
+        }
+
+        snprintf(tmp, sizeof(tmp), "%s.%d.%lx.tmp", name, (int)getpid(),
+                 (unsigned long)pthread_self());
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd == -1) {
+                LOG_ERROR("WRITE_COMPACT_INDEX failed to create %s %s\n",
+                          tmp, strerror(errno));
+                goto finished;
+        }
+        memcpy(hdr, compact_magic, sizeof(compact_magic));
+        put_le64(hdr + 8, idx->noffs);
+        put_le64(hdr + 16, nsamples);
+        put_le64(hdr + 24, len);
+        put_le64(hdr + 32, idx->id.dev);
+        put_le64(hdr + 40, idx->id.ino);
+        put_le64(hdr + 48, idx->id.mtime);
+        put_le64(hdr + 56, idx->id.size);
+        if (write(fd, hdr, sizeof(hdr)) == sizeof(hdr) &&
+            write(fd, samples, nsamples * COMPACT_SAMPLE_SIZE) ==
+                (ssize_t)(nsamples * COMPACT_SAMPLE_SIZE) &&
+            write(fd, data, len) == (ssize_t)len) {
+                ret = 0;
+        }
+        if (close(fd) == -1 || ret == -1 || rename(tmp, name) == -1) {
+                LOG_ERROR("WRITE_COMPACT_INDEX failed to write %s\n", tmp);
+                unlink(tmp);
+                ret = -1;
+        }
+
+finished:
+        free(samples);
+        free(data);
+        return ret;
+}
+
+/* Read a .gz.gzi file into a new, uncached, bgzf_index.
+ *
+ * The index file consists of
+ * +------------------------------+
+ * |            count             | 8 bytes
+ * +------------------------------+
+ * followed by count blocks of
+ * +------------------------------+
+ * |      compressed offset       | 8 bytes
+ * +------------------------------+
+ * |      uncompressed offset     | 8 bytes
+ * +------------------------------+
+ * all in little endian byteorder. The first block of the file, at offset 0
+ * in both the compressed and uncompressed data, is not stored. So just
+ * reading the last entry of the index file will give us a good (and
+ * valid) starting offset for finding the EOF and uncompressed file size.
+ * A large index is mapped from its compact form if there is one, see
+ * write_compact_index(). For a format that has no index file, path is the
+ * compressed file and the index is read from that.
+ */
+static struct bgzf_index *load_index(const char *path)
+{
+        const struct format *fmt = name_format(path, 0);
+        struct bgzf_index *idx = NULL;
+        uint64_t *buf = NULL;
+        struct stat st;
+        uint64_t count;
+        size_t len = strlen(path);
+        char compact[PATH_MAX];
+        int fd, i, use_compact;
+
+        if (len > 4 && !strcmp(path + len - 4, ".zri")) {
+                return load_zran_index(path);
+        }
+        if (fmt && fmt->load_index) {
+                return fmt->load_index(path);
+        }
+
+        LOG("LOAD_INDEX [%s]\n", path);
+
+        fd = openat(dir_fd, path, O_RDONLY);
+        if (fd == -1) {
+                return NULL;
+        }
+        if (fstat(fd, &st) == -1 || st.st_size < 8 ||
+            (st.st_size - 8) % 16) {
+                LOG_ERROR("LOAD_INDEX [%s] invalid index file\n", path);
+                goto finished;
+        }
+
+        use_compact = compact_index_name(path, &st, compact);
+        if (use_compact) {
+                idx = calloc(1, sizeof(*idx));
+                if (idx == NULL) {
+                        goto finished;
+                }
+                idx->path = strdup(path);
+                idx->noffs = (st.st_size - 8) / 16 + 1;
+                set_file_id(&idx->id, &st);
+                if (idx->path && map_compact_index(idx, compact) == 0) {
+                        LOG("LOAD_INDEX [%s] mapped %s\n", path, compact);
+                        goto finished;
+                }
+                free_index(idx);
+                idx = NULL;
+        }
+
+        buf = malloc(st.st_size);
+        if (buf == NULL) {
+                goto finished;
+        }
+        if (pread(fd, buf, st.st_size, 0) != st.st_size) {
+                goto finished;
+        }
+        count = le64toh(buf[0]);
+        if (count != (uint64_t)(st.st_size - 8) / 16 || count >= INT32_MAX) {
+                LOG_ERROR("LOAD_INDEX [%s] invalid index file\n", path);
+                goto finished;
+        }
+
+        idx = calloc(1, sizeof(*idx));
+        if (idx == NULL) {
+                goto finished;
+        }
+        idx->path = strdup(path);
+        idx->noffs = count + 1;
+        idx->offs = malloc(idx->noffs * sizeof(bgzidx1_t));
+        if (idx->path == NULL || idx->offs == NULL) {
+                free_index(idx);
+                idx = NULL;
+                goto finished;
+        }
+        set_file_id(&idx->id, &st);
+        idx->offs[0].caddr = 0;
+        idx->offs[0].uaddr = 0;
+        for (i = 1; i < idx->noffs; i++) {
+                idx->offs[i].caddr = le64toh(buf[2 * i - 1]);
+                idx->offs[i].uaddr = le64toh(buf[2 * i]);
+        }
+        if (use_compact && write_compact_index(idx, compact) == 0 &&
+            map_compact_index(idx, compact) == 0) {
+                free(idx->offs);
+                idx->offs = NULL;
+        }
+
+finished:
+        free(buf);
+        close(fd);
+        return idx;
+}
+
+static void index_lru_unlink(struct bgzf_index *idx)
+{
+        if (idx->lru_prev) {
+                idx->lru_prev->lru_next = idx->lru_next;
+        } else {
+                index_lru_head = idx->lru_next;
+        }
+        if (idx->lru_next) {
+                idx->lru_next->lru_prev = idx->lru_prev;
+        } else {
+                index_lru_tail = idx->lru_prev;
+        }
+        idx->lru_prev = idx->lru_next = NULL;
+        index_idle_size -= index_size(idx);
+}
+
+/* Must be called with index_cache_mutex held. Indexes that are still in
+ * use stay around until the final put_index().
+ */
+static void index_cache_unlink(struct bgzf_index *idx)
+{
+        struct bgzf_index **pp;
+
+        pp = &index_cache[hash_path(idx->path) % INDEX_CACHE_BUCKETS];
+        while (*pp != idx) {
+                pp = &(*pp)->hash_next;
+        }
+        *pp = idx->hash_next;
+        idx->cached = 0;
+        if (idx->refcount == 0) {
+                index_lru_unlink(idx);
+                free_index(idx);
+        }
+}
+
+static void put_index(struct bgzf_index *idx)
+{
+        pthread_mutex_lock(&index_cache_mutex);
+        if (--idx->refcount) {
+                pthread_mutex_unlock(&index_cache_mutex);
+                return;
+        }
+        if (!idx->cached) {
+                pthread_mutex_unlock(&index_cache_mutex);
+                free_index(idx);
+                return;
+        }
+
+        /* Idle, move it to the LRU list and trim the cache */
+        idx->lru_prev = NULL;
+        idx->lru_next = index_lru_head;
+        if (index_lru_head) {
+                index_lru_head->lru_prev = idx;
+        } else {
+                index_lru_tail = idx;
+        }
+        index_lru_head = idx;
+        index_idle_size += index_size(idx);
+        while (index_idle_size > index_cache_size) {
+                index_cache_unlink(index_lru_tail);
+        }
+        pthread_mutex_unlock(&index_cache_mutex);
+}
+
+/* Done loading the index of load, wake up the ones waiting for it.
+ * Must be called with index_cache_mutex held.
+ */
+static void index_load_done(struct index_load *load, struct bgzf_index *idx)
+{
+        struct index_load **pp;
+
+        if (load == NULL) {
+                return;
+        }
+        for (pp = &index_loads; *pp != load; pp = &(*pp)->next) {
+        }
+        *pp = load->next;
+        load->done = 1;
+        load->idx = idx;
+        if (idx) {
+                idx->refcount += load->waiters;
+        }
+        if (load->waiters) {
+                pthread_cond_broadcast(&index_load_cond);
+        } else {
+                free(load->path);
+                free(load);
+        }
+}
+
+/* Returns a referenced index for path, a .gz.gzi file or a compressed file
+ * that holds its own index, loading it if it is not already cached or if
+ * the cached copy is stale. Only one thread loads an index, any others
+ * that want it meanwhile wait for it.
+ * The reference must be dropped with put_index().
+ */
+static struct bgzf_index *get_index(const char *path)
+{
+        struct bgzf_index *idx, *old, **bucket;
+        struct index_load *load;
+        struct file_id id;
+        struct stat st;
+
+        if (fstatat(dir_fd, path, &st, AT_NO_AUTOMOUNT) != 0) {
+                return NULL;
+        }
+        set_file_id(&id, &st);
+
+        bucket = &index_cache[hash_path(path) % INDEX_CACHE_BUCKETS];
+        pthread_mutex_lock(&index_cache_mutex);
+        for (idx = *bucket; idx; idx = idx->hash_next) {
+                if (strcmp(idx->path, path)) {
+                        continue;
+                }
+                if (!same_file_id(&idx->id, &id)) {
+                        LOG_INFO("GET_INDEX [%s] stale\n", path);
+                        index_cache_unlink(idx);
+                        break;
+                }
+                if (idx->refcount++ == 0) {
+                        index_lru_unlink(idx);
+                }
+                pthread_mutex_unlock(&index_cache_mutex);
+                count_stat(STAT_INDEX_HITS, 1);
+                return idx;
+        }
+        count_stat(STAT_INDEX_MISSES, 1);
+
+        for (load = index_loads; load; load = load->next) {
+                if (!strcmp(load->path, path)) {
+                        break;
+                }
+        }
+        if (load) {
+                load->waiters++;
+                while (!load->done) {
+                        pthread_cond_wait(&index_load_cond,
+                                          &index_cache_mutex);
+                }
+                idx = load->idx;
+                if (--load->waiters == 0) {
+                        free(load->path);
+                        free(load);
+                }
+                pthread_mutex_unlock(&index_cache_mutex);
+                count_stat(STAT_FLIGHT_WAITS, 1);
+                return idx;
+        }
+        /* Without memory for it the index is just loaded unshared */
+        load = calloc(1, sizeof(*load));
+        if (load) {
+                load->path = strdup(path);
+                if (load->path == NULL) {
+                        free(load);
+                        load = NULL;
+                }
+        }
+        if (load) {
+                load->next = index_loads;
+                index_loads = load;
+        }
+        pthread_mutex_unlock(&index_cache_mutex);
+
+        idx = load_index(path);
+        if (idx == NULL) {
+                pthread_mutex_lock(&index_cache_mutex);
+                index_load_done(load, NULL);
+                pthread_mutex_unlock(&index_cache_mutex);
+                return NULL;
+        }
+        idx->refcount = 1;
+
+        pthread_mutex_lock(&index_cache_mutex);
+        for (old = *bucket; old; old = old->hash_next) {
+                if (!strcmp(old->path, path)) {
+                        break;
+                }
+        }
+        if (old && same_file_id(&old->id, &idx->id)) {
+                /* Somebody else loaded it while we were busy */
+                if (old->refcount++ == 0) {
+                        index_lru_unlink(old);
+                }
+                index_load_done(load, old);
+                pthread_mutex_unlock(&index_cache_mutex);
+                free_index(idx);
+                return old;
+        }
+        if (old) {
+                index_cache_unlink(old);
+        }
+        idx->hash_next = *bucket;
+        *bucket = idx;
+        idx->cached = 1;
+        index_load_done(load, idx);
+        pthread_mutex_unlock(&index_cache_mutex);
+        return idx;
+}
+
+/* Drop the cached index for path, if any. */
+static void index_cache_drop(const char *path)
+{
+        struct bgzf_index *idx;
+
+        pthread_mutex_lock(&index_cache_mutex);
+        for (idx = index_cache[hash_path(path) % INDEX_CACHE_BUCKETS]; idx;
+             idx = idx->hash_next) {
+                if (!strcmp(idx->path, path)) {
+                        index_cache_unlink(idx);
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&index_cache_mutex);
+}
+
+/* crc32 of decompressed blocks, for --verify-crc and the disk cache.
+ * zlib's crc32() does a few bytes per cycle, which is too slow to check
+ * every block that is inflated, so where the CPU can do carry-less
+ * multiplication (PCLMULQDQ) or has the ARMv8 crc32 instructions those
+ * are used instead. Which one is picked once at startup.
+ */
+#if defined(__x86_64__)
+/* Fold 64 bytes at a time, then 16, and reduce the remainder with Barrett
+ * reduction, as in Intel's "Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ Instruction". Takes and returns the crc without the
+ * initial and final inversion, len must be a multiple of 16 and at least
+ * 64.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *p, size_t len)
+{
+        const __m128i mask32 = _mm_setr_epi32(~0, 0, 0, 0);
+        __m128i x1, x2, x3, x4, x5, x6, x7, x8, k;
+
+        x1 = _mm_loadu_si128((const __m128i *)p);
+        x2 = _mm_loadu_si128((const __m128i *)(p + 16));
+        x3 = _mm_loadu_si128((const __m128i *)(p + 32));
+        x4 = _mm_loadu_si128((const __m128i *)(p + 48));
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+        p += 64;
+        len -= 64;
+
+        k = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+        for (; len >= 64; p += 64, len -= 64) {
+                x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+                x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+                x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+                x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+                x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+                x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+                x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+                x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+                x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                        _mm_loadu_si128((const __m128i *)p));
+                x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                        _mm_loadu_si128((const __m128i *)(p + 16)));
+                x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                        _mm_loadu_si128((const __m128i *)(p + 32)));
+                x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                        _mm_loadu_si128((const __m128i *)(p + 48)));
+        }
+
+        /* Down to 128 bits */
+        k = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+        x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), x2);
+        x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), x3);
+        x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), x4);
+        for (; len >= 16; p += 16, len -= 16) {
+                x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+                x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+                x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                        _mm_loadu_si128((const __m128i *)p));
+        }
+
+        /* 128 to 64 bits, then 64 to 32 */
+        x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+        x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+        k = _mm_set_epi64x(0, 0x163cd6124);
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        /* Barrett reduction with mu and the polynomial */
+        k = _mm_set_epi64x(0x1f7011641, 0x1db710641);
+        x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x10);
+        x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), k, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+        return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_simd(uint32_t crc, const unsigned char *p, size_t len)
+{
+        size_t n = len & ~(size_t)15;
+
+        if (n >= 64) {
+                crc = ~crc32_pclmul(~crc, p, n);
+                p += n;
+                len -= n;
+        }
+        return crc32(crc, p, len);
+}
+
+static int have_crc32_simd(void)
+{
+        unsigned int eax, ebx, ecx, edx;
+
+        return __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+                (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+#define CRC32_SIMD "pclmul"
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32_simd(uint32_t crc, const unsigned char *p, size_t len)
+{
+        uint64_t v;
+
+        crc = ~crc;
+        for (; len >= 8; p += 8, len -= 8) {
+                memcpy(&v, p, 8);
+                crc = __crc32d(crc, v);
+        }
+        for (; len; p++, len--) {
+                crc = __crc32b(crc, *p);
+        }
+        return ~crc;
+}
+
+static int have_crc32_simd(void)
+{
+        return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#define CRC32_SIMD "armv8 crc32"
+#endif
+
+static uint32_t zlib_crc32(uint32_t crc, const unsigned char *p, size_t len)
+{
+        return crc32(crc, p, len);
+}
+
+#ifdef HAVE_LIBDEFLATE
+static uint32_t crc32_libdeflate(uint32_t crc, const unsigned char *p,
+                                 size_t len)
+{
+        return libdeflate_crc32(crc, p, len);
+}
+#endif
+
+static uint32_t (*block_crc32_fn)(uint32_t crc, const unsigned char *p,
+                                  size_t len) = zlib_crc32;
+static const char *block_crc32_name = "zlib";
+static int verify_crc;
+
+static void init_block_crc32(void)
+{
+#ifdef CRC32_SIMD
+        if (have_crc32_simd()) {
+                block_crc32_fn = crc32_simd;
+                block_crc32_name = CRC32_SIMD;
+                return;
+        }
+#endif
+#ifdef HAVE_LIBDEFLATE
+        /* Which does its own runtime detection */
+        block_crc32_fn = crc32_libdeflate;
+        block_crc32_name = "libdeflate";
+#endif
+}
+
+static uint32_t block_crc32(const unsigned char *p, size_t len)
+{
+        return block_crc32_fn(0, p, len);
+}
+
+/* The second tier of the block cache, blocks kept in a file on local disk
+ * so that they survive a restart of the daemon, enabled with --disk-cache.
+ *
+ * The data file is split in slots of DISK_SLOT_SIZE bytes, one block each,
+ * and the index file has a record per slot that says which block is in it
+ * and the crc32 of its data. A slot is written data first and record last,
+ * and both are checked when they are read back, so a crash at any point
+ * only ever loses blocks. Nothing is synced, the cache can always be
+ * rebuilt.
+ *
+ * Slots are reused in CLOCK order. Only blocks that are accessed a second
+ * time are written to disk, either as a hit in the block cache or as a
+ * miss on a block that was inflated before, so a single scan through a
+ * large file does not flush the cache. Blocks are written by the disk
+ * writer thread, from a copy, so readers never wait for it.
+ */
+#define DISK_SLOT_SIZE (64 * 1024)      /* BGZF_MAX_BLOCK_SIZE, ZRAN_CHUNK */
+#define DISK_HEADER_SIZE 64
+#define DISK_MIN_SLOTS 16
+#define DISK_QUEUE_MAX 256
+
+static const char disk_magic[8] = "FBGZDC\0\1";
+
+/* A record in the index file. The cache is local to the machine so it is
+ * kept in host byte order.
+ */
+struct disk_record {
+        struct file_id id;
+        uint64_t caddr;
+        uint32_t clen;
+        uint32_t ulen;
+        uint32_t crc;           /* of the data */
+        uint32_t pad[2];
+        uint32_t rcrc;          /* of the record up to here */
+};
+
+struct disk_slot {
+        struct disk_record rec;
+        int next;               /* in the hash chain, -1 at the end */
+        uint32_t gen;           /* bumped every time the slot is reused */
+        uint8_t used;
+        uint8_t ref;            /* for CLOCK */
+        uint8_t busy;           /* being written */
+};
+
+/* A block queued for the disk writer */
+struct disk_write {
+        struct disk_write *next;
+        struct disk_record rec;
+        unsigned char data[];
+};
+
+static size_t disk_cache_size;
+static char *disk_cache_dir;
+static int disk_data_fd = -1, disk_index_fd = -1;
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct disk_slot *disk_slots;
+static int num_disk_slots;
+static int *disk_buckets;
+static int num_disk_buckets;
+static int disk_hand;
+static size_t disk_bytes;
+static uint32_t *disk_ghosts;   /* blocks seen once, direct mapped */
+
+static pthread_mutex_t disk_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_write_cond = PTHREAD_COND_INITIALIZER;
+static struct disk_write *disk_writes;
+static int num_disk_writes;
+static int disk_writer_running;
+
+static uint32_t disk_record_crc(const struct disk_record *rec)
+{
+        return crc32(0, (const unsigned char *)rec,
+                     offsetof(struct disk_record, rcrc));
+}
+
+static int *disk_bucket(const struct file_id *id, uint64_t caddr)
+{
+        return &disk_buckets[hash_block(id, caddr) & (num_disk_buckets - 1)];
+}
+
+/* Must be called with disk_mutex held */
+static int disk_find(const struct file_id *id, uint64_t caddr)
+{
+        int i;
+
+        for (i = *disk_bucket(id, caddr); i >= 0; i = disk_slots[i].next) {
+                if (disk_slots[i].rec.caddr == caddr &&
+                    same_file_id(&disk_slots[i].rec.id, id)) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+static void disk_link(int i)
+{
+        struct disk_slot *s = &disk_slots[i];
+        int *bucket = disk_bucket(&s->rec.id, s->rec.caddr);
+
+        s->next = *bucket;
+        *bucket = i;
+        s->used = 1;
+        disk_bytes += s->rec.ulen;
+}
+
+static void disk_unlink(int i)
+{
+        struct disk_slot *s = &disk_slots[i];
+        int *pp = disk_bucket(&s->rec.id, s->rec.caddr);
+
+        while (*pp != i) {
+                pp = &disk_slots[*pp].next;
+        }
+        *pp = s->next;
+        s->used = 0;
+        disk_bytes -= s->rec.ulen;
+}
+
+/* Open, or create, the disk cache in dir and load its index */
+static int disk_cache_init(const char *dir)
+{
+        char name[PATH_MAX], header[DISK_HEADER_SIZE];
+        struct disk_record recs[256];
+        int i, j, n = 0, loaded = 0;
+        struct stat st;
+        ssize_t count;
+
+        if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+                return -1;
+        }
+        num_disk_slots = disk_cache_size / DISK_SLOT_SIZE;
+        if (num_disk_slots < DISK_MIN_SLOTS) {
+                num_disk_slots = DISK_MIN_SLOTS;
+        }
+        num_disk_buckets = 64;
+        while (num_disk_buckets < num_disk_slots) {
+                num_disk_buckets <<= 1;
+        }
+        disk_slots = calloc(num_disk_slots, sizeof(disk_slots[0]));
+        disk_buckets = malloc(num_disk_buckets * sizeof(disk_buckets[0]));
+        disk_ghosts = calloc(num_disk_slots, sizeof(disk_ghosts[0]));
+        if (disk_slots == NULL || disk_buckets == NULL ||
+            disk_ghosts == NULL) {
+                return -1;
+        }
+        memset(disk_buckets, 0xff, num_disk_buckets * sizeof(disk_buckets[0]));
+
+        snprintf(name, sizeof(name), "%s/blocks.index", dir);
+        disk_index_fd = open(name, O_RDWR|O_CREAT, 0600);
+        if (disk_index_fd == -1) {
+                return -1;
+        }
+        /* Two mounts must not share the same slots */
+        if (flock(disk_index_fd, LOCK_EX|LOCK_NB) == -1) {
+                fprintf(stderr, "disk cache %s is used by another mount\n",
+                        dir);
+                return -1;
+        }
+        snprintf(name, sizeof(name), "%s/blocks.data", dir);
+        disk_data_fd = open(name, O_RDWR|O_CREAT, 0600);
+        if (disk_data_fd == -1) {
+                return -1;
+        }
+
+        if (pread(disk_index_fd, header, sizeof(header), 0) ==
+            sizeof(header) && !memcmp(header, disk_magic, 8) &&
+            fstat(disk_index_fd, &st) == 0) {
+                n = (st.st_size - DISK_HEADER_SIZE) / sizeof(recs[0]);
+                if (n > num_disk_slots) {
+                        /* The cache was made smaller */
+                        n = num_disk_slots;
+                }
+        } else {
+                memset(header, 0, sizeof(header));
+                memcpy(header, disk_magic, 8);
+                if (ftruncate(disk_index_fd, 0) == -1 ||
+                    pwrite(disk_index_fd, header, sizeof(header), 0) !=
+                    sizeof(header)) {
+                        return -1;
+                }
+        }
+
+        for (i = 0; i < n; i += count) {
+                count = pread(disk_index_fd, recs, sizeof(recs),
+                              DISK_HEADER_SIZE + (off_t)i * sizeof(recs[0]));
+                if (count < (ssize_t)sizeof(recs[0])) {
+                        break;
+                }
+                count /= sizeof(recs[0]);
+                for (j = 0; j < count && i + j < n; j++) {
+                        struct disk_record *rec = &recs[j];
+
+                        if (rec->rcrc != disk_record_crc(rec) ||
+                            rec->ulen == 0 || rec->ulen > DISK_SLOT_SIZE ||
+                            disk_find(&rec->id, rec->caddr) >= 0) {
+                                continue;
+                        }
+                        disk_slots[i + j].rec = *rec;
+                        disk_link(i + j);
+                        loaded++;
+                }
+        }
+        if (ftruncate(disk_index_fd, DISK_HEADER_SIZE +
+                      (off_t)num_disk_slots * sizeof(recs[0])) == -1 ||
+            ftruncate(disk_data_fd,
+                      (off_t)num_disk_slots * DISK_SLOT_SIZE) == -1) {
+                return -1;
+        }
+        LOG_INFO("Loaded %d blocks from the disk cache\n", loaded);
+        return 0;
+}
+
+/* Returns a new block read from the disk cache, owned by the caller, or
+ * NULL if it is not there.
+ */
+static struct cached_block *disk_cache_get(const struct file_id *id,
+                                           uint64_t caddr)
+{
+        static const struct disk_record zero_rec;
+        struct cached_block *blk;
+        struct disk_record rec;
+        struct disk_slot *s;
+        uint32_t gen;
+        int i, good;
+
+        if (disk_slots == NULL) {
+                return NULL;
+        }
+        pthread_mutex_lock(&disk_mutex);
+        i = disk_find(id, caddr);
+        if (i < 0) {
+                pthread_mutex_unlock(&disk_mutex);
+                count_stat(STAT_DISK_MISSES, 1);
+                return NULL;
+        }
+        s = &disk_slots[i];
+        s->ref = 1;
+        rec = s->rec;
+        gen = s->gen;
+        pthread_mutex_unlock(&disk_mutex);
+
+        blk = malloc(sizeof(*blk) + rec.ulen);
+        if (blk == NULL) {
+                return NULL;
+        }
+        memset(blk, 0, sizeof(*blk));
+        blk->id = *id;
+        blk->caddr = caddr;
+        blk->clen = rec.clen;
+        blk->ulen = rec.ulen;
+        blk->refcount = 1;
+        blk->disk = 1;
+        good = pread(disk_data_fd, blk->data, rec.ulen,
+                     (off_t)i * DISK_SLOT_SIZE) == rec.ulen &&
+                block_crc32(blk->data, rec.ulen) == rec.crc;
+
+        pthread_mutex_lock(&disk_mutex);
+        if (s->gen != gen) {
+                /* Reused while we read it */
+                good = 0;
+        } else if (!good) {
+                LOG_ERROR("disk cache slot %d is corrupt\n", i);
+                disk_unlink(i);
+                if (pwrite(disk_index_fd, &zero_rec, sizeof(zero_rec),
+                           DISK_HEADER_SIZE + (off_t)i * sizeof(rec)) < 0) {
+                        /* It fails the crc again next time */
+                }
+        }
+        pthread_mutex_unlock(&disk_mutex);
+        if (!good) {
+                free(blk);
+                count_stat(STAT_DISK_MISSES, 1);
+                return NULL;
+        }
+        count_stat(STAT_DISK_HITS, 1);
+        return blk;
+}
+
+/* Whether the block is in the disk cache, then there is no need to read
+ * its compressed data.
+ */
+static int disk_cache_has(const struct file_id *id, uint64_t caddr)
+{
+        int i;
+
+        if (disk_slots == NULL) {
+                return 0;
+        }
+        pthread_mutex_lock(&disk_mutex);
+        i = disk_find(id, caddr);
+        pthread_mutex_unlock(&disk_mutex);
+        return i >= 0;
+}
+
+/* Must be called with disk_mutex held. Takes the next slot in CLOCK order
+ * that has not been used since the hand last passed it.
+ */
+static int disk_alloc_slot(void)
+{
+        while (1) {
+                int i = disk_hand;
+                struct disk_slot *s = &disk_slots[i];
+
+                disk_hand = (disk_hand + 1) % num_disk_slots;
+                if (s->busy) {
+                        continue;
+                }
+                if (s->used && s->ref) {
+                        s->ref = 0;
+                        continue;
+                }
+                if (s->used) {
+                        disk_unlink(i);
+                }
+                s->busy = 1;
+                s->gen++;
+                return i;
+        }
+}
+
+static void write_disk_block(struct disk_write *w)
+{
+        struct disk_record *rec = &w->rec;
+        struct disk_slot *s;
+        int i, ok;
+
+        pthread_mutex_lock(&disk_mutex);
+        if (disk_find(&rec->id, rec->caddr) >= 0) {
+                pthread_mutex_unlock(&disk_mutex);
+                return;
+        }
+        i = disk_alloc_slot();
+        pthread_mutex_unlock(&disk_mutex);
+
+        rec->crc = block_crc32(w->data, rec->ulen);
+        rec->rcrc = disk_record_crc(rec);
+        ok = pwrite(disk_data_fd, w->data, rec->ulen,
+                    (off_t)i * DISK_SLOT_SIZE) == rec->ulen &&
+                pwrite(disk_index_fd, rec, sizeof(*rec),
+                       DISK_HEADER_SIZE + (off_t)i * sizeof(*rec)) ==
+                sizeof(*rec);
+
+        pthread_mutex_lock(&disk_mutex);
+        s = &disk_slots[i];
+        s->busy = 0;
+        if (ok && disk_find(&rec->id, rec->caddr) < 0) {
+                s->rec = *rec;
+                s->ref = 0;
+                disk_link(i);
+        }
+        pthread_mutex_unlock(&disk_mutex);
+        if (ok) {
+                count_stat(STAT_DISK_WRITES, 1);
+        }
+}
+
+static void write_disk_blocks(struct disk_write *list)
+{
+        while (list) {
+                struct disk_write *w = list;
+
+                list = w->next;
+                write_disk_block(w);
+                free(w);
+        }
+}
+
+static void *disk_writer(void *arg)
+{
+        struct disk_write *list;
+
+        pthread_mutex_lock(&disk_write_mutex);
+        while (1) {
+                while (disk_writes == NULL) {
+                        pthread_cond_wait(&disk_write_cond,
+                                          &disk_write_mutex);
+                }
+                list = disk_writes;
+                disk_writes = NULL;
+                num_disk_writes = 0;
+                pthread_mutex_unlock(&disk_write_mutex);
+
+                write_disk_blocks(list);
+
+                pthread_mutex_lock(&disk_write_mutex);
+        }
+        return NULL;
+}
+
+static void start_disk_writer(void)
+{
+        pthread_t thread;
+
+        if (disk_slots == NULL) {
+                return;
+        }
+        if (pthread_create(&thread, NULL, disk_writer, NULL) == 0) {
+                pthread_detach(thread);
+                disk_writer_running = 1;
+        }
+}
+
+/* Queue a copy of a referenced block to be written to the disk cache.
+ * Blocks are dropped if the writer can not keep up.
+ */
+static void disk_cache_store(const struct cached_block *blk)
+{
+        struct disk_write *w;
+
+        w = malloc(sizeof(*w) + blk->ulen);
+        if (w == NULL) {
+                return;
+        }
+        memset(w, 0, sizeof(*w));
+        w->rec.id = blk->id;
+        w->rec.caddr = blk->caddr;
+        w->rec.clen = blk->clen;
+        w->rec.ulen = blk->ulen;
+        memcpy(w->data, blk->data, blk->ulen);
+
+        pthread_mutex_lock(&disk_write_mutex);
+        if (num_disk_writes >= DISK_QUEUE_MAX) {
+                pthread_mutex_unlock(&disk_write_mutex);
+                free(w);
+                count_stat(STAT_DISK_DROPS, 1);
+                return;
+        }
+        w->next = disk_writes;
+        disk_writes = w;
+        num_disk_writes++;
+        if (!disk_writer_running) {
+                /* No writer thread, write it out ourself */
+                disk_writes = NULL;
+                num_disk_writes = 0;
+                pthread_mutex_unlock(&disk_write_mutex);
+                write_disk_blocks(w);
+                return;
+        }
+        pthread_cond_signal(&disk_write_cond);
+        pthread_mutex_unlock(&disk_write_mutex);
+}
+
+/* Called for a referenced block when it is hit in the block cache, or
+ * when it has just been inflated. It is written to disk the second time
+ * it is accessed.
+ */
+static void disk_cache_admit(struct cached_block *blk, int hit)
+{
+        uint64_t hash;
+        uint32_t tag;
+
+        if (disk_slots == NULL || blk->ulen == 0 ||
+            __atomic_load_n(&blk->disk, __ATOMIC_RELAXED)) {
+                return;
+        }
+        if (!hit) {
+                hash = hash_block(&blk->id, blk->caddr);
+                tag = (hash >> 32) | 1;
+                if (__atomic_exchange_n(&disk_ghosts[hash % num_disk_slots],
+                                        tag, __ATOMIC_RELAXED) != tag) {
+                        return;
+                }
+        }
+        if (__atomic_exchange_n(&blk->disk, 1, __ATOMIC_RELAXED) == 0) {
+                disk_cache_store(blk);
+        }
+}
+
+/* Write out what is still queued when we unmount */
+static void flush_disk_writes(void)
+{
+        struct disk_write *list;
+
+        pthread_mutex_lock(&disk_write_mutex);
+        list = disk_writes;
+        disk_writes = NULL;
+        num_disk_writes = 0;
+        disk_writer_running = 0;
+        pthread_mutex_unlock(&disk_write_mutex);
+        write_disk_blocks(list);
+}
+
+/* Ranges of files pinned in the block cache with setxattr, see set_pin(),
+ * by the identity of the compressed file. Blocks are pinned as they go
+ * into the cache.
+ */
+struct pin {
+        struct pin *next;
+        struct file_id id;
+        uint64_t start, end;    /* uncompressed, end UINT64_MAX for all */
+        uint64_t cstart, cend;  /* compressed offsets of its blocks */
+        char path[];
+};
+
+static pthread_mutex_t pin_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pin *pins;
+static int num_pins;
+
+/* Whether the block at caddr of the compressed file id is pinned */
+static int block_pinned(const struct file_id *id, uint64_t caddr)
+{
+        struct pin *pin;
+        int ret = 0;
+
+        if (__atomic_load_n(&num_pins, __ATOMIC_RELAXED) == 0) {
+                return 0;
+        }
+        pthread_mutex_lock(&pin_mutex);
+        for (pin = pins; pin && !ret; pin = pin->next) {
+                ret = same_file_id(&pin->id, id) && caddr >= pin->cstart &&
+                      caddr < pin->cend;
+        }
+        pthread_mutex_unlock(&pin_mutex);
+        return ret;
+}
+
+static void block_cache_init(void)
+{
+        size_t num_buckets = 64;
+        int i;
+
+        /* Size the hash tables for the number of full sized blocks that
+         * fit in the cache.
+         */
+        while (num_buckets * BLOCK_CACHE_SHARDS * BGZF_MAX_BLOCK_SIZE <
+               block_cache_size) {
+                num_buckets <<= 1;
+        }
+
+        for (i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+                struct cache_shard *shard = &block_cache[i];
+
+                pthread_mutex_init(&shard->mutex, NULL);
+                pthread_cond_init(&shard->inflight_cond, NULL);
+                shard->num_buckets = num_buckets;
+                shard->buckets = calloc(num_buckets, sizeof(shard->buckets[0]));
+                if (shard->buckets == NULL) {
+                        fprintf(stderr, "Failed to allocate block cache\n");
+                        exit(1);
+                }
+                shard->max_size = block_cache_size / BLOCK_CACHE_SHARDS;
+        }
+}
+
+static struct cache_shard *block_shard(uint64_t hash)
+{
+        return &block_cache[hash % BLOCK_CACHE_SHARDS];
+}
+
+static struct cached_block **block_bucket(struct cache_shard *shard,
+                                          uint64_t hash)
+{
+        return &shard->buckets[(hash / BLOCK_CACHE_SHARDS) &
+                               (shard->num_buckets - 1)];
+}
+
+static void lru_unlink(struct cache_shard *shard, struct cached_block *blk)
+{
+        if (blk->lru_prev) {
+                blk->lru_prev->lru_next = blk->lru_next;
+        } else {
+                shard->lru_head = blk->lru_next;
+        }
+        if (blk->lru_next) {
+                blk->lru_next->lru_prev = blk->lru_prev;
+        } else {
+                shard->lru_tail = blk->lru_prev;
+        }
+        blk->lru_prev = blk->lru_next = NULL;
+}
+
+static void lru_push(struct cache_shard *shard, struct cached_block *blk)
+{
+        blk->lru_prev = NULL;
+        blk->lru_next = shard->lru_head;
+        if (shard->lru_head) {
+                shard->lru_head->lru_prev = blk;
+        } else {
+                shard->lru_tail = blk;
+        }
+        shard->lru_head = blk;
+}
+
+/* Must be called with the shard locked. Blocks that are still referenced
+ * by a reader are unlinked here and freed by the final block_cache_put().
+ */
+static void block_cache_unlink(struct cache_shard *shard,
+                               struct cached_block *blk)
+{
+        struct cached_block **pp;
+
+        pp = block_bucket(shard, hash_block(&blk->id, blk->caddr));
+        while (*pp != blk) {
+                pp = &(*pp)->hash_next;
+        }
+        *pp = blk->hash_next;
+        lru_unlink(shard, blk);
+        shard->size -= blk->ulen;
+        if (blk->pinned) {
+                shard->pinned_size -= blk->ulen;
+        }
+        if (--blk->refcount == 0) {
+                free(blk);
+        }
+}
+
+static void block_cache_evict(struct cache_shard *shard)
+{
+        struct cached_block *blk;
+
+        /* There is always an unpinned block left to evict */
+        while (shard->size > shard->max_size && shard->lru_tail) {
+                blk = shard->lru_tail;
+                if (blk->pinned) {
+                        lru_unlink(shard, blk);
+                        lru_push(shard, blk);
+                        continue;
+                }
+                block_cache_unlink(shard, blk);
+        }
+}
+
+/* Must be called with the shard locked. A block is only pinned while
+ * the pinned blocks take up at most half of the shard.
+ */
+static void pin_block(struct cache_shard *shard, struct cached_block *blk,
+                      int pin)
+{
+        if (pin && !blk->pinned &&
+            shard->pinned_size + blk->ulen <= shard->max_size / 2) {
+                blk->pinned = 1;
+                shard->pinned_size += blk->ulen;
+        } else if (!pin && blk->pinned) {
+                blk->pinned = 0;
+                shard->pinned_size -= blk->ulen;
+        }
+}
+
+/* Returns a referenced block, or NULL if it is not in the cache. */
+static struct cached_block *block_cache_get(const struct file_id *id,
+                                            uint64_t caddr)
+{
+        uint64_t hash = hash_block(id, caddr);
+        struct cache_shard *shard = block_shard(hash);
+        struct cached_block *blk;
+
+        if (block_cache_size == 0) {
+                return NULL;
+        }
+
+        pthread_mutex_lock(&shard->mutex);
+        for (blk = *block_bucket(shard, hash); blk; blk = blk->hash_next) {
+                if (blk->caddr == caddr && same_file_id(&blk->id, id)) {
+                        blk->refcount++;
+                        lru_unlink(shard, blk);
+                        lru_push(shard, blk);
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        return blk;
+}
+
+/* Adds a newly decompressed block, owned by the caller, to the cache.
+ * If another thread raced us and already added the same block then the
+ * new copy is dropped and the cached one is returned instead.
+ * Either way the caller gets back a referenced block.
+ */
+static struct cached_block *block_cache_insert(struct cached_block *blk)
+{
+        uint64_t hash = hash_block(&blk->id, blk->caddr);
+        struct cache_shard *shard = block_shard(hash);
+        struct cached_block **bucket, *old;
+        int pinned;
+
+        if (block_cache_size == 0) {
+                return blk;
+        }
+
+        pinned = block_pinned(&blk->id, blk->caddr);
+        pthread_mutex_lock(&shard->mutex);
+        bucket = block_bucket(shard, hash);
+        for (old = *bucket; old; old = old->hash_next) {
+                if (old->caddr == blk->caddr &&
+                    same_file_id(&old->id, &blk->id)) {
+                        old->refcount++;
+                        pthread_mutex_unlock(&shard->mutex);
+                        free(blk);
+                        return old;
+                }
+        }
+        blk->hash_next = *bucket;
+        *bucket = blk;
+        lru_push(shard, blk);
+        blk->refcount++;
+        shard->size += blk->ulen;
+        if (pinned) {
+                pin_block(shard, blk, 1);
+        }
+        block_cache_evict(shard);
+        pthread_mutex_unlock(&shard->mutex);
+        return blk;
+}
+
+static void block_cache_put(struct cached_block *blk)
+{
+        struct cache_shard *shard;
+
+        if (block_cache_size == 0) {
+                /* Blocks are never shared when the cache is disabled. */
+                free(blk);
+                return;
+        }
+
+        shard = block_shard(hash_block(&blk->id, blk->caddr));
+        pthread_mutex_lock(&shard->mutex);
+        if (--blk->refcount == 0) {
+                free(blk);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+}
+
+/* Returns the referenced block at caddr if it is cached, or once the
+ * thread that is decompressing it is done. Otherwise NULL is returned
+ * and the caller is to decompress it and hand the result, or NULL, to
+ * block_inflight_done() with *claim, so that others can wait for that.
+ * NULL is also returned, with *claim NULL, if the block could not be
+ * claimed or the thread decompressing it failed, then the caller just
+ * decompresses it on its own.
+ */
+static struct cached_block *block_cache_wait(const struct file_id *id,
+                                             uint64_t caddr,
+                                             struct inflight_block **claim)
+{
+        uint64_t hash = hash_block(id, caddr);
+        struct cache_shard *shard = block_shard(hash);
+        struct inflight_block *in;
+        struct cached_block *blk;
+
+        *claim = NULL;
+        if (block_cache_size == 0) {
+                return NULL;
+        }
+
+        pthread_mutex_lock(&shard->mutex);
+        /* It may have been added since we looked */
+        for (blk = *block_bucket(shard, hash); blk; blk = blk->hash_next) {
+                if (blk->caddr == caddr && same_file_id(&blk->id, id)) {
+                        blk->refcount++;
+                        pthread_mutex_unlock(&shard->mutex);
+                        return blk;
+                }
+        }
+        for (in = shard->inflight; in; in = in->next) {
+                if (in->caddr == caddr && same_file_id(&in->id, id)) {
+                        break;
+                }
+        }
+        if (in) {
+                in->waiters++;
+                while (!in->done) {
+                        pthread_cond_wait(&shard->inflight_cond,
+                                          &shard->mutex);
+                }
+                blk = in->blk;
+                if (--in->waiters == 0) {
+                        free(in);
+                }
+                pthread_mutex_unlock(&shard->mutex);
+                count_stat(STAT_FLIGHT_WAITS, 1);
+                return blk;
+        }
+        in = calloc(1, sizeof(*in));
+        if (in) {
+                in->id = *id;
+                in->caddr = caddr;
+                in->next = shard->inflight;
+                shard->inflight = in;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        *claim = in;
+        return NULL;
+}
+
+/* Wake up the threads waiting for the block claimed by
+ * block_cache_wait(). blk is a referenced block, or NULL, and is returned
+ * as it is.
+ */
+static struct cached_block *block_inflight_done(struct inflight_block *in,
+                                                struct cached_block *blk)
+{
+        struct inflight_block **pp;
+        struct cache_shard *shard;
+
+        if (in == NULL) {
+                return blk;
+        }
+        shard = block_shard(hash_block(&in->id, in->caddr));
+        pthread_mutex_lock(&shard->mutex);
+        for (pp = &shard->inflight; *pp != in; pp = &(*pp)->next) {
+        }
+        *pp = in->next;
+        in->done = 1;
+        in->blk = blk;
+        if (blk) {
+                blk->refcount += in->waiters;
+        }
+        if (in->waiters) {
+                pthread_cond_broadcast(&shard->inflight_cond);
+        } else {
+                free(in);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        return blk;
+}
+
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+
+/* Inflate backends. Each one decompresses a complete raw deflate stream,
+ * the payload of a single BGZF block, into a buffer of exactly out_len
+ * bytes and returns 0 on success or -1 if the data is corrupt. If crc is
+ * not NULL it is set to the crc32 of the output, which ISA-L works out
+ * while it inflates.
+ * BGZF blocks are small and always decompressed whole in one call, which
+ * is the case libdeflate and ISA-L are optimized for. Both of them pick
+ * the best SIMD implementation for the CPU at runtime.
+ */
+struct inflater {
+        const char *name;
+        int (*inflate)(const unsigned char *in, size_t in_len,
+                       unsigned char *out, size_t out_len, uint32_t *crc);
+};
+
+static pthread_key_t zstream_key;
+static pthread_once_t zstream_once = PTHREAD_ONCE_INIT;
+
+static void free_zstream(void *ptr)
+{
+        z_stream *zs = ptr;
+
+        inflateEnd(zs);
+        free(zs);
+}
+
+static void create_zstream_key(void)
+{
+        pthread_key_create(&zstream_key, free_zstream);
+}
+
+/* Each thread keeps its own raw inflate stream so that we only pay for
+ * inflateReset() per block and not for a full inflateInit().
+ */
+static z_stream *get_zstream(void)
+{
+        z_stream *zs;
+
+        pthread_once(&zstream_once, create_zstream_key);
+        zs = pthread_getspecific(zstream_key);
+        if (zs) {
+                inflateReset(zs);
+                return zs;
+        }
+
+        zs = calloc(1, sizeof(*zs));
+        if (zs == NULL) {
+                return NULL;
+        }
+        if (inflateInit2(zs, -15) != Z_OK) {
+                free(zs);
+                return NULL;
+        }
+        pthread_setspecific(zstream_key, zs);
+        return zs;
+}
+
+static int zlib_inflate(const unsigned char *in, size_t in_len,
+                        unsigned char *out, size_t out_len, uint32_t *crc)
+{
+        z_stream *zs = get_zstream();
+
+        if (zs == NULL) {
+                return -1;
+        }
+        zs->next_in = discard_const(in);
+        zs->avail_in = in_len;
+        zs->next_out = out;
+        zs->avail_out = out_len;
+        if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->total_out != out_len) {
+                return -1;
+        }
+        if (crc) {
+                *crc = block_crc32(out, out_len);
+        }
+        return 0;
+}
+
+#ifdef HAVE_LIBDEFLATE
+static pthread_key_t libdeflate_key;
+static pthread_once_t libdeflate_once = PTHREAD_ONCE_INIT;
+
+static void free_libdeflate(void *ptr)
+{
+        libdeflate_free_decompressor(ptr);
+}
+
+static void create_libdeflate_key(void)
+{
+        pthread_key_create(&libdeflate_key, free_libdeflate);
+}
+
+static int libdeflate_inflate(const unsigned char *in, size_t in_len,
+                              unsigned char *out, size_t out_len,
+                              uint32_t *crc)
+{
+        struct libdeflate_decompressor *d;
+
+        pthread_once(&libdeflate_once, create_libdeflate_key);
+        d = pthread_getspecific(libdeflate_key);
+        if (d == NULL) {
+                d = libdeflate_alloc_decompressor();
+                if (d == NULL) {
+                        return -1;
+                }
+                pthread_setspecific(libdeflate_key, d);
+        }
+        /* Passing NULL for actual_out makes a short output an error */
+        if (libdeflate_deflate_decompress(d, in, in_len, out, out_len,
+                                          NULL) != LIBDEFLATE_SUCCESS) {
+                return -1;
+        }
+        if (crc) {
+                *crc = block_crc32(out, out_len);
+        }
+        return 0;
+}
+#endif
+
+#ifdef HAVE_ISAL
+static pthread_key_t isal_key;
+static pthread_once_t isal_once = PTHREAD_ONCE_INIT;
+
+static void create_isal_key(void)
+{
+        pthread_key_create(&isal_key, free);
+}
+
+static int isal_inflate(const unsigned char *in, size_t in_len,
+                        unsigned char *out, size_t out_len, uint32_t *crc)
+{
+        struct inflate_state *state;
+
+        /* The inflate state is large, keep one per thread */
+        pthread_once(&isal_once, create_isal_key);
+        state = pthread_getspecific(isal_key);
+        if (state == NULL) {
+                state = malloc(sizeof(*state));
+                if (state == NULL) {
+                        return -1;
+                }
+                pthread_setspecific(isal_key, state);
+        }
+        isal_inflate_init(state);
+        state->next_in = discard_const(in);
+        state->avail_in = in_len;
+        state->next_out = out;
+        state->avail_out = out_len;
+        /* Raw deflate either way, but with the gzip crc32 computed */
+        state->crc_flag = crc ? ISAL_GZIP_NO_HDR : ISAL_DEFLATE;
+        if (isal_inflate_stateless(state) != ISAL_DECOMP_OK ||
+            state->total_out != out_len) {
+                return -1;
+        }
+        if (crc) {
+                *crc = state->crc;
+        }
+        return 0;
+}
+#endif
+
+static const struct inflater inflaters[] = {
+        { "zlib", zlib_inflate },
+#ifdef HAVE_LIBDEFLATE
+        { "libdeflate", libdeflate_inflate },
+#endif
+#ifdef HAVE_ISAL
+        { "isal", isal_inflate },
+#endif
+        { NULL, NULL }
+};
+
+/* Use the fastest backend that was compiled in by default */
+static const struct inflater *inflater =
+        &inflaters[sizeof(inflaters) / sizeof(inflaters[0]) - 2];
+
+/* Returns the total size of the BGZF block described by the gzip header
+ * in buf, or 0 if this is not a valid BGZF header.
+ */
+static size_t bgzf_block_size(const unsigned char *buf, size_t len)
+{
+        size_t xlen, pos;
+
+        if (len < BGZF_HEADER_SIZE || buf[0] != 31 || buf[1] != 139 ||
+            buf[2] != 8 || !(buf[3] & 4)) {
+                return 0;
+        }
+        xlen = buf[10] | (buf[11] << 8);
+        for (pos = 12; pos + 4 <= 12 + xlen && pos + 4 <= len;) {
+                size_t slen = buf[pos + 2] | (buf[pos + 3] << 8);
+
+                if (buf[pos] == 'B' && buf[pos + 1] == 'C' && slen == 2 &&
+                    pos + 6 <= len) {
+                        return (buf[pos + 4] | (buf[pos + 5] << 8)) + 1;
+                }
+                pos += 4 + slen;
+        }
+        return 0;
+}
+
+/* The block_size() of the BGZF format, see struct format */
+static ssize_t bgzf_block(const unsigned char *buf, size_t len,
+                          uint32_t *ulen)
+{
+        size_t bsize = bgzf_block_size(buf, len);
+
+        if (bsize < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE || bsize > len ||
+            12 + (buf[10] | (buf[11] << 8)) > bsize - BGZF_FOOTER_SIZE) {
+                return -1;
+        }
+        *ulen = get_le32(buf + bsize - 4);
+        return bsize;
+}
+
+/* Inflate the payload of a BGZF block. With --verify-crc the data is
+ * checked against the crc32 in the block footer.
+ */
+static ssize_t bgzf_decompress(const unsigned char *in, size_t in_len,
+                               unsigned char *out, size_t out_len)
+{
+        size_t hsize = 12 + (in[10] | (in[11] << 8));
+        uint32_t crc;
+
+        if (inflater->inflate(in + hsize, in_len - hsize - BGZF_FOOTER_SIZE,
+                              out, out_len, verify_crc ? &crc : NULL)) {
+                return -EIO;
+        }
+        if (verify_crc && crc != get_le32(in + in_len - BGZF_FOOTER_SIZE)) {
+                return -EBADMSG;
+        }
+        return out_len;
+}
+
+/* Drop every cached block of the compressed file dev/ino, whatever
+ * version of the file it came from.
+ */
+static void block_cache_purge(uint64_t dev, uint64_t ino)
+{
+        int i;
+
+        if (block_cache_size == 0) {
+                return;
+        }
+        for (i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+                struct cache_shard *shard = &block_cache[i];
+                struct cached_block *blk, *next;
+
+                pthread_mutex_lock(&shard->mutex);
+                for (blk = shard->lru_head; blk; blk = next) {
+                        next = blk->lru_next;
+                        if (blk->id.dev == dev && blk->id.ino == ino) {
+                                block_cache_unlink(shard, blk);
+                        }
+                }
+                pthread_mutex_unlock(&shard->mutex);
+        }
+}
+
+/* Pin or unpin the cached blocks of the compressed file id from cstart up
+ * to cend.
+ */
+static void block_cache_pin_range(const struct file_id *id, uint64_t cstart,
+                                  uint64_t cend, int pin)
+{
+        int i;
+
+        if (block_cache_size == 0) {
+                return;
+        }
+        for (i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+                struct cache_shard *shard = &block_cache[i];
+                struct cached_block *blk;
+
+                pthread_mutex_lock(&shard->mutex);
+                for (blk = shard->lru_head; blk; blk = blk->lru_next) {
+                        if (same_file_id(&blk->id, id) &&
+                            blk->caddr >= cstart && blk->caddr < cend) {
+                                pin_block(shard, blk, pin);
+                        }
+                }
+                pthread_mutex_unlock(&shard->mutex);
+        }
+}
+
+/* With --remote the source tree is a URL prefix that htslib can open,
+ * such as s3://bucket/archive or https://host/archive, instead of a
+ * local directory. The objects are listed in fuse-bgzip.listing at the
+ * prefix, one "<size> <mtime> <path>" line for each, as
+ *   find . -type f -printf '%s %T@ %P\n'
+ * prints them. At mount time the listing is mirrored in
+ * ~/.fuse-bgzip/remote/<hash of the prefix> with an empty file of the
+ * right size and mtime for each object, and the .gz.gzi indexes are
+ * downloaded. LOOKUP, GETATTR and READDIR are then served from that tree,
+ * and only the compressed data is read from the remote.
+ */
+static char *remote_base;
+static char *remote_listing;
+static char remote_dir[PATH_MAX];
+
+/* Connections per open file. hFILE is not thread safe. A handle has up
+ * to this many, so that concurrent reads of the same file become
+ * parallel range requests.
+ */
+#define REMOTE_CONNECTIONS 4
+
+struct remote {
+        char *url;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        hFILE *idle[REMOTE_CONNECTIONS];
+        int num_idle;
+        int num_open;
+};
+
+/* The remote behind each descriptor of a file in remote_dir, indexed by
+ * the descriptor.
+ */
+static struct remote **remote_fds;
+static int num_remote_fds;
+
+static struct remote *fd_remote(int fd)
+{
+        if (remote_fds == NULL || fd < 0 || fd >= num_remote_fds) {
+                return NULL;
+        }
+        return __atomic_load_n(&remote_fds[fd], __ATOMIC_ACQUIRE);
+}
+
+static int is_remote_fd(int fd)
+{
+        return fd_remote(fd) != NULL;
+}
+
+/* Open path, a .gz or plain file, for reading its data. */
+static int open_source(const char *path)
+{
+        struct remote *r;
+        int fd;
+
+        fd = openat(dir_fd, path, O_RDONLY);
+        if (fd == -1 || remote_base == NULL) {
+                return fd;
+        }
+        if (fd >= num_remote_fds) {
+                close(fd);
+                errno = EMFILE;
+                return -1;
+        }
+        r = calloc(1, sizeof(*r));
+        if (r == NULL || asprintf(&r->url, "%s/%s", remote_base, path) < 0) {
+                free(r);
+                close(fd);
+                errno = ENOMEM;
+                return -1;
+        }
+        pthread_mutex_init(&r->mutex, NULL);
+        pthread_cond_init(&r->cond, NULL);
+        __atomic_store_n(&remote_fds[fd], r, __ATOMIC_RELEASE);
+        return fd;
+}
+
+static void close_source(int fd)
+{
+        struct remote *r = fd_remote(fd);
+
+        if (r) {
+                __atomic_store_n(&remote_fds[fd], NULL, __ATOMIC_RELAXED);
+                while (r->num_idle) {
+                        hclose(r->idle[--r->num_idle]);
+                }
+                pthread_mutex_destroy(&r->mutex);
+                pthread_cond_destroy(&r->cond);
+                free(r->url);
+                free(r);
+        }
+        close(fd);
+}
+
+static hFILE *remote_get(struct remote *r)
+{
+        hFILE *hf;
+
+        pthread_mutex_lock(&r->mutex);
+        while (r->num_idle == 0 && r->num_open >= REMOTE_CONNECTIONS) {
+                pthread_cond_wait(&r->cond, &r->mutex);
+        }
+        if (r->num_idle) {
+                hf = r->idle[--r->num_idle];
+                pthread_mutex_unlock(&r->mutex);
+                return hf;
+        }
+        r->num_open++;
+        pthread_mutex_unlock(&r->mutex);
+
+        hf = hopen(r->url, "r");
+        if (hf == NULL) {
+                LOG_ERROR("REMOTE failed to open %s %s\n", r->url,
+                          strerror(errno));
+                pthread_mutex_lock(&r->mutex);
+                r->num_open--;
+                pthread_cond_signal(&r->cond);
+                pthread_mutex_unlock(&r->mutex);
+        }
+        return hf;
+}
+
+/* A connection that failed is closed, the next read opens a new one */
+static void remote_put(struct remote *r, hFILE *hf, int failed)
+{
+        if (failed) {
+                hclose(hf);
+        }
+        pthread_mutex_lock(&r->mutex);
+        if (failed) {
+                r->num_open--;
+        } else {
+                r->idle[r->num_idle++] = hf;
+        }
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->mutex);
+}
+
+/* pread() of the data of a file opened with open_source() */
+static ssize_t source_pread(int fd, void *buf, size_t len, off_t offset)
+{
+        struct remote *r = fd_remote(fd);
+        size_t count = 0;
+        hFILE *hf;
+        ssize_t n;
+
+        if (r == NULL) {
+                return pread(fd, buf, len, offset);
+        }
+        hf = remote_get(r);
+        if (hf == NULL) {
+                errno = EIO;
+                return -1;
+        }
+        count_stat(STAT_REMOTE_READS, 1);
+        if (hseek(hf, offset, SEEK_SET) < 0) {
+                remote_put(r, hf, 1);
+                errno = EIO;
+                return -1;
+        }
+        while (count < len) {
+                n = hread(hf, (char *)buf + count, len - count);
+                if (n < 0) {
+                        LOG_ERROR("REMOTE read of %s failed at %jd\n", r->url,
+                                  (intmax_t)(offset + count));
+                        remote_put(r, hf, 1);
+                        errno = EIO;
+                        return -1;
+                }
+                if (n == 0) {
+                        break;
+                }
+                count += n;
+        }
+        remote_put(r, hf, 0);
+        return count;
+}
+
+/* Read all of url into a new buffer. Returns the size or -1. */
+static ssize_t read_remote_object(const char *url, char **data)
+{
+        size_t len = 0, max = 0;
+        char *buf = NULL, *tmp;
+        hFILE *hf;
+        ssize_t n;
+
+        hf = hopen(url, "r");
+        if (hf == NULL) {
+                return -1;
+        }
+        do {
+                if (len == max) {
+                        max = max ? max * 2 : 65536;
+                        tmp = realloc(buf, max + 1);
+                        if (tmp == NULL) {
+                                n = -1;
+                                break;
+                        }
+                        buf = tmp;
+                }
+                n = hread(hf, buf + len, max - len);
+                if (n > 0) {
+                        len += n;
+                }
+        } while (n > 0);
+        if (hclose(hf) || n < 0) {
+                free(buf);
+                return -1;
+        }
+        if (buf == NULL) {
+                buf = malloc(1);
+                if (buf == NULL) {
+                        return -1;
+                }
+        }
+        buf[len] = 0;
+        *data = buf;
+        return len;
+}
+
+static void make_parent_dirs(char *path)
+{
+        char *p;
+
+        for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+                *p = 0;
+                mkdir(path, 0755);
+                *p = '/';
+        }
+}
+
+/* Make the file for one entry of the listing in remote_dir, unless it
+ * is already there with the same size and mtime.
+ */
+static int sync_remote_entry(const char *path, int64_t size, double mtime)
+{
+        char file[PATH_MAX], tmp[PATH_MAX + 16], url[PATH_MAX];
+        struct timespec ts[2];
+        size_t len = strlen(path);
+        struct stat st;
+        char *data;
+        ssize_t count;
+        int fd;
+
+        ts[0].tv_sec = (time_t)mtime;
+        ts[0].tv_nsec = (long)((mtime - (double)ts[0].tv_sec) * 1e9);
+        ts[1] = ts[0];
+
+        snprintf(file, sizeof(file), "%s/%s", remote_dir, path);
+        if (stat(file, &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_size == size && st.st_mtime == ts[1].tv_sec) {
+                return 0;
+        }
+        make_parent_dirs(file);
+
+        if (len > 7 && !strcmp(path + len - 7, ".gz.gzi")) {
+                snprintf(url, sizeof(url), "%s/%s", remote_base, path);
+                count = read_remote_object(url, &data);
+                if (count < 0) {
+                        fprintf(stderr, "failed to download %s\n", url);
+                        return -1;
+                }
+                snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+                fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd == -1 || write(fd, data, count) != count ||
+                    futimens(fd, ts) || close(fd) || rename(tmp, file)) {
+                        fprintf(stderr, "failed to write %s %s\n", file,
+                                strerror(errno));
+                        free(data);
+                        unlink(tmp);
+                        return -1;
+                }
+                free(data);
+                return 0;
+        }
+
+        /* Only the size and mtime matter, the data is read remotely */
+        fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || ftruncate(fd, size) || futimens(fd, ts) ||
+            close(fd)) {
+                fprintf(stderr, "failed to create %s %s\n", file,
+                        strerror(errno));
+                return -1;
+        }
+        return 0;
+}
+
+/* The names in the listing, while remote_dir is pruned */
+static struct lookup_cache remote_names;
+
+static int prune_remote_entry(const char *path, const struct stat *st,
+                              int type, struct FTW *ftw)
+{
+        const char *name = path + strlen(remote_dir) + 1;
+        int64_t value;
+
+        if (ftw->level == 0) {
+                return 0;
+        }
+        if (type == FTW_DP) {
+                /* Fails unless it is empty */
+                rmdir(path);
+        } else if (lookup_cache_get(&remote_names, name, &value)) {
+                unlink(path);
+        }
+        return 0;
+}
+
+/* Mirror the listing of remote_base in remote_dir. Returns the number of
+ * entries or -1.
+ */
+static int sync_remote(void)
+{
+        char url[PATH_MAX], *data, *line, *next, *end;
+        int count = 0, failed = 0;
+        struct rlimit rl;
+
+        if (remote_listing) {
+                snprintf(url, sizeof(url), "%s", remote_listing);
+        } else {
+                snprintf(url, sizeof(url), "%s/fuse-bgzip.listing",
+                         remote_base);
+        }
+        if (read_remote_object(url, &data) < 0) {
+                fprintf(stderr, "failed to read the remote listing %s\n",
+                        url);
+                return -1;
+        }
+
+        lookup_cache_init(&remote_names);
+        for (line = data; *line; line = next) {
+                int64_t size;
+                double mtime;
+                char *path;
+
+                next = strchr(line, '\n');
+                if (next) {
+                        *next++ = 0;
+                } else {
+                        next = line + strlen(line);
+                }
+                end = line + strlen(line);
+                if (end > line && end[-1] == '\r') {
+                        *--end = 0;
+                }
+                if (*line == 0) {
+                        continue;
+                }
+                size = strtoll(line, &path, 10);
+                mtime = strtod(path, &path);
+                while (*path == ' ' || *path == '\t') {
+                        path++;
+                }
+                while (!strncmp(path, "./", 2)) {
+                        path += 2;
+                }
+                if (size < 0 || *path == 0 || *path == '/' ||
+                    !strcmp(path, "..") || !strncmp(path, "../", 3) ||
+                    strstr(path, "/../") ||
+                    (strlen(path) > 3 &&
+                     !strcmp(path + strlen(path) - 3, "/.."))) {
+                        fprintf(stderr, "skipping invalid listing line "
+                                "[%s]\n", line);
+                        continue;
+                }
+                if (remote_listing == NULL &&
+                    !strcmp(path, "fuse-bgzip.listing")) {
+                        continue;
+                }
+                if (sync_remote_entry(path, size, mtime)) {
+                        failed++;
+                        continue;
+                }
+                lookup_cache_set(&remote_names, path, size);
+                count++;
+        }
+        free(data);
+        nftw(remote_dir, prune_remote_entry, 16, FTW_DEPTH | FTW_PHYS);
+        lookup_cache_clear(&remote_names);
+        if (failed) {
+                fprintf(stderr, "%d entries of the remote listing could not "
+                        "be mirrored\n", failed);
+        }
+
+        num_remote_fds = 1024;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+                num_remote_fds = rl.rlim_cur < (1 << 20) ? rl.rlim_cur :
+                        1 << 20;
+        }
+        remote_fds = calloc(num_remote_fds, sizeof(remote_fds[0]));
+        if (remote_fds == NULL) {
+                return -1;
+        }
+        return count;
+}
+
+/* The files that handles read from, the .gz file of a bgzip file or the
+ * plain file itself. All handles of a file share one source and so one
+ * descriptor. Descriptors that no read is using are closed again, least
+ * recently used first, once more than max_source_fds are open, and are
+ * reopened by the next read, so thousands of open handles neither need a
+ * descriptor each nor run into RLIMIT_NOFILE. A closed source whose file
+ * has been replaced since it was opened can not be reopened, reads then
+ * fail with ESTALE.
+ * With --mmap a local compressed file is also mapped, see map_source(),
+ * which stays valid when fd is closed.
+ */
+#define SOURCE_BUCKETS 4096
+
+struct source {
+        struct source *hash_next;
+        struct source *lru_prev, *lru_next;     /* open but not pinned */
+        struct file_id id;
+        int fd;                 /* -1 while closed */
+        int refcount;           /* one per handle */
+        int pins;               /* reads that are using fd */
+        unsigned char *map;     /* id.size bytes, or NULL */
+        char path[];
+};
+
+static int use_mmap;
+
+static pthread_mutex_t source_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct source *source_table[SOURCE_BUCKETS];
+static struct source *source_lru_head, *source_lru_tail;
+static int num_source_fds;
+static int max_source_fds;
+
+static void source_lru_unlink(struct source *src)
+{
+        if (src->lru_prev) {
+                src->lru_prev->lru_next = src->lru_next;
+        } else {
+                source_lru_head = src->lru_next;
+        }
+        if (src->lru_next) {
+                src->lru_next->lru_prev = src->lru_prev;
+        } else {
+                source_lru_tail = src->lru_prev;
+        }
+        src->lru_prev = src->lru_next = NULL;
+}
+
+static void source_lru_push(struct source *src)
+{
+        src->lru_prev = NULL;
+        src->lru_next = source_lru_head;
+        if (source_lru_head) {
+                source_lru_head->lru_prev = src;
+        } else {
+                source_lru_tail = src;
+        }
+        source_lru_head = src;
+}
+
+/* Must be called with source_mutex held. Takes the descriptors off idle
+ * sources, least recently used first, while more than max_source_fds are
+ * open, up to CLOSE_BATCH of them into fds. The caller closes them with
+ * close_sources() once it has dropped the lock, as closing the
+ * connections of a remote source can take a while.
+ */
+#define CLOSE_BATCH 16
+
+static int take_idle_sources(int *fds)
+{
+        int n = 0;
+
+        while (num_source_fds > max_source_fds && source_lru_tail &&
+               n < CLOSE_BATCH) {
+                struct source *src = source_lru_tail;
+
+                source_lru_unlink(src);
+                fds[n++] = src->fd;
+                src->fd = -1;
+                num_source_fds--;
+        }
+        return n;
+}
+
+static void close_sources(int *fds, int n)
+{
+        while (n > 0) {
+                close_source(fds[--n]);
+        }
+}
+
+/* Make sure the descriptor of src stays open until unpin_source().
+ * Returns 0 or -errno.
+ */
+static int pin_source(struct source *src)
+{
+        int fds[CLOSE_BATCH];
+        struct file_id id;
+        struct stat st;
+        int fd, n, ret;
+
+        pthread_mutex_lock(&source_mutex);
+        if (src->pins++ == 0 && src->fd != -1) {
+                source_lru_unlink(src);
+        }
+        if (src->fd != -1) {
+                pthread_mutex_unlock(&source_mutex);
+                return 0;
+        }
+        /* Pinned, so nobody closes it while we reopen it */
+        pthread_mutex_unlock(&source_mutex);
+
+        fd = open_source(src->path);
+        if (fd == -1 || fstat(fd, &st) == -1) {
+                ret = -errno;
+                goto failed;
+        }
+        set_file_id(&id, &st);
+        if (!same_file_id(&id, &src->id)) {
+                ret = -ESTALE;
+                goto failed;
+        }
+        pthread_mutex_lock(&source_mutex);
+        if (src->fd != -1) {
+                /* Another read reopened it meanwhile */
+                pthread_mutex_unlock(&source_mutex);
+                close_source(fd);
+                return 0;
+        }
+        src->fd = fd;
+        num_source_fds++;
+        n = take_idle_sources(fds);
+        pthread_mutex_unlock(&source_mutex);
+        close_sources(fds, n);
+        count_stat(STAT_SOURCE_REOPENS, 1);
+        return 0;
+
+failed:
+        if (fd != -1) {
+                close_source(fd);
+        }
+        pthread_mutex_lock(&source_mutex);
+        if (--src->pins == 0 && src->fd != -1) {
+                source_lru_push(src);
+        }
+        pthread_mutex_unlock(&source_mutex);
+        return ret;
+}
+
+static void unpin_source(struct source *src)
+{
+        int fds[CLOSE_BATCH];
+        int n = 0;
+
+        pthread_mutex_lock(&source_mutex);
+        if (--src->pins == 0 && src->fd != -1) {
+                source_lru_push(src);
+                n = take_idle_sources(fds);
+        }
+        pthread_mutex_unlock(&source_mutex);
+        close_sources(fds, n);
+}
+
+static void put_source(struct source *src)
+{
+        struct source **pp;
+        int fd;
+
+        pthread_mutex_lock(&source_mutex);
+        if (--src->refcount) {
+                pthread_mutex_unlock(&source_mutex);
+                return;
+        }
+        pp = &source_table[hash_path(src->path) % SOURCE_BUCKETS];
+        while (*pp != src) {
+                pp = &(*pp)->hash_next;
+        }
+        *pp = src->hash_next;
+        fd = src->fd;
+        if (fd != -1) {
+                source_lru_unlink(src);
+                num_source_fds--;
+        }
+        pthread_mutex_unlock(&source_mutex);
+        if (fd != -1) {
+                close_source(fd);
+        }
+        if (src->map) {
+                munmap(src->map, src->id.size);
+        }
+        free(src);
+}
+
+/* Returns the source of path in bucket, referenced, or NULL. Must be
+ * called with source_mutex held.
+ */
+static struct source *find_source(struct source *bucket, const char *path,
+                                  const struct file_id *id)
+{
+        struct source *src;
+
+        for (src = bucket; src; src = src->hash_next) {
+                if (same_file_id(&src->id, id) && !strcmp(src->path, path)) {
+                        src->refcount++;
+                        break;
+                }
+        }
+        return src;
+}
+
+/* Pin src, that was just referenced, and drop it again if that fails */
+static struct source *pin_found_source(struct source *src)
+{
+        int ret = pin_source(src);
+
+        if (ret == 0) {
+                return src;
+        }
+        put_source(src);
+        errno = -ret;
+        return NULL;
+}
+
+/* Returns the source of path, referenced and pinned, and its stat in st,
+ * or NULL with errno set.
+ */
+static struct source *get_source(const char *path, struct stat *st)
+{
+        struct source **bucket, *src, *old;
+        int fds[CLOSE_BATCH];
+        struct file_id id;
+        int fd, n, ret;
+
+        bucket = &source_table[hash_path(path) % SOURCE_BUCKETS];
+        if (fstatat(dir_fd, path, st, AT_NO_AUTOMOUNT) == 0) {
+                set_file_id(&id, st);
+                pthread_mutex_lock(&source_mutex);
+                src = find_source(*bucket, path, &id);
+                pthread_mutex_unlock(&source_mutex);
+                if (src) {
+                        return pin_found_source(src);
+                }
+        }
+
+        fd = open_source(path);
+        if (fd == -1) {
+                return NULL;
+        }
+        src = calloc(1, sizeof(*src) + strlen(path) + 1);
+        if (src == NULL || fstat(fd, st) == -1) {
+                ret = src ? errno : ENOMEM;
+                free(src);
+                close_source(fd);
+                errno = ret;
+                return NULL;
+        }
+        strcpy(src->path, path);
+        set_file_id(&src->id, st);
+        src->fd = fd;
+        src->refcount = 1;
+        src->pins = 1;
+        pthread_mutex_lock(&source_mutex);
+        /* Somebody else may have opened it while we were busy */
+        old = find_source(*bucket, path, &src->id);
+        if (old) {
+                pthread_mutex_unlock(&source_mutex);
+                close_source(fd);
+                free(src);
+                return pin_found_source(old);
+        }
+        src->hash_next = *bucket;
+        *bucket = src;
+        num_source_fds++;
+        n = take_idle_sources(fds);
+        pthread_mutex_unlock(&source_mutex);
+        close_sources(fds, n);
+        return src;
+}
+
+/* Map the compressed file of src, which must be pinned, so that blocks
+ * are decompressed from the page cache in place instead of being read
+ * with pread() first, see inflate_block(). The kernel is told what will
+ * be needed next from the index, see init_span(). Remote files are never
+ * mapped, and neither is anything if the map fails.
+ * Replacing the file is fine as the map keeps the old one, truncating it
+ * or rewriting it in place makes reads of the map fault, see map_sigbus().
+ */
+static void map_source(struct source *src)
+{
+        void *map;
+
+        if (!use_mmap || src->id.size <= 0 || is_remote_fd(src->fd) ||
+            __atomic_load_n(&src->map, __ATOMIC_ACQUIRE)) {
+                return;
+        }
+        pthread_mutex_lock(&source_mutex);
+        if (src->map == NULL) {
+                map = mmap(NULL, src->id.size, PROT_READ, MAP_SHARED,
+                           src->fd, 0);
+                if (map != MAP_FAILED) {
+                        __atomic_store_n(&src->map, map, __ATOMIC_RELEASE);
+                } else {
+                        LOG_INFO("MMAP [%s] %s\n", src->path,
+                                 strerror(errno));
+                }
+        }
+        pthread_mutex_unlock(&source_mutex);
+}
+
+/* The compressed data at caddr of a mapped file and how much of it there
+ * is, or NULL if the file is not mapped.
+ */
+static const unsigned char *map_data(struct file *file, uint64_t caddr,
+                                     size_t *len)
+{
+        const unsigned char *map;
+
+        if (file->src == NULL) {
+                return NULL;
+        }
+        map = __atomic_load_n(&file->src->map, __ATOMIC_ACQUIRE);
+        if (map == NULL) {
+                return NULL;
+        }
+        *len = caddr < (uint64_t)file->id.size ? file->id.size - caddr : 0;
+        return map + caddr;
+}
+
+/* Touching a page of a map that the file no longer has raises SIGBUS.
+ * Whoever reads a map sets map_fault first, and map_sigbus() jumps back
+ * there so that the read fails with EIO instead of taking down the mount.
+ * It is thread local as the signal is delivered to the thread that
+ * faulted, and the handler runs with SA_NODEFER so that the jump does not
+ * leave SIGBUS blocked.
+ */
+static __thread sigjmp_buf *map_fault;
+
+static void map_sigbus(int sig)
+{
+        if (map_fault == NULL) {
+                /* Not ours, the fault is taken again and kills us */
+                signal(sig, SIG_DFL);
+                return;
+        }
+        siglongjmp(*map_fault, 1);
+}
+
+static void init_map_sigbus(void)
+{
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = map_sigbus;
+        sa.sa_flags = SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, NULL);
+}
+
+/* fmt->block_size() and fmt->decompress() of data that is mapped if
+ * mapped is set, -EIO if the map faults.
+ */
+static ssize_t map_block_size(const struct format *fmt, int mapped,
+                              const unsigned char *buf, size_t len,
+                              uint32_t *ulen)
+{
+        sigjmp_buf jmp;
+        ssize_t ret;
+
+        if (!mapped) {
+                return fmt->block_size(buf, len, ulen);
+        }
+        if (sigsetjmp(jmp, 0)) {
+                map_fault = NULL;
+                return -EIO;
+        }
+        map_fault = &jmp;
+        ret = fmt->block_size(buf, len, ulen);
+        map_fault = NULL;
+        return ret;
+}
+
+static ssize_t map_decompress(const struct format *fmt, int mapped,
+                              const unsigned char *in, size_t in_len,
+                              unsigned char *out, size_t out_len)
+{
+        sigjmp_buf jmp;
+        ssize_t ret;
+
+        if (!mapped) {
+                return fmt->decompress(in, in_len, out, out_len);
+        }
+        if (sigsetjmp(jmp, 0)) {
+                map_fault = NULL;
+                return -EIO;
+        }
+        map_fault = &jmp;
+        ret = fmt->decompress(in, in_len, out, out_len);
+        map_fault = NULL;
+        return ret;
+}
+
+/* Handles keep the descriptor of their source in fd, which is only valid
+ * between pin_file() and unpin_file(). Files that were set up without a
+ * source, to work out a size or build an index, just own their fd.
+ */
+static int pin_file(struct file *file)
+{
+        int ret;
+
+        if (file->src == NULL) {
+                return 0;
+        }
+        ret = pin_source(file->src);
+        if (ret == 0 && file->fd != file->src->fd) {
+                /* Only after a reopen, when nobody is using the old one */
+                file->fd = file->src->fd;
+        }
+        return ret;
+}
+
+static void unpin_file(struct file *file)
+{
+        if (file->src) {
+                unpin_source(file->src);
+        }
+}
+
+#ifdef HAVE_ZSTD
+/* Seekable zstd: independent zstd frames followed by a skippable frame
+ * with the seek table,
+ * +------------------------------+
+ * |   0x184D2A5E   |    size     | 4 + 4 bytes
+ * +------------------------------+
+ * then for every frame
+ * +------------------------------+
+ * | compressed | decompressed | [checksum] | 4 + 4 + 4 bytes
+ * +------------------------------+
+ * and the footer
+ * +------------------------------+
+ * |   frames   | descriptor |   0x8F92EAB1   | 4 + 1 + 4 bytes
+ * +------------------------------+
+ * all in little endian byteorder. Bit 7 of the descriptor is set if the
+ * entries have a checksum, which is not needed since zstd checks the
+ * checksum of the frame itself.
+ * The seek table gives the index entries directly, one per frame, so
+ * frames have to be blocks as well: at most BGZF_MAX_BLOCK_SIZE in and out.
+ */
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define ZSTD_SEEK_FOOTER_SIZE 9
+
+static pthread_key_t zstd_key;
+static pthread_once_t zstd_once = PTHREAD_ONCE_INIT;
+
+static void free_zstd(void *ptr)
+{
+        ZSTD_freeDCtx(ptr);
+}
+
+static void create_zstd_key(void)
+{
+        pthread_key_create(&zstd_key, free_zstd);
+}
+
+static ssize_t zstd_block(const unsigned char *buf, size_t len,
+                          uint32_t *ulen)
+{
+        unsigned long long size;
+        size_t clen;
+
+        if (len < 4) {
+                return -1;
+        }
+        /* The seek table, or anything else after the frames */
+        if ((get_le32(buf) & 0xfffffff0) == 0x184d2a50) {
+                *ulen = 0;
+                return 0;
+        }
+        clen = ZSTD_findFrameCompressedSize(buf, len);
+        size = ZSTD_getFrameContentSize(buf, len);
+        if (ZSTD_isError(clen) || size == ZSTD_CONTENTSIZE_ERROR) {
+                return -1;
+        }
+        if (size == ZSTD_CONTENTSIZE_UNKNOWN) {
+                *ulen = UINT32_MAX;
+        } else if (size > BGZF_MAX_BLOCK_SIZE) {
+                return -1;
+        } else {
+                *ulen = size;
+        }
+        return clen;
+}
+
+static ssize_t zstd_decompress(const unsigned char *in, size_t in_len,
+                               unsigned char *out, size_t out_len)
+{
+        ZSTD_DCtx *dctx;
+        size_t n;
+
+        pthread_once(&zstd_once, create_zstd_key);
+        dctx = pthread_getspecific(zstd_key);
+        if (dctx == NULL) {
+                dctx = ZSTD_createDCtx();
+                if (dctx == NULL) {
+                        return -EIO;
+                }
+                pthread_setspecific(zstd_key, dctx);
+        }
+        n = ZSTD_decompressDCtx(dctx, out, out_len, in, in_len);
+        if (ZSTD_isError(n)) {
+                return ZSTD_getErrorCode(n) == ZSTD_error_checksum_wrong ?
+                       -EBADMSG : -EIO;
+        }
+        return n;
+}
+
+/* Whether the compressed file path ends with a seek table */
+static int has_seek_table(const char *path)
+{
+        unsigned char footer[ZSTD_SEEK_FOOTER_SIZE];
+        struct stat st;
+        int fd, ret;
+
+        if (fstatat(dir_fd, path, &st, AT_NO_AUTOMOUNT) != 0 ||
+            st.st_size < 8 + ZSTD_SEEK_FOOTER_SIZE) {
+                return 0;
+        }
+        fd = open_source(path);
+        if (fd == -1) {
+                return 0;
+        }
+        ret = source_pread(fd, footer, sizeof(footer),
+                           st.st_size - sizeof(footer)) == sizeof(footer) &&
+              get_le32(footer + 5) == ZSTD_SEEKABLE_MAGIC;
+        close_source(fd);
+        return ret;
+}
+
+/* Read the seek table at the end of path into a new, uncached,
+ * bgzf_index with an entry per frame. The frames have to cover the file
+ * up to the seek table.
+ */
+static struct bgzf_index *load_seek_table(const char *path)
+{
+        unsigned char footer[ZSTD_SEEK_FOOTER_SIZE];
+        unsigned char *buf = NULL;
+        struct bgzf_index *idx = NULL;
+        uint64_t caddr = 0, uaddr = 0;
+        size_t esize, tsize;
+        uint32_t nframes;
+        struct stat st;
+        uint32_t i;
+        int fd;
+
+        LOG("LOAD_SEEK_TABLE [%s]\n", path);
+
+        if (fstatat(dir_fd, path, &st, AT_NO_AUTOMOUNT) != 0) {
+                return NULL;
+        }
+        fd = open_source(path);
+        if (fd == -1) {
+                return NULL;
+        }
+        if (st.st_size < 8 + ZSTD_SEEK_FOOTER_SIZE ||
+            source_pread(fd, footer, sizeof(footer),
+                         st.st_size - sizeof(footer)) != sizeof(footer) ||
+            get_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC) {
+                goto invalid;
+        }
+        nframes = get_le32(footer);
+        esize = footer[4] & 0x80 ? 12 : 8;
+        if (nframes >= (uint64_t)st.st_size / esize) {
+                goto invalid;
+        }
+        tsize = 8 + nframes * esize + ZSTD_SEEK_FOOTER_SIZE;
+        if (tsize > (uint64_t)st.st_size) {
+                goto invalid;
+        }
+        buf = malloc(tsize);
+        if (buf == NULL) {
+                goto finished;
+        }
+        if (source_pread(fd, buf, tsize, st.st_size - tsize) !=
+            (ssize_t)tsize || get_le32(buf) != ZSTD_SKIPPABLE_MAGIC ||
+            get_le32(buf + 4) != tsize - 8) {
+                goto invalid;
+        }
+
+        idx = calloc(1, sizeof(*idx));
+        if (idx == NULL) {
+                goto finished;
+        }
+        idx->path = strdup(path);
+        idx->noffs = nframes ? nframes : 1;
+        idx->offs = calloc(idx->noffs, sizeof(bgzidx1_t));
+        if (idx->path == NULL || idx->offs == NULL) {
+                goto failed;
+        }
+        set_file_id(&idx->id, &st);
+        for (i = 0; i < nframes; i++) {
+                uint32_t csize = get_le32(buf + 8 + i * esize);
+                uint32_t dsize = get_le32(buf + 12 + i * esize);
+
+                if (csize == 0 || csize > BGZF_MAX_BLOCK_SIZE ||
+                    dsize > BGZF_MAX_BLOCK_SIZE) {
+                        LOG_ERROR("LOAD_SEEK_TABLE [%s] frame %u is larger "
+                                  "than %d bytes\n", path, i,
+                                  BGZF_MAX_BLOCK_SIZE);
+                        goto failed;
+                }
+                idx->offs[i].caddr = caddr;
+                idx->offs[i].uaddr = uaddr;
+                caddr += csize;
+                uaddr += dsize;
+        }
+        idx->usize = uaddr;
+        if (caddr != st.st_size - tsize) {
+                free_index(idx);
+                idx = NULL;
+                goto invalid;
+        }
+        goto finished;
+
+failed:
+        free_index(idx);
+        idx = NULL;
+        goto finished;
+invalid:
+        LOG_ERROR("LOAD_SEEK_TABLE [%s] invalid seek table\n", path);
+finished:
+        free(buf);
+        close_source(fd);
+        return idx;
+}
+#endif
+
+/* Decompress the block starting at compressed offset caddr.
+ * The compressed data is read with pread() unless the caller already has
+ * the len bytes at caddr in data or the file is mapped, and is
+ * decompressed with thread local state, so any number of threads can do
+ * this concurrently on the same handle. The data is checked against the
+ * checksum of the block, for BGZF only with --verify-crc, once, before it
+ * goes into the block cache.
+ * Returns a block with a single reference owned by the caller, or NULL
+ * on error. A block with clen == 0 marks the end of the file.
+ */
+static struct cached_block *inflate_block(struct file *file, uint64_t caddr,
+                                          const unsigned char *data,
+                                          size_t len)
+{
+        unsigned char buf[BGZF_MAX_BLOCK_SIZE];
+        const unsigned char *cdata = data;
+        struct cached_block *blk, *tmp;
+        ssize_t bsize = 0, n;
+        ssize_t count = len;
+        uint32_t isize = 0;
+        uint64_t start;
+        int mapped = 0;
+
+        if (data == NULL) {
+                cdata = map_data(file, caddr, &len);
+                count = len < sizeof(buf) ? len : sizeof(buf);
+                mapped = cdata != NULL;
+        }
+        if (cdata == NULL) {
+                count = source_pread(file->fd, buf, sizeof(buf), caddr);
+                if (count < 0) {
+                        return NULL;
+                }
+                count_stat(STAT_IO_READS, 1);
+                count_stat(STAT_IO_SUBMITS, 1);
+                count_stat(STAT_IO_BYTES, count);
+                cdata = buf;
+        }
+        if (count > 0) {
+                bsize = map_block_size(file->fmt, mapped, cdata, count,
+                                       &isize);
+        }
+        if (bsize == -EIO && mapped) {
+                LOG_ERROR("INFLATE_BLOCK [%s] changed while mapped\n",
+                          file->src->path);
+                return NULL;
+        }
+        if (bsize < 0 || bsize > count ||
+            (isize > BGZF_MAX_BLOCK_SIZE && isize != UINT32_MAX)) {
+                LOG_ERROR("INFLATE_BLOCK invalid block header at %" PRIu64
+                          "\n", caddr);
+                return NULL;
+        }
+
+        /* The size is only known once it is decompressed */
+        blk = malloc(sizeof(*blk) +
+                     (isize == UINT32_MAX ? BGZF_MAX_BLOCK_SIZE : isize));
+        if (blk == NULL) {
+                return NULL;
+        }
+        memset(blk, 0, sizeof(*blk));
+        blk->id = file->id;
+        blk->caddr = caddr;
+        blk->clen = bsize;
+        blk->ulen = isize;
+        blk->refcount = 1;
+        if (isize == 0) {
+                return blk;
+        }
+
+        start = now_ns();
+        n = map_decompress(file->fmt, mapped, cdata, bsize, blk->data,
+                           isize == UINT32_MAX ? BGZF_MAX_BLOCK_SIZE :
+                           isize);
+        if (n == -EBADMSG) {
+                LOG_ERROR("INFLATE_BLOCK checksum mismatch in block at %"
+                          PRIu64 "\n", caddr);
+                count_stat(STAT_CRC_ERRORS, 1);
+                free(blk);
+                return NULL;
+        }
+        if (n < 0 || (isize != UINT32_MAX && n != isize)) {
+                LOG_ERROR("INFLATE_BLOCK failed to inflate block at %" PRIu64
+                          "\n", caddr);
+                free(blk);
+                return NULL;
+        }
+        if (isize == UINT32_MAX) {
+                isize = blk->ulen = n;
+                tmp = realloc(blk, sizeof(*blk) + n);
+                if (tmp) {
+                        blk = tmp;
+                }
+        }
+        count_stat(STAT_INFLATE_NS, now_ns() - start);
+        count_stat(STAT_BLOCKS_INFLATED, 1);
+        count_stat(STAT_BYTES_INFLATED, isize);
+
+        return blk;
+}
+
+/* Return the last index entry that starts at or before offset. */
+static int find_index_entry(const struct bgzf_index *idx, uint64_t offset)
+{
+        int lo = 0, hi = idx->noffs - 1;
+
+        if (idx->offs == NULL) {
+                const unsigned char *p;
+                bgzidx1_t ent, next;
+                int e;
+
+                hi = compact_samples(idx->noffs) - 1;
+                while (lo < hi) {
+                        int mid = lo + (hi - lo + 1) / 2;
+
+                        if (get_le64(idx->samples +
+                                     mid * COMPACT_SAMPLE_SIZE) <= offset) {
+                                lo = mid;
+                        } else {
+                                hi = mid - 1;
+                        }
+                }
+                e = lo * COMPACT_SAMPLE;
+                ent = compact_sample(idx, lo, &p);
+                while (e + 1 < idx->noffs && (e + 1) % COMPACT_SAMPLE) {
+                        next = ent;
+                        next_compact_entry(idx, &next, &p);
+                        if (next.uaddr > offset) {
+                                break;
+                        }
+                        ent = next;
+                        e++;
+                }
+                return e;
+        }
+
+        while (lo < hi) {
+                int mid = lo + (hi - lo + 1) / 2;
+
+                if (idx->offs[mid].uaddr <= offset) {
+                        lo = mid;
+                } else {
+                        hi = mid - 1;
+                }
+        }
+        return lo;
+}
+
+/* The compressed data of a range of index entries, read with as few
+ * requests as possible before a batch of jobs inflates them, instead
+ * of one pread() per block. Entries whose first block is cached are not
+ * read. The first job that needs the data reads it, see fetch_span(),
+ * and the others wait for that.
+ */
+struct cspan {
+        pthread_mutex_t mutex;
+        int fetched;
+        int n;
+        uint64_t *starts;       /* n + 1 compressed offsets, one per entry */
+        uint8_t *valid;         /* whether the data of each entry was read */
+        unsigned char *data;    /* from starts[0], NULL to just pread() */
+};
+
+/* Larger spans are read block by block */
+#define CSPAN_MAX (16 * 1024 * 1024)
+
+/* With io_uring, or from a remote, a run of entries is read with
+ * requests of this size, so that they can be in flight at the same time.
+ */
+#define CSPAN_CHUNK (256 * 1024)
+
+/* A read of len bytes at off into buf, res is what the read returned */
+struct extent {
+        unsigned char *buf;
+        size_t len;
+        uint64_t off;
+        ssize_t res;
+};
+
+enum {
+        IO_PREAD,
+        IO_URING,
+};
+
+#ifdef HAVE_LIBURING
+static int io_engine = IO_URING;
+#else
+static int io_engine = IO_PREAD;
+#endif
+
+#ifdef HAVE_LIBURING
+#define URING_DEPTH 64
+
+/* Every thread that reads has its own ring, so submitting never takes a
+ * lock. NULL if a ring could not be set up, then pread() is used.
+ */
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+
+static void free_uring(void *ptr)
+{
+        struct io_uring *ring = ptr;
+
+        io_uring_queue_exit(ring);
+        free(ring);
+}
+
+static void create_uring_key(void)
+{
+        pthread_key_create(&uring_key, free_uring);
+}
+
+static struct io_uring *get_uring(void)
+{
+        struct io_uring *ring;
+
+        pthread_once(&uring_once, create_uring_key);
+        ring = pthread_getspecific(uring_key);
+        if (ring) {
+                return ring;
+        }
+        ring = malloc(sizeof(*ring));
+        if (ring == NULL) {
+                return NULL;
+        }
+        if (io_uring_queue_init(URING_DEPTH, ring, 0) < 0) {
+                LOG_INFO("io_uring is not available, using pread\n");
+                free(ring);
+                __atomic_store_n(&io_engine, IO_PREAD, __ATOMIC_RELAXED);
+                return NULL;
+        }
+        pthread_setspecific(uring_key, ring);
+        return ring;
+}
+
+/* Submit the reads in waves of up to URING_DEPTH and reap them all.
+ * The ones that could not be submitted are left with res 0.
+ */
+static void uring_read_extents(int fd, struct extent *ext, int n)
+{
+        struct io_uring *ring = get_uring();
+        int i = 0, queued, submitted, ret;
+
+        if (ring == NULL) {
+                return;
+        }
+        while (i < n) {
+                for (queued = 0; queued < URING_DEPTH && i + queued < n;
+                     queued++) {
+                        struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+                        struct extent *e = &ext[i + queued];
+
+                        if (sqe == NULL) {
+                                break;
+                        }
+                        io_uring_prep_read(sqe, fd, e->buf, e->len, e->off);
+                        io_uring_sqe_set_data(sqe, e);
+                }
+                ret = io_uring_submit_and_wait(ring, queued);
+                submitted = ret < 0 ? 0 : ret;
+                count_stat(STAT_IO_SUBMITS, 1);
+                count_stat(STAT_IO_READS, submitted);
+                while (submitted--) {
+                        struct io_uring_cqe *cqe;
+                        struct extent *e;
+
+                        while ((ret = io_uring_wait_cqe(ring, &cqe)) ==
+                               -EINTR) {
+                        }
+                        if (ret < 0) {
+                                break;
+                        }
+                        e = io_uring_cqe_get_data(cqe);
+                        e->res = cqe->res;
+                        io_uring_cqe_seen(ring, cqe);
+                }
+                if (ret < 0) {
+                        /* The ones still queued go away with the ring */
+                        LOG_ERROR("io_uring failed %s, using pread\n",
+                                  strerror(-ret));
+                        pthread_setspecific(uring_key, NULL);
+                        free_uring(ring);
+                        return;
+                }
+                i += queued;
+        }
+}
+#endif
+
+/* Defined with the inflate workers */
+static void run_batch(void (*fn)(void *arg, int i), void *arg, int n,
+                      struct file *owner);
+
+struct remote_extents {
+        int fd;
+        struct extent *ext;
+};
+
+static void remote_extent_job(void *arg, int i)
+{
+        struct remote_extents *re = arg;
+        struct extent *e = &re->ext[i];
+
+        e->res = source_pread(re->fd, e->buf, e->len, e->off);
+        if (e->res > 0) {
+                count_stat(STAT_IO_READS, 1);
+                count_stat(STAT_IO_SUBMITS, 1);
+        }
+}
+
+/* Read every extent, completing short reads with pread(). The range
+ * requests for a remote file are issued in parallel by the inflate
+ * workers.
+ */
+static void read_extents(int fd, struct extent *ext, int n)
+{
+        struct remote_extents re;
+        int i;
+
+        for (i = 0; i < n; i++) {
+                ext[i].res = 0;
+        }
+        if (is_remote_fd(fd)) {
+                re.fd = fd;
+                re.ext = ext;
+                run_batch(remote_extent_job, &re, n, NULL);
+#ifdef HAVE_LIBURING
+        } else if (__atomic_load_n(&io_engine, __ATOMIC_RELAXED) ==
+                   IO_URING) {
+                uring_read_extents(fd, ext, n);
+#endif
+        }
+        for (i = 0; i < n; i++) {
+                struct extent *e = &ext[i];
+
+                if (e->res < 0) {
+                        continue;
+                }
+                while ((size_t)e->res < e->len) {
+                        ssize_t count = source_pread(fd, e->buf + e->res,
+                                                     e->len - e->res,
+                                                     e->off + e->res);
+
+                        count_stat(STAT_IO_READS, 1);
+                        count_stat(STAT_IO_SUBMITS, 1);
+                        if (count <= 0) {
+                                e->res = -1;
+                                break;
+                        }
+                        e->res += count;
+                }
+                if (e->res > 0) {
+                        count_stat(STAT_IO_BYTES, e->res);
+                }
+        }
+}
+
+/* Set up span to cover index entries first .. first + n - 1 of file,
+ * nothing is read until fetch_span(). Returns -1 if the span is not
+ * worth it, then the entries are read block by block. That is always the
+ * case for a mapped file, whose pages for the span are asked for with
+ * MADV_WILLNEED instead.
+ */
+static int init_span(struct cspan *span, struct file *file,
+                     const struct bgzf_index *idx, int first, int n)
+{
+        const unsigned char *data;
+        uintptr_t start;
+        size_t len;
+        int i;
+
+        memset(span, 0, sizeof(*span));
+        if (n < 2) {
+                return -1;
+        }
+        span->starts = malloc((n + 1) * sizeof(uint64_t));
+        span->valid = calloc(n, 1);
+        if (span->starts == NULL || span->valid == NULL) {
+                goto failed;
+        }
+        for (i = 0; i <= n; i++) {
+                span->starts[i] = first + i < idx->noffs ?
+                        index_entry(idx, first + i).caddr :
+                        (uint64_t)file->id.size;
+        }
+        if (span->starts[n] < span->starts[0] ||
+            span->starts[n] - span->starts[0] > CSPAN_MAX) {
+                goto failed;
+        }
+        data = map_data(file, span->starts[0], &len);
+        if (data) {
+                /* Used in place, just have the kernel read it in now */
+                start = (uintptr_t)data & ~((uintptr_t)getpagesize() - 1);
+                madvise((void *)start, (uintptr_t)data + span->starts[n] -
+                        span->starts[0] - start, MADV_WILLNEED);
+                goto failed;
+        }
+        span->n = n;
+        pthread_mutex_init(&span->mutex, NULL);
+        return 0;
+
+failed:
+        free(span->starts);
+        free(span->valid);
+        return -1;
+}
+
+static void free_span(struct cspan *span)
+{
+        if (span->n == 0) {
+                return;
+        }
+        pthread_mutex_destroy(&span->mutex);
+        free(span->starts);
+        free(span->valid);
+        free(span->data);
+}
+
+/* Read the entries of span that are not cached, merging neighbours into
+ * one read, or into CSPAN_CHUNK sized reads that are all submitted at
+ * once with io_uring. Only the first caller reads, the others wait.
+ */
+static void fetch_span(struct cspan *span, struct file *file)
+{
+        struct extent *ext = NULL;
+        uint64_t base;
+        int i, j, n = 0, split;
+
+        pthread_mutex_lock(&span->mutex);
+        if (span->fetched) {
+                pthread_mutex_unlock(&span->mutex);
+                return;
+        }
+        span->fetched = 1;
+
+        base = span->starts[0];
+        split = is_remote_fd(file->fd) ||
+                __atomic_load_n(&io_engine, __ATOMIC_RELAXED) == IO_URING;
+        for (i = 0; i < span->n; i++) {
+                struct cached_block *blk;
+
+                blk = block_cache_get(&file->id, span->starts[i]);
+                if (blk) {
+                        block_cache_put(blk);
+                } else if (!disk_cache_has(&file->id, span->starts[i])) {
+                        span->valid[i] = 1;
+                }
+        }
+        span->data = malloc(span->starts[span->n] - base);
+        ext = malloc(((span->starts[span->n] - base) / CSPAN_CHUNK +
+                      2 * span->n) * sizeof(*ext));
+        if (span->data == NULL || ext == NULL) {
+                goto failed;
+        }
+        for (i = 0; i < span->n; i = j) {
+                uint64_t off, end;
+
+                if (!span->valid[i]) {
+                        j = i + 1;
+                        continue;
+                }
+                for (j = i + 1; j < span->n && span->valid[j]; j++) {
+                }
+                for (off = span->starts[i]; off < span->starts[j];
+                     off = end) {
+                        /* Split at aligned offsets */
+                        end = (off / CSPAN_CHUNK + 1) * CSPAN_CHUNK;
+                        if (end > span->starts[j] || !split) {
+                                end = span->starts[j];
+                        }
+                        ext[n].buf = span->data + (off - base);
+                        ext[n].off = off;
+                        ext[n].len = end - off;
+                        n++;
+                }
+        }
+        read_extents(file->fd, ext, n);
+        for (i = 0; i < n; i++) {
+                if (ext[i].res < 0) {
+                        goto failed;
+                }
+        }
+        free(ext);
+        pthread_mutex_unlock(&span->mutex);
+        return;
+
+failed:
+        /* Leave it to pread() */
+        free(ext);
+        free(span->data);
+        span->data = NULL;
+        pthread_mutex_unlock(&span->mutex);
+}
+
+/* The compressed data at caddr if span has it, and how much of it */
+static const unsigned char *span_data(struct cspan *span, struct file *file,
+                                      uint64_t caddr, size_t *len)
+{
+        int lo = 0, hi;
+
+        if (span == NULL || span->n == 0) {
+                return NULL;
+        }
+        fetch_span(span, file);
+        if (span->data == NULL || caddr < span->starts[0] ||
+            caddr >= span->starts[span->n]) {
+                return NULL;
+        }
+        hi = span->n - 1;
+        while (lo < hi) {
+                int mid = lo + (hi - lo + 1) / 2;
+
+                if (span->starts[mid] <= caddr) {
+                        lo = mid;
+                } else {
+                        hi = mid - 1;
+                }
+        }
+        if (!span->valid[lo]) {
+                return NULL;
+        }
+        *len = span->starts[lo + 1] - caddr;
+        return span->data + (caddr - span->starts[0]);
+}
+
+/* Returns the referenced block at caddr from the block cache,
+ * decompressing it on a miss, from span if that has it.
+ */
+static struct cached_block *get_span_block(struct file *file,
+                                           uint64_t caddr,
+                                           struct cspan *span)
+{
+        struct inflight_block *claim;
+        const unsigned char *data;
+        struct cached_block *blk;
+        size_t len = 0;
+
+        blk = block_cache_get(&file->id, caddr);
+        if (blk) {
+                count_stat(STAT_BLOCK_HITS, 1);
+                disk_cache_admit(blk, 1);
+                return blk;
+        }
+        count_stat(STAT_BLOCK_MISSES, 1);
+        blk = block_cache_wait(&file->id, caddr, &claim);
+        if (blk) {
+                return blk;
+        }
+        blk = disk_cache_get(&file->id, caddr);
+        if (blk) {
+                return block_inflight_done(claim, block_cache_insert(blk));
+        }
+        data = span_data(span, file, caddr, &len);
+        blk = inflate_block(file, caddr, data, len);
+        if (blk) {
+                blk = block_cache_insert(blk);
+                disk_cache_admit(blk, 0);
+        }
+        return block_inflight_done(claim, blk);
+}
+
+static struct cached_block *get_block(struct file *file, uint64_t caddr)
+{
+        return get_span_block(file, caddr, NULL);
+}
+
+static void run_batch_jobs(struct batch *b)
+{
+        int i;
+
+        while ((i = __atomic_fetch_add(&b->job, 1, __ATOMIC_RELAXED)) < b->n) {
+                b->fn(b->arg, i);
+        }
+}
+
+/* Must be called with pool_mutex held */
+static void unqueue_batch(struct batch *b)
+{
+        struct batch **pp, *prev = NULL;
+
+        for (pp = &pool_head[b->prio]; *pp != b; pp = &(*pp)->next) {
+                prev = *pp;
+        }
+        *pp = b->next;
+        if (pool_tail[b->prio] == b) {
+                pool_tail[b->prio] = prev;
+        }
+        b->next = NULL;
+        b->queued = 0;
+}
+
+/* Must be called with pool_mutex held */
+static void enqueue_batch(struct batch *b)
+{
+        b->next = NULL;
+        b->queued = 1;
+        if (pool_tail[b->prio]) {
+                pool_tail[b->prio]->next = b;
+        } else {
+                pool_head[b->prio] = b;
+        }
+        pool_tail[b->prio] = b;
+}
+
+static int batch_load(struct batch *b)
+{
+        return b->owner ? b->owner->pool_jobs : b->users;
+}
+
+/* Must be called with pool_mutex held. Readahead is left to at most all
+ * but one of the workers, so that one is always ready for a read.
+ */
+static struct batch *pick_batch(void)
+{
+        struct batch *b, *best = NULL;
+        int p, i;
+
+        for (p = 0; p < NUM_PRIOS && best == NULL; p++) {
+                if (p == PRIO_BACKGROUND && inflate_threads > 1 &&
+                    background_jobs >= inflate_threads - 1) {
+                        break;
+                }
+                b = pool_head[p];
+                for (i = 0; b && i < POOL_SCAN; i++, b = b->next) {
+                        if (best == NULL || batch_load(b) < batch_load(best)) {
+                                best = b;
+                        }
+                }
+        }
+        return best;
+}
+
+/* Whether the thread is running a readahead job, so that the batches it
+ * submits itself are not served ahead of the reads that are waiting.
+ */
+static pthread_key_t background_key;
+
+static void *inflate_worker(void *arg)
+{
+        struct batch *b;
+        int i;
+
+        pthread_mutex_lock(&pool_mutex);
+        while (1) {
+                b = pick_batch();
+                if (b == NULL) {
+                        pthread_cond_wait(&pool_cond, &pool_mutex);
+                        continue;
+                }
+                i = __atomic_fetch_add(&b->job, 1, __ATOMIC_RELAXED);
+                if (i >= b->n - 1 || b->next) {
+                        /* Done handing out, or let the others have a go */
+                        unqueue_batch(b);
+                        if (i < b->n - 1) {
+                                enqueue_batch(b);
+                        }
+                }
+                if (i >= b->n) {
+                        if (b->users == 0 && b->detached) {
+                                pthread_mutex_unlock(&pool_mutex);
+                                if (b->destructor) {
+                                        b->destructor(b->arg);
+                                }
+                                free(b);
+                                pthread_mutex_lock(&pool_mutex);
+                        }
+                        continue;
+                }
+                b->users++;
+                if (b->owner) {
+                        b->owner->pool_jobs++;
+                }
+                if (b->prio == PRIO_BACKGROUND) {
+                        background_jobs++;
+                }
+                pthread_mutex_unlock(&pool_mutex);
+
+                pthread_setspecific(background_key,
+                                    b->prio == PRIO_BACKGROUND ? b : NULL);
+                b->fn(b->arg, i);
+
+                pthread_mutex_lock(&pool_mutex);
+                if (b->prio == PRIO_BACKGROUND) {
+                        background_jobs--;
+                        /* A worker may have been held back for the limit */
+                        if (pool_head[PRIO_BACKGROUND]) {
+                                pthread_cond_signal(&pool_cond);
+                        }
+                }
+                if (b->owner) {
+                        b->owner->pool_jobs--;
+                }
+                if (--b->users || b->queued) {
+                        continue;
+                }
+                if (!b->detached) {
+                        pthread_cond_signal(&b->done);
+                } else {
+                        pthread_mutex_unlock(&pool_mutex);
+                        if (b->destructor) {
+                                b->destructor(b->arg);
+                        }
+                        free(b);
+                        pthread_mutex_lock(&pool_mutex);
+                }
+        }
+        return NULL;
+}
+
+/* Parse a list of CPUs such as 0-3,8. Returns -1 if it is not valid. */
+static int parse_cpu_list(const char *str, cpu_set_t *set)
+{
+        unsigned long first, last;
+        char *end;
+
+        CPU_ZERO(set);
+        do {
+                first = strtoul(str, &end, 10);
+                last = first;
+                if (end == str) {
+                        return -1;
+                }
+                if (*end == '-') {
+                        str = end + 1;
+                        last = strtoul(str, &end, 10);
+                        if (end == str || last < first) {
+                                return -1;
+                        }
+                }
+                if (last >= CPU_SETSIZE) {
+                        return -1;
+                }
+                for (; first <= last; first++) {
+                        CPU_SET(first, set);
+                }
+                str = end + 1;
+        } while (*end == ',');
+        return *end ? -1 : 0;
+}
+
+static void start_inflate_workers(void)
+{
+        pthread_attr_t attr;
+        pthread_t thread;
+        int i;
+
+        if (inflate_threads < 0 && CPU_COUNT(&inflate_cpus)) {
+                inflate_threads = CPU_COUNT(&inflate_cpus);
+        } else if (inflate_threads < 0) {
+                inflate_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        pthread_key_create(&background_key, NULL);
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (CPU_COUNT(&inflate_cpus)) {
+                pthread_attr_setaffinity_np(&attr, sizeof(inflate_cpus),
+                                            &inflate_cpus);
+        }
+        for (i = 0; i < inflate_threads; i++) {
+                if (pthread_create(&thread, &attr, inflate_worker, NULL)) {
+                        LOG_ERROR("Failed to create inflate worker %s\n",
+                            strerror(errno));
+                        inflate_threads = i;
+                        break;
+                }
+        }
+        pthread_attr_destroy(&attr);
+}
+
+static void queue_batch(struct batch *b)
+{
+        pthread_mutex_lock(&pool_mutex);
+        enqueue_batch(b);
+        if (b->n == 1) {
+                pthread_cond_signal(&pool_cond);
+        } else {
+                pthread_cond_broadcast(&pool_cond);
+        }
+        pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Run all jobs of a batch, using idle workers from the pool, and return
+ * once every job has completed. owner is the file the jobs are for.
+ */
+static void run_batch(void (*fn)(void *arg, int i), void *arg, int n,
+                      struct file *owner)
+{
+        struct batch b;
+
+        memset(&b, 0, sizeof(b));
+        b.fn = fn;
+        b.arg = arg;
+        b.n = n;
+        b.owner = owner;
+        b.prio = inflate_threads > 0 && pthread_getspecific(background_key) ?
+                PRIO_BACKGROUND : PRIO_DEMAND;
+        pthread_cond_init(&b.done, NULL);
+
+        if (n > 1 && inflate_threads > 0) {
+                queue_batch(&b);
+        }
+
+        run_batch_jobs(&b);
+
+        /* All jobs have been handed out. Make sure no more workers pick up
+         * this batch and wait for the ones that did.
+         */
+        pthread_mutex_lock(&pool_mutex);
+        if (b.queued) {
+                unqueue_batch(&b);
+        }
+        while (b.users) {
+                pthread_cond_wait(&b.done, &pool_mutex);
+        }
+        pthread_mutex_unlock(&pool_mutex);
+        pthread_cond_destroy(&b.done);
+}
+
+/* Queue a batch of readahead jobs for the workers and return without
+ * waiting for them. destructor(arg) is called once all jobs have
+ * completed. Returns -1 if there are no workers to run it.
+ */
+static int start_batch(void (*fn)(void *arg, int i), void *arg, int n,
+                       struct file *owner, void (*destructor)(void *arg))
+{
+        struct batch *b;
+
+        if (inflate_threads <= 0 || n <= 0) {
+                return -1;
+        }
+        b = calloc(1, sizeof(*b));
+        if (b == NULL) {
+                return -1;
+        }
+        b->fn = fn;
+        b->arg = arg;
+        b->n = n;
+        b->prio = PRIO_BACKGROUND;
+        b->owner = owner;
+        b->detached = 1;
+        b->destructor = destructor;
+        queue_batch(b);
+        return 0;
+}
+
+/* Copy size bytes at offset out of the uncompressed data, walking block by
+ * block from the block at caddr which starts at uaddr in the uncompressed
+ * data, with the compressed data from span if it is not NULL.
+ * Returns the number of bytes copied, which is only short at the end of
+ * the file, or -EIO.
+ */
+static int read_range(struct file *file, char *buf, size_t size,
+                      off_t offset, uint64_t caddr, uint64_t uaddr,
+                      struct cspan *span)
+{
+        size_t count = 0;
+
+        while (count < size) {
+                struct cached_block *blk;
+                uint64_t pos = offset + count;
+
+                blk = get_span_block(file, caddr, span);
+                if (blk == NULL) {
+                        return count ? count : -EIO;
+                }
+                if (blk->clen == 0) {
+                        block_cache_put(blk);
+                        break;
+                }
+                if (pos < uaddr + blk->ulen) {
+                        size_t len = uaddr + blk->ulen - pos;
+
+                        if (len > size - count) {
+                                len = size - count;
+                        }
+                        memcpy(buf + count, blk->data + (pos - uaddr), len);
+                        count += len;
+                }
+                uaddr += blk->ulen;
+                caddr += blk->clen;
+                block_cache_put(blk);
+        }
+
+        return count;
+}
+
+/* A large read split up by index entry, so that the blocks can be
+ * inflated in parallel straight into the reply buffer.
+ */
+struct parallel_read {
+        struct file *file;
+        char *buf;
+        size_t size;
+        off_t offset;
+        int first;      /* index entry of the first job */
+        int *counts;    /* result of read_range() for each job */
+        size_t *wants;  /* bytes each job should have read */
+        struct cspan span;
+};
+
+static void parallel_read_job(void *arg, int i)
+{
+        struct parallel_read *pr = arg;
+        struct bgzf_index *idx = pr->file->idx;
+        int e = pr->first + i;
+        bgzidx1_t ent = index_entry(idx, e);
+        uint64_t start, end;
+
+        start = ent.uaddr;
+        if (start < (uint64_t)pr->offset) {
+                start = pr->offset;
+        }
+        end = pr->offset + pr->size;
+        if (e + 1 < idx->noffs && index_entry(idx, e + 1).uaddr < end) {
+                end = index_entry(idx, e + 1).uaddr;
+        }
+        pr->wants[i] = end - start;
+        pr->counts[i] = read_range(pr->file, pr->buf + (start - pr->offset),
+                                   end - start, start, ent.caddr, ent.uaddr,
+                                   &pr->span);
+}
+
+/* Consume len bytes of input of an inflate stream that reads the file at
+ * *in_pos, the ones that have not been read yet are skipped in the file.
+ */
+static void skip_input(z_stream *zs, uint64_t *in_pos, size_t len)
+{
+        size_t n = len < zs->avail_in ? len : zs->avail_in;
+
+        zs->next_in += n;
+        zs->avail_in -= n;
+        *in_pos += len - n;
+}
+
+/* Inflate span e of a plain gzip file, from its checkpoint up to the next
+ * one, into the block cache in ZRAN_CHUNK pieces. Returns the referenced
+ * piece that starts at want, or NULL on error or if there is no such
+ * piece.
+ */
+static struct cached_block *inflate_span(struct file *file,
+                                         struct bgzf_index *idx, int e,
+                                         uint64_t want)
+{
+        struct cached_block *blk = NULL, *found = NULL;
+        uint64_t uaddr = idx->offs[e].uaddr;
+        uint64_t in_pos = idx->offs[e].caddr;
+        unsigned char input[16384];
+        int bits = idx->bits[e];
+        z_stream zs = {0};
+        uint64_t end, start = now_ns();
+        ssize_t count;
+        size_t len;
+        int ret, raw = 1;
+
+        end = e + 1 < idx->noffs ? idx->offs[e + 1].uaddr : idx->usize;
+        if (inflateInit2(&zs, -15) != Z_OK) {
+                return NULL;
+        }
+        if (bits) {
+                if (source_pread(file->fd, input, 1, in_pos - 1) != 1) {
+                        goto failed;
+                }
+                inflatePrime(&zs, bits, input[0] >> (8 - bits));
+        }
+        inflateSetDictionary(&zs, idx->windows + (size_t)e * ZRAN_WINDOW,
+                             ZRAN_WINDOW);
+
+        for (; uaddr < end; uaddr += len) {
+                len = end - uaddr < ZRAN_CHUNK ? end - uaddr : ZRAN_CHUNK;
+                blk = malloc(sizeof(*blk) + len);
+                if (blk == NULL) {
+                        goto failed;
+                }
+                memset(blk, 0, sizeof(*blk));
+                blk->id = file->id;
+                blk->caddr = uaddr;
+                blk->clen = len;
+                blk->ulen = len;
+                blk->refcount = 1;
+
+                zs.next_out = blk->data;
+                zs.avail_out = len;
+                while (zs.avail_out) {
+                        if (zs.avail_in == 0) {
+                                count = source_pread(file->fd, input,
+                                                     sizeof(input), in_pos);
+                                if (count <= 0) {
+                                        goto failed;
+                                }
+                                in_pos += count;
+                                zs.next_in = input;
+                                zs.avail_in = count;
+                        }
+                        ret = inflate(&zs, Z_NO_FLUSH);
+                        if (ret == Z_STREAM_END) {
+                                /* The next member starts after the
+                                 * trailer of this one, which only
+                                 * inflate in gzip mode reads itself.
+                                 */
+                                if (raw) {
+                                        skip_input(&zs, &in_pos, 8);
+                                        inflateReset2(&zs, 31);
+                                        raw = 0;
+                                } else {
+                                        inflateReset(&zs);
+                                }
+                        } else if (ret != Z_OK) {
+                                LOG_ERROR("INFLATE_SPAN failed to inflate "
+                                          "at %" PRIu64 "\n", uaddr);
+                                goto failed;
+                        }
+                }
+
+                blk = block_cache_insert(blk);
+                disk_cache_admit(blk, 0);
+                if (uaddr == want) {
+                        found = blk;
+                } else {
+                        block_cache_put(blk);
+                }
+                blk = NULL;
+        }
+        count_stat(STAT_INFLATE_NS, now_ns() - start);
+        count_stat(STAT_BYTES_INFLATED, end - idx->offs[e].uaddr);
+        inflateEnd(&zs);
+        return found;
+
+failed:
+        free(blk);
+        if (found) {
+                block_cache_put(found);
+        }
+        inflateEnd(&zs);
+        return NULL;
+}
+
+/* Returns the referenced chunk at key of index entry e of a plain gzip
+ * file, decompressing the entry on a miss.
+ */
+static struct cached_block *get_zran_block(struct file *file,
+                                           struct bgzf_index *idx, int e,
+                                           uint64_t key)
+{
+        struct inflight_block *claim;
+        struct cached_block *blk;
+
+        blk = block_cache_get(&file->id, key);
+        if (blk) {
+                count_stat(STAT_BLOCK_HITS, 1);
+                disk_cache_admit(blk, 1);
+                return blk;
+        }
+        count_stat(STAT_BLOCK_MISSES, 1);
+        blk = block_cache_wait(&file->id, key, &claim);
+        if (blk) {
+                return blk;
+        }
+        blk = disk_cache_get(&file->id, key);
+        if (blk) {
+                blk = block_cache_insert(blk);
+        } else {
+                blk = inflate_span(file, idx, e, key);
+        }
+        return block_inflight_done(claim, blk);
+}
+
+/* Read uncompressed data of a plain gzip file through the block cache */
+static int read_zran(struct file *file, struct bgzf_index *idx, char *buf,
+                     size_t size, off_t offset)
+{
+        size_t count = 0;
+
+        while (count < size && offset + count < idx->usize) {
+                struct cached_block *blk;
+                uint64_t pos = offset + count, key;
+                size_t len;
+                int e;
+
+                e = find_index_entry(idx, pos);
+                key = idx->offs[e].uaddr + (pos - idx->offs[e].uaddr) /
+                        ZRAN_CHUNK * ZRAN_CHUNK;
+                blk = get_zran_block(file, idx, e, key);
+                if (blk == NULL) {
+                        return count ? (int)count : -EIO;
+                }
+                len = key + blk->ulen - pos;
+                if (len > size - count) {
+                        len = size - count;
+                }
+                memcpy(buf + count, blk->data + (pos - key), len);
+                count += len;
+                block_cache_put(blk);
+        }
+        return count;
+}
+
+/* Read uncompressed data through the block cache.
+ * The index gives us the compressed offset of a block at or before
+ * offset, from there we walk block by block until the request is filled
+ * or we reach the end of the file. Requests that span several index
+ * entries are handed to the inflate workers, one job per entry.
+ */
+static int read_blocks(struct file *file, char *buf, size_t size,
+                       off_t offset)
+{
+        struct bgzf_index *idx = file->idx;
+        struct parallel_read pr;
+        bgzidx1_t ent;
+        int first, last, n, i, count = 0;
+
+        if (idx == NULL || idx->noffs == 0) {
+                return -EIO;
+        }
+        if (size == 0) {
+                return 0;
+        }
+        if (idx->windows) {
+                return read_zran(file, idx, buf, size, offset);
+        }
+
+        first = find_index_entry(idx, offset);
+        last = find_index_entry(idx, offset + size - 1);
+        n = last - first + 1;
+        ent = index_entry(idx, first);
+        init_span(&pr.span, file, idx, first, n);
+        if (inflate_threads <= 0 || n < PARALLEL_MIN_BLOCKS) {
+                count = read_range(file, buf, size, offset,
+                                   ent.caddr, ent.uaddr, &pr.span);
+                free_span(&pr.span);
+                return count;
+        }
+
+        pr.file = file;
+        pr.buf = buf;
+        pr.size = size;
+        pr.offset = offset;
+        pr.first = first;
+        pr.counts = malloc(n * sizeof(int));
+        pr.wants = malloc(n * sizeof(size_t));
+        if (pr.counts == NULL || pr.wants == NULL) {
+                free(pr.counts);
+                free(pr.wants);
+                count = read_range(file, buf, size, offset,
+                                   ent.caddr, ent.uaddr, &pr.span);
+                free_span(&pr.span);
+                return count;
+        }
+
+        run_batch(parallel_read_job, &pr, n, file);
+        free_span(&pr.span);
+
+        /* The data is only valid up to the first short or failed job */
+        for (i = 0; i < n; i++) {
+                if (pr.counts[i] < 0) {
+                        if (count == 0) {
+                                count = pr.counts[i];
+                        }
+                        break;
+                }
+                count += pr.counts[i];
+                if ((size_t)pr.counts[i] < pr.wants[i]) {
+                        break;
+                }
+        }
+        free(pr.counts);
+        free(pr.wants);
+        return count;
+}
+
+/* Inflate up to len bytes into out from where the stream is. Returns the
+ * number of bytes inflated, which is only short at the end of the file,
+ * or -EIO.
+ */
+static int stream_inflate(struct gz_stream *s, int fd, unsigned char *out,
+                          size_t len)
+{
+        ssize_t count;
+        int ret;
+
+        s->zs.next_out = out;
+        s->zs.avail_out = len;
+        while (s->zs.avail_out && !s->eof) {
+                if (s->zs.avail_in == 0) {
+                        count = source_pread(fd, s->in, GZ_STREAM_INPUT,
+                                             s->in_pos);
+                        if (count < 0) {
+                                return -EIO;
+                        }
+                        if (count == 0) {
+                                s->eof = 1;
+                                break;
+                        }
+                        s->in_pos += count;
+                        s->zs.next_in = s->in;
+                        s->zs.avail_in = count;
+                }
+                ret = inflate(&s->zs, Z_NO_FLUSH);
+                if (ret == Z_STREAM_END) {
+                        /* Another member may follow, anything else that
+                         * is not a gzip header is the end.
+                         */
+                        if (s->zs.avail_in == 0) {
+                                count = source_pread(fd, s->in,
+                                                     GZ_STREAM_INPUT,
+                                                     s->in_pos);
+                                if (count <= 0) {
+                                        s->eof = 1;
+                                        break;
+                                }
+                                s->in_pos += count;
+                                s->zs.next_in = s->in;
+                                s->zs.avail_in = count;
+                        }
+                        if (s->zs.next_in[0] != 0x1f) {
+                                s->eof = 1;
+                                break;
+                        }
+                        inflateReset(&s->zs);
+                } else if (ret != Z_OK) {
+                        return -EIO;
+                }
+        }
+        count_stat(STAT_BYTES_INFLATED, len - s->zs.avail_out);
+        return len - s->zs.avail_out;
+}
+
+static void stop_stream(struct gz_stream *s)
+{
+        if (s->started) {
+                inflateEnd(&s->zs);
+                free(s->in);
+                s->in = NULL;
+                s->started = 0;
+        }
+}
+
+/* Read a gzip file that has no index yet by inflating it from the start.
+ * Carrying on from where the previous read ended is cheap, seeking back
+ * means starting over.
+ */
+static int read_stream(struct file *file, char *buf, size_t size,
+                       off_t offset)
+{
+        struct gz_stream *s = file->stream;
+        unsigned char skip[16384];
+        size_t count = 0;
+        int ret = 0;
+
+        pthread_mutex_lock(&file->mutex);
+        if (!s->started) {
+                memset(s, 0, sizeof(*s));
+                s->in = malloc(GZ_STREAM_INPUT);
+                if (s->in == NULL || inflateInit2(&s->zs, 31) != Z_OK) {
+                        free(s->in);
+                        s->in = NULL;
+                        pthread_mutex_unlock(&file->mutex);
+                        return -ENOMEM;
+                }
+                s->started = 1;
+        } else if ((uint64_t)offset < s->uaddr) {
+                inflateReset(&s->zs);
+                s->zs.avail_in = 0;
+                s->in_pos = 0;
+                s->uaddr = 0;
+                s->eof = 0;
+        }
+        while (count < size && !s->eof) {
+                if (s->uaddr < (uint64_t)offset) {
+                        ret = stream_inflate(s, file->fd, skip,
+                                             offset - s->uaddr < sizeof(skip) ?
+                                             offset - s->uaddr : sizeof(skip));
+                } else {
+                        ret = stream_inflate(s, file->fd,
+                                             (unsigned char *)buf + count,
+                                             size - count);
+                        if (ret > 0) {
+                                count += ret;
+                        }
+                }
+                if (ret < 0) {
+                        break;
+                }
+                s->uaddr += ret;
+        }
+        pthread_mutex_unlock(&file->mutex);
+        if (ret < 0 && count == 0) {
+                return ret;
+        }
+        return count;
+}
+
+/* Read uncompressed data of a bgzip file, or the data of a plain file of
+ * a remote source. A handle that was opened while its index was being
+ * built switches over to it once it is there.
+ */
+static int read_pinned_file(struct file *file, char *buf, size_t size,
+                            off_t offset)
+{
+        struct bgzf_index *idx;
+        unsigned done;
+        ssize_t count;
+
+        if (file->stream == NULL && file->idx == NULL) {
+                /* A plain file of a remote source */
+                count = source_pread(file->fd, buf, size, offset);
+                return count < 0 ? -errno : (int)count;
+        }
+        if (file->stream == NULL) {
+                return read_blocks(file, buf, size, offset);
+        }
+        idx = __atomic_load_n(&file->idx, __ATOMIC_ACQUIRE);
+        done = __atomic_load_n(&index_builds_done, __ATOMIC_ACQUIRE);
+        if (idx == NULL &&
+            done != __atomic_load_n(&file->builds_seen, __ATOMIC_RELAXED)) {
+                pthread_mutex_lock(&file->mutex);
+                idx = file->idx;
+                if (idx == NULL) {
+                        __atomic_store_n(&file->builds_seen, done,
+                                         __ATOMIC_RELAXED);
+                        idx = get_index(file->built_index);
+                        __atomic_store_n(&file->idx, idx, __ATOMIC_RELEASE);
+                        if (idx) {
+                                stop_stream(file->stream);
+                        }
+                }
+                pthread_mutex_unlock(&file->mutex);
+        }
+        if (idx) {
+                return read_blocks(file, buf, size, offset);
+        }
+        return read_stream(file, buf, size, offset);
+}
+
+static int read_file(struct file *file, char *buf, size_t size,
+                     off_t offset)
+{
+        int ret;
+
+        ret = pin_file(file);
+        if (ret) {
+                return ret;
+        }
+        ret = read_pinned_file(file, buf, size, offset);
+        unpin_file(file);
+        return ret;
+}
+
+/* Returns the size of the uncompressed data, or -1 on error.
+ * Only the blocks after the last index entry need to be decompressed.
+ */
+static int64_t scan_file_size(struct file *file)
+{
+        struct bgzf_index *idx = file->idx;
+        bgzidx1_t last = index_entry(idx, idx->noffs - 1);
+        uint64_t caddr = last.caddr, uaddr = last.uaddr;
+
+        while (1) {
+                struct cached_block *blk;
+
+                blk = get_block(file, caddr);
+                if (blk == NULL) {
+                        return -1;
+                }
+                if (blk->clen == 0) {
+                        block_cache_put(blk);
+                        break;
+                }
+                uaddr += blk->ulen;
+                caddr += blk->clen;
+                block_cache_put(blk);
+        }
+        return uaddr;
+}
+
+/* The empty block bgzip appends to mark the end of the file */
+static const unsigned char bgzf_eof_block[28] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+        0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00
+};
+
+/* Fast path for the uncompressed size that does not inflate anything.
+ * The last entry of the index gives the offsets of the final data block,
+ * and every BGZF block ends in a gzip footer holding its uncompressed
+ * size (ISIZE). So the size is the uaddr of the last entry plus the ISIZE
+ * of that block, provided that the block, optionally followed by the EOF
+ * marker block, runs exactly to the end of the compressed file.
+ * Returns -1 if the file does not look like that.
+ */
+static int64_t trailer_file_size(int fd, off_t gz_size, const char *index_file)
+{
+        unsigned char hdr[BGZF_HEADER_SIZE];
+        unsigned char tail[sizeof(bgzf_eof_block) + 4];
+        uint64_t entry[2] = { 0, 0 };   /* caddr, uaddr */
+        struct stat st;
+        size_t bsize;
+        uint32_t isize;
+        int idx_fd;
+
+        /* Only the last 16 bytes of the index are needed */
+        idx_fd = openat(dir_fd, index_file, O_RDONLY);
+        if (idx_fd == -1) {
+                return -1;
+        }
+        if (fstat(idx_fd, &st) == -1 || st.st_size < 8 ||
+            (st.st_size - 8) % 16) {
+                close(idx_fd);
+                return -1;
+        }
+        if (st.st_size > 8 &&
+            pread(idx_fd, entry, sizeof(entry), st.st_size - 16) !=
+            sizeof(entry)) {
+                close(idx_fd);
+                return -1;
+        }
+        close(idx_fd);
+        entry[0] = le64toh(entry[0]);
+        entry[1] = le64toh(entry[1]);
+
+        if (source_pread(fd, hdr, sizeof(hdr), entry[0]) != sizeof(hdr)) {
+                return -1;
+        }
+        bsize = bgzf_block_size(hdr, sizeof(hdr));
+        if (bsize < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE) {
+                return -1;
+        }
+        if (entry[0] + bsize != (uint64_t)gz_size &&
+            entry[0] + bsize + sizeof(bgzf_eof_block) != (uint64_t)gz_size) {
+                return -1;
+        }
+        if (source_pread(fd, tail, sizeof(tail), entry[0] + bsize - 4) !=
+            (ssize_t)(gz_size - (entry[0] + bsize - 4))) {
+                return -1;
+        }
+        if (entry[0] + bsize != (uint64_t)gz_size &&
+            memcmp(tail + 4, bgzf_eof_block, sizeof(bgzf_eof_block))) {
+                return -1;
+        }
+        isize = tail[0] | (tail[1] << 8) | (tail[2] << 16) |
+                ((uint32_t)tail[3] << 24);
+        if (isize > BGZF_MAX_BLOCK_SIZE) {
+                return -1;
+        }
+        return entry[1] + isize;
+}
+
+/* Sizes are keyed by the full path of the file and the identity of its
+ * .gz file, so files with the same name in different directories do not
+ * collide and a rewritten .gz never gets the old size.
+ */
+static void size_key(const char *path, const struct stat *gz_st, char *key,
+                     size_t len)
+{
+        struct file_id id;
+
+        set_file_id(&id, gz_st);
+        snprintf(key, len, DB_SIZE "%s:%" PRIu64 ":%" PRId64 ":%" PRId64,
+                 path, id.ino, id.mtime, id.size);
+}
+
+/* Returns INDEX_BGZF or INDEX_ZRAN for the .gz file fd, or -1 if it is
+ * not a gzip file at all.
+ */
+static int gz_kind(int fd)
+{
+        unsigned char hdr[BGZF_HEADER_SIZE];
+        ssize_t count;
+
+        count = source_pread(fd, hdr, sizeof(hdr), 0);
+        if (count < 2 || hdr[0] != 0x1f || hdr[1] != 0x8b) {
+                return -1;
+        }
+        return bgzf_block_size(hdr, count) ? INDEX_BGZF : INDEX_ZRAN;
+}
+
+/* Write a .gzi for the BGZF file fd, with an entry for every block. Only
+ * the header and the ISIZE of each block are read.
+ */
+static int write_bgzf_index(int fd, FILE *out)
+{
+        unsigned char hdr[BGZF_HEADER_SIZE], isize[4];
+        uint64_t caddr = 0, uaddr = 0, count = 0, entry[2];
+        size_t bsize;
+        ssize_t n;
+
+        /* The count is filled in at the end */
+        if (fwrite(&count, sizeof(count), 1, out) != 1) {
+                return -1;
+        }
+        while ((n = source_pread(fd, hdr, sizeof(hdr), caddr)) != 0) {
+                bsize = n > 0 ? bgzf_block_size(hdr, n) : 0;
+                if (bsize < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE ||
+                    source_pread(fd, isize, 4, caddr + bsize - 4) != 4) {
+                        LOG_ERROR("WRITE_BGZF_INDEX invalid block at %"
+                                  PRIu64 "\n", caddr);
+                        return -1;
+                }
+                if (caddr) {
+                        entry[0] = htole64(caddr);
+                        entry[1] = htole64(uaddr);
+                        if (fwrite(entry, sizeof(entry), 1, out) != 1) {
+                                return -1;
+                        }
+                        count++;
+                }
+                uaddr += isize[0] | (isize[1] << 8) | (isize[2] << 16) |
+                        ((uint32_t)isize[3] << 24);
+                caddr += bsize;
+        }
+        count = htole64(count);
+        if (fseek(out, 0, SEEK_SET) ||
+            fwrite(&count, sizeof(count), 1, out) != 1) {
+                return -1;
+        }
+        return 0;
+}
+
+/* Inflate the plain gzip file fd once, the way zran.c in the zlib sources
+ * does, and write out a checkpoint for the first deflate block and then
+ * for the first block boundary after every ZRAN_SPAN bytes, in the format
+ * that load_zran_index() reads. Concatenated gzip members are followed.
+ * Returns the size of the uncompressed data, or -1 on error.
+ */
+static int64_t write_zran_index(int fd, FILE *out)
+{
+        unsigned char input[65536], window[ZRAN_WINDOW];
+        uint64_t totin = 0, totout = 0, last = 0, in_pos = 0, hdr[2];
+        uint64_t *points = NULL, *tmp;
+        unsigned char *windows = NULL, *wtmp;
+        size_t n = 0, max = 0, left;
+        z_stream zs = {0};
+        int64_t ret = -1;
+        ssize_t count;
+        int err;
+
+        if (inflateInit2(&zs, 31) != Z_OK) {
+                return -1;
+        }
+        memset(window, 0, sizeof(window));
+        while (1) {
+                if (zs.avail_in == 0) {
+                        count = source_pread(fd, input, sizeof(input), in_pos);
+                        if (count <= 0) {
+                                goto finished;
+                        }
+                        in_pos += count;
+                        zs.next_in = input;
+                        zs.avail_in = count;
+                }
+                if (zs.avail_out == 0) {
+                        zs.next_out = window;
+                        zs.avail_out = ZRAN_WINDOW;
+                }
+                totin += zs.avail_in;
+                totout += zs.avail_out;
+                err = inflate(&zs, Z_BLOCK);
+                totin -= zs.avail_in;
+                totout -= zs.avail_out;
+                if (err == Z_STREAM_END) {
+                        if (zs.avail_in == 0) {
+                                count = source_pread(fd, input,
+                                                     sizeof(input), in_pos);
+                                if (count < 0) {
+                                        goto finished;
+                                }
+                                in_pos += count;
+                                zs.next_in = input;
+                                zs.avail_in = count;
+                        }
+                        if (zs.avail_in == 0 || zs.next_in[0] != 0x1f) {
+                                break;
+                        }
+                        inflateReset(&zs);
+                        continue;
+                }
+                if (err != Z_OK) {
+                        goto finished;
+                }
+                if (!(zs.data_type & 128) || (zs.data_type & 64) ||
+                    (n && totout - last <= ZRAN_SPAN)) {
+                        continue;
+                }
+
+                if (n == max) {
+                        max = max ? max * 2 : 64;
+                        tmp = realloc(points, max * 3 * sizeof(uint64_t));
+                        if (tmp == NULL) {
+                                goto finished;
+                        }
+                        points = tmp;
+                        wtmp = realloc(windows, max * ZRAN_WINDOW);
+                        if (wtmp == NULL) {
+                                goto finished;
+                        }
+                        windows = wtmp;
+                }
+                points[3 * n] = htole64(totin);
+                points[3 * n + 1] = htole64(totout);
+                points[3 * n + 2] = htole64(zs.data_type & 7);
+                /* The window is circular, the oldest byte is next_out */
+                left = zs.avail_out;
+                memcpy(windows + n * ZRAN_WINDOW, window + ZRAN_WINDOW - left,
+                       left);
+                memcpy(windows + n * ZRAN_WINDOW + left, window,
+                       ZRAN_WINDOW - left);
+                n++;
+                last = totout;
+        }
+
+        hdr[0] = htole64(n);
+        hdr[1] = htole64(totout);
+        if (n && fwrite(hdr, sizeof(hdr), 1, out) == 1 &&
+            fwrite(points, 3 * sizeof(uint64_t), n, out) == n &&
+            fwrite(windows, ZRAN_WINDOW, n, out) == n) {
+                ret = totout;
+        }
+
+finished:
+        free(points);
+        free(windows);
+        inflateEnd(&zs);
+        return ret;
+}
+
+/* Indexes that are being built or are queued for the builder thread.
+ * There is only ever one build for an index.
+ */
+struct index_build {
+        struct index_build *next;
+        int kind;
+        int running;
+        int done;
+        int waiters;
+        char *path;     /* that is shown uncompressed */
+        char *index;    /* to write */
+};
+
+static pthread_mutex_t build_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t build_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t build_done_cond = PTHREAD_COND_INITIALIZER;
+static struct index_build *index_builds;
+static int index_builder_running;
+
+/* Defined with the inode table */
+static void index_built(const char *path);
+
+/* Write the index of b, to a temporary file first so that nobody ever
+ * sees half an index.
+ */
+static void run_index_build(struct index_build *b)
+{
+        char gzfile[PATH_MAX], tmp[PATH_MAX + 32], key[SIZE_KEY_MAX];
+        uint64_t start = now_ns();
+        struct stat st;
+        int64_t size = 0;
+        FILE *out;
+        int fd;
+
+        LOG_INFO("BUILD_INDEX [%s] %s\n", b->path, b->index);
+
+        snprintf(gzfile, PATH_MAX, "%s.gz", b->path);
+        fd = open_source(gzfile);
+        if (fd == -1) {
+                return;
+        }
+        snprintf(tmp, sizeof(tmp), "%s.%d.tmp", b->index, (int)getpid());
+        out = fopen(tmp, "w");
+        if (out == NULL) {
+                LOG_ERROR("BUILD_INDEX failed to create %s %s\n", tmp,
+                          strerror(errno));
+                close_source(fd);
+                return;
+        }
+        if (b->kind == INDEX_BGZF) {
+                size = write_bgzf_index(fd, out);
+        } else {
+                size = write_zran_index(fd, out);
+        }
+        if (fclose(out) || size < 0 || rename(tmp, b->index)) {
+                LOG_ERROR("BUILD_INDEX [%s] failed\n", b->path);
+                unlink(tmp);
+                close_source(fd);
+                return;
+        }
+        LOG_INFO("BUILD_INDEX [%s] done in %" PRIu64 "ms\n", b->path,
+                 (now_ns() - start) / 1000000);
+
+        /* Until now the size came from the gzip trailer */
+        if (b->kind == INDEX_ZRAN && fstat(fd, &st) == 0) {
+                size_key(b->path, &st, key, sizeof(key));
+                store_size(key, size);
+                index_built(b->path);
+        }
+        close_source(fd);
+}
+
+/* Must be called with build_mutex held */
+static void finish_build(struct index_build *b)
+{
+        struct index_build **pp;
+
+        for (pp = &index_builds; *pp != b; pp = &(*pp)->next) {
+        }
+        *pp = b->next;
+        b->done = 1;
+        __atomic_add_fetch(&index_builds_done, 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&build_done_cond);
+        if (b->waiters == 0) {
+                free(b->path);
+                free(b->index);
+                free(b);
+        }
+}
+
+static void *index_builder(void *arg)
+{
+        struct index_build *b;
+
+        pthread_mutex_lock(&build_mutex);
+        while (1) {
+                for (b = index_builds; b && b->running; b = b->next) {
+                }
+                if (b == NULL) {
+                        pthread_cond_wait(&build_cond, &build_mutex);
+                        continue;
+                }
+                b->running = 1;
+                pthread_mutex_unlock(&build_mutex);
+
+                run_index_build(b);
+
+                pthread_mutex_lock(&build_mutex);
+                finish_build(b);
+        }
+        return NULL;
+}
+
+static void start_index_builder(void)
+{
+        pthread_t thread;
+
+        if (!build_indexes) {
+                return;
+        }
+        if (pthread_create(&thread, NULL, index_builder, NULL) == 0) {
+                pthread_detach(thread);
+                index_builder_running = 1;
+        }
+}
+
+/* Get the index for path written to index, unless that is under way
+ * already. Plain gzip files are left to the builder thread, BGZF files
+ * are cheap to index so the caller does it and returns once it is done.
+ */
+static void request_index(const char *path, const char *index, int kind)
+{
+        int wait = kind == INDEX_BGZF || !index_builder_running;
+        struct index_build *b;
+
+        pthread_mutex_lock(&build_mutex);
+        for (b = index_builds; b; b = b->next) {
+                if (!strcmp(b->index, index)) {
+                        break;
+                }
+        }
+        if (b && wait && b->running) {
+                b->waiters++;
+                while (!b->done) {
+                        pthread_cond_wait(&build_done_cond, &build_mutex);
+                }
+                if (--b->waiters == 0) {
+                        free(b->path);
+                        free(b->index);
+                        free(b);
+                }
+                pthread_mutex_unlock(&build_mutex);
+                return;
+        }
+        if (b && !wait) {
+                pthread_mutex_unlock(&build_mutex);
+                return;
+        }
+        if (b == NULL) {
+                b = calloc(1, sizeof(*b));
+                if (b == NULL) {
+                        pthread_mutex_unlock(&build_mutex);
+                        return;
+                }
+                b->kind = kind;
+                b->path = strdup(path);
+                b->index = strdup(index);
+                if (b->path == NULL || b->index == NULL) {
+                        free(b->path);
+                        free(b->index);
+                        free(b);
+                        pthread_mutex_unlock(&build_mutex);
+                        return;
+                }
+                b->next = index_builds;
+                index_builds = b;
+        }
+        if (!wait) {
+                pthread_cond_signal(&build_cond);
+                pthread_mutex_unlock(&build_mutex);
+                return;
+        }
+        /* Ours, or queued and not picked up yet */
+        b->running = 1;
+        pthread_mutex_unlock(&build_mutex);
+
+        run_index_build(b);
+
+        pthread_mutex_lock(&build_mutex);
+        finish_build(b);
+        pthread_mutex_unlock(&build_mutex);
+}
+
+/* Returns a referenced index for path, whose .gz is open as fd and has
+ * no .gz.gzi, from index_dir. The name of the index and the kind of file
+ * are returned in index and kind, index is empty if the file is not a
+ * gzip file. NULL is returned for a plain gzip file until its index has
+ * been built, which is only started if it is opened.
+ */
+static struct bgzf_index *get_built_index(const char *path, int fd,
+                                          const struct stat *st, int open,
+                                          char *index, int *kind)
+{
+        struct bgzf_index *idx;
+        struct file_id id;
+
+        index[0] = 0;
+        *kind = gz_kind(fd);
+        if (*kind < 0) {
+                return NULL;
+        }
+        /* Named after the identity of the .gz, so a changed file gets a
+         * new index.
+         */
+        set_file_id(&id, st);
+        snprintf(index, PATH_MAX, "%s/%08x-%" PRIx64 "-%" PRIx64 "-%" PRIx64
+                 ".%s", index_dir, hash_path(path), id.ino, (uint64_t)id.mtime,
+                 (uint64_t)id.size, *kind == INDEX_BGZF ? "gzi" : "zri");
+        idx = get_index(index);
+        if (idx || (*kind == INDEX_ZRAN && !open)) {
+                return idx;
+        }
+        request_index(path, index, *kind);
+        return get_index(index);
+}
+
+/* The uncompressed size of path, without a .gz.gzi, from its built index.
+ * A plain gzip file that is not indexed yet gets the ISIZE from its
+ * trailer, which is only right for a single member under 4G, and exact
+ * is cleared so that it is not cached.
+ */
+static int64_t built_file_size(const char *path, int fd,
+                               const struct stat *st, int *exact)
+{
+        char index[PATH_MAX];
+        struct bgzf_index *idx;
+        struct file gz = { 0 };
+        unsigned char isize[4];
+        int64_t size;
+        int kind;
+
+        idx = get_built_index(path, fd, st, 0, index, &kind);
+        if (idx && idx->windows) {
+                size = idx->usize;
+        } else if (idx) {
+                size = trailer_file_size(fd, st->st_size, index);
+                if (size < 0) {
+                        gz.fmt = FORMAT_BGZF;
+                        gz.idx = idx;
+                        gz.fd = fd;
+                        set_file_id(&gz.id, st);
+                        size = scan_file_size(&gz);
+                }
+        } else {
+                if (kind != INDEX_ZRAN || st->st_size < 4 ||
+                    source_pread(fd, isize, 4, st->st_size - 4) != 4) {
+                        return -1;
+                }
+                *exact = 0;
+                return isize[0] | (isize[1] << 8) | (isize[2] << 16) |
+                        ((uint32_t)isize[3] << 24);
+        }
+        put_index(idx);
+        *exact = 1;
+        return size;
+}
+
+/* Works out the uncompressed size of path, whose compressed file in
+ * format fmt is described by stbuf, and stores it under key. Returns -1
+ * if it could not be determined.
+ */
+static int64_t find_unzipped_size(const char *path, const struct format *fmt,
+                                  const struct stat *stbuf, const char *key)
+{
+        char gzfile[PATH_MAX];
+        char index_file[PATH_MAX];
+        struct file gz = { 0 };
+        struct bgzf_index *idx;
+        int fd, exact;
+        int64_t pos;
+
+        LOG_INFO("GET_UNZIPPED_SIZE SLOW PATH [%s]\n", path);
+        count_stat(STAT_SIZE_SLOW, 1);
+
+        snprintf(gzfile, PATH_MAX, "%s%s", path, fmt->suffix);
+        if (fmt->index_suffix == NULL) {
+                /* The index has the size of every block */
+                idx = get_index(gzfile);
+                if (idx == NULL) {
+                        return -1;
+                }
+                pos = idx->usize;
+                put_index(idx);
+                store_size(key, pos);
+                return pos;
+        }
+        fd = open_source(gzfile);
+        if (fd == -1) {
+                return -1;
+        } 
+
+        snprintf(index_file, PATH_MAX, "%s%s", path, fmt->index_suffix);
+        if (build_indexes && faccessat(dir_fd, index_file, F_OK, 0)) {
+                pos = built_file_size(path, fd, stbuf, &exact);
+                close_source(fd);
+                if (pos >= 0 && exact) {
+                        store_size(key, pos);
+                }
+                return pos;
+        }
+        pos = trailer_file_size(fd, stbuf->st_size, index_file);
+        if (pos < 0) {
+                LOG_INFO("GET_UNZIPPED_SIZE [%s] inconsistent trailer, "
+                    "scanning\n", path);
+                gz.idx = get_index(index_file);
+                if (gz.idx == NULL) {
+                        close_source(fd);
+                        return -1;
+                }
+                gz.fmt = fmt;
+                gz.fd = fd;
+                set_file_id(&gz.id, stbuf);
+
+                pos = scan_file_size(&gz);
+                put_index(gz.idx);
+        }
+        close_source(fd);
+        if (pos < 0) {
+                return -1;
+        }
+
+        LOG_INFO("GET_UNZIPPED_SIZE [%s] %" PRId64 "\n", path, pos);
+
+        /* Write the size to cache */
+        store_size(key, pos);
+        return pos;
+}
+
+/* Sizes that a thread is working out, so that a directory listing that
+ * many processes look at right after it changed only does each once.
+ */
+struct size_scan {
+        struct size_scan *next;
+        char *key;
+        int done;
+        int waiters;
+        int64_t size;
+};
+
+static pthread_mutex_t size_scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t size_scan_cond = PTHREAD_COND_INITIALIZER;
+static struct size_scan *size_scans;
+
+/* Sets st_size in stbuf, of the compressed file of path in format fmt, to
+ * the size of the uncompressed file, or leaves it if it could not be
+ * determined.
+ */
+static void get_unzipped_size(const char *path, const struct format *fmt,
+                              struct stat *stbuf)
+{
+        char file[SIZE_KEY_MAX];
+        struct size_scan *scan, **pp;
+        int64_t pos;
+
+        LOG("GET_UNZIPPED_SIZE [%s]\n", path);
+
+        size_key(path, stbuf, file, sizeof(file));
+
+        if (lookup_cache_get(&size_cache, file, &pos) == 0) {
+                count_stat(STAT_SIZE_HITS, 1);
+                stbuf->st_size = pos;
+                return;
+        }
+
+        pthread_mutex_lock(&size_scan_mutex);
+        for (scan = size_scans; scan; scan = scan->next) {
+                if (!strcmp(scan->key, file)) {
+                        break;
+                }
+        }
+        if (scan) {
+                scan->waiters++;
+                while (!scan->done) {
+                        pthread_cond_wait(&size_scan_cond, &size_scan_mutex);
+                }
+                pos = scan->size;
+                if (--scan->waiters == 0) {
+                        free(scan->key);
+                        free(scan);
+                }
+                pthread_mutex_unlock(&size_scan_mutex);
+                count_stat(STAT_FLIGHT_WAITS, 1);
+                if (pos >= 0) {
+                        stbuf->st_size = pos;
+                }
+                return;
+        }
+        scan = calloc(1, sizeof(*scan));
+        if (scan) {
+                scan->key = strdup(file);
+                if (scan->key == NULL) {
+                        free(scan);
+                        scan = NULL;
+                }
+        }
+        if (scan) {
+                scan->next = size_scans;
+                size_scans = scan;
+        }
+        pthread_mutex_unlock(&size_scan_mutex);
+
+        pos = find_unzipped_size(path, fmt, stbuf, file);
+        if (pos >= 0) {
+                stbuf->st_size = pos;
+        }
+        if (scan == NULL) {
+                return;
+        }
+
+        pthread_mutex_lock(&size_scan_mutex);
+        for (pp = &size_scans; *pp != scan; pp = &(*pp)->next) {
+        }
+        *pp = scan->next;
+        scan->done = 1;
+        scan->size = pos;
+        if (scan->waiters) {
+                pthread_cond_broadcast(&size_scan_cond);
+        } else {
+                free(scan->key);
+                free(scan);
+        }
+        pthread_mutex_unlock(&size_scan_mutex);
+}
+
+/* The control directory /.fuse-bgzip and the files in it are made up by
+ * us and never freed. The directory is not listed in the root, so it does
+ * not get in the way of anything that walks the tree.
+ */
+#define CTL_DIR ".fuse-bgzip"
+
+static struct inode *ctl_inode, *stats_inode, *heat_inode, *pins_inode;
+
+/* An inode for path that is not in the inode table, or NULL */
+static struct inode *new_inode(const char *path)
+{
+        struct inode *inode = calloc(1, sizeof(*inode) + strlen(path) + 1);
+
+        if (inode) {
+                strcpy(inode->path, path);
+        }
+        return inode;
+}
+
+static struct inode *alloc_inode(const char *path)
+{
+        struct inode *inode = new_inode(path);
+
+        if (inode == NULL) {
+                fprintf(stderr, "Failed to allocate inode\n");
+                exit(1);
+        }
+        return inode;
+}
+
+static int is_ctl_inode(struct inode *inode)
+{
+        return inode == ctl_inode || inode == stats_inode ||
+               inode == heat_inode || inode == pins_inode;
+}
+
+static struct inode *get_inode(fuse_ino_t ino)
+{
+        if (ino == FUSE_ROOT_ID) {
+                return root_inode;
+        }
+        return (struct inode *)(uintptr_t)ino;
+}
+
+/* Builds the path of name in the directory parent */
+static int child_path(struct inode *parent, const char *name, char *path)
+{
+        int len;
+
+        if (parent == root_inode) {
+                len = snprintf(path, PATH_MAX, "%s", name);
+        } else {
+                len = snprintf(path, PATH_MAX, "%s/%s", parent->path, name);
+        }
+        return len >= PATH_MAX ? -ENAMETOOLONG : 0;
+}
+
+static struct inode **inode_bucket(const char *path)
+{
+        return &inode_table[hash_path(path) & (inode_table_size - 1)];
+}
+
+static void inode_table_grow(void)
+{
+        size_t size = inode_table_size ? inode_table_size * 2 : 1024;
+        struct inode **table;
+        size_t i;
+
+        table = calloc(size, sizeof(*table));
+        if (table == NULL) {
+                return;
+        }
+        for (i = 0; i < inode_table_size; i++) {
+                while (inode_table[i]) {
+                        struct inode *inode = inode_table[i];
+                        size_t h = hash_path(inode->path) & (size - 1);
+
+                        inode_table[i] = inode->hash_next;
+                        inode->hash_next = table[h];
+                        table[h] = inode;
+                }
+        }
+        free(inode_table);
+        inode_table = table;
+        inode_table_size = size;
+}
+
+/* Returns the inode for path with one more lookup reference, creating it
+ * if the kernel does not know about it yet.
+ */
+static struct inode *ref_inode(const char *path, int bgzip)
+{
+        struct inode *inode;
+
+        pthread_mutex_lock(&inode_mutex);
+        if (num_inodes >= inode_table_size) {
+                inode_table_grow();
+                if (inode_table_size == 0) {
+                        pthread_mutex_unlock(&inode_mutex);
+                        return NULL;
+                }
+        }
+        for (inode = *inode_bucket(path); inode; inode = inode->hash_next) {
+                if (!strcmp(inode->path, path)) {
+                        break;
+                }
+        }
+        if (inode == NULL) {
+                inode = calloc(1, sizeof(*inode) + strlen(path) + 1);
+                if (inode == NULL) {
+                        pthread_mutex_unlock(&inode_mutex);
+                        return NULL;
+                }
+                strcpy(inode->path, path);
+                inode->hash_next = *inode_bucket(path);
+                *inode_bucket(path) = inode;
+                num_inodes++;
+        }
+        inode->nlookup++;
+        __atomic_store_n(&inode->bgzip, bgzip, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&inode_mutex);
+        return inode;
+}
+
+static void forget_inode(struct inode *inode, uint64_t nlookup)
+{
+        struct inode **ptr;
+
+        if (inode == root_inode || is_ctl_inode(inode)) {
+                return;
+        }
+        pthread_mutex_lock(&inode_mutex);
+        inode->nlookup -= nlookup;
+        if (inode->nlookup) {
+                pthread_mutex_unlock(&inode_mutex);
+                return;
+        }
+        for (ptr = inode_bucket(inode->path); *ptr != inode;
+             ptr = &(*ptr)->hash_next) {
+        }
+        *ptr = inode->hash_next;
+        num_inodes--;
+        pthread_mutex_unlock(&inode_mutex);
+        free(inode);
+}
+
+static pthread_mutex_t *attr_lock(const struct inode *inode)
+{
+        return &attr_locks[((uintptr_t)inode >> 6) % ATTR_LOCKS];
+}
+
+static void reset_attr(struct inode *inode)
+{
+        pthread_mutex_t *lock = attr_lock(inode);
+
+        pthread_mutex_lock(lock);
+        inode->attr_gen++;
+        inode->attr_valid = 0;
+        pthread_mutex_unlock(lock);
+}
+
+/* Returns the node ID for path if the kernel knows about it, or 0.
+ * The classification of the inode is thrown away so that it is worked out
+ * again the next time it is used.
+ * The inode may be forgotten as soon as the lock is dropped, so the ID is
+ * only good for sending notifications to the kernel.
+ */
+static fuse_ino_t reset_inode(const char *path)
+{
+        struct inode *inode = NULL;
+
+        if (!strcmp(path, ".")) {
+                return FUSE_ROOT_ID;
+        }
+        pthread_mutex_lock(&inode_mutex);
+        if (inode_table_size) {
+                for (inode = *inode_bucket(path); inode;
+                     inode = inode->hash_next) {
+                        if (!strcmp(inode->path, path)) {
+                                __atomic_store_n(&inode->bgzip, -1,
+                                                 __ATOMIC_RELAXED);
+                                reset_attr(inode);
+                                break;
+                        }
+                }
+        }
+        pthread_mutex_unlock(&inode_mutex);
+        return (uintptr_t)inode;
+}
+
+/* Stats the compressed file of path, in the first format that it exists
+ * in. Returns the format, or NULL with errno set.
+ */
+static const struct format *stat_compressed(const char *path,
+                                            struct stat *st)
+{
+        const struct format *fmt;
+        char tmp[PATH_MAX];
+
+        for (fmt = formats; fmt->name; fmt++) {
+                snprintf(tmp, PATH_MAX, "%s%s", path, fmt->suffix);
+                if (fstatat(dir_fd, tmp, st, AT_NO_AUTOMOUNT) == 0) {
+                        return fmt;
+                }
+                if (errno != ENOENT) {
+                        break;
+                }
+        }
+        return NULL;
+}
+
+/* Stats path. For a file that is shown uncompressed this is the
+ * compressed file with st_size set to the size of the uncompressed data.
+ * bgzip is what the path was classified as the last time, or -1 if that
+ * is not known. Returns the classification of path or -errno.
+ */
+static int stat_path(const char *path, int bgzip, struct stat *st)
+{
+        const struct format *fmt;
+        int ret;
+
+        if (bgzip != 1) {
+                if (fstatat(dir_fd, path, st, AT_NO_AUTOMOUNT) == 0) {
+                        return 0;
+                }
+                ret = -errno;
+                if (ret != -ENOENT || !need_bgzip_uncompress(path)) {
+                        return ret;
+                }
+        }
+
+        fmt = stat_compressed(path, st);
+        if (fmt == NULL) {
+                ret = -errno;
+                if (ret == -ENOENT && bgzip == 1) {
+                        /* It is not a bgzip file any more */
+                        return stat_path(path, -1, st);
+                }
+                return ret;
+        }
+        get_unzipped_size(path, fmt, st);
+        return 1;
+}
+
+/* Stats a file that is shown uncompressed, the fast path of getattr.
+ * The uncompressed size is kept with the inode along with the identity
+ * of the compressed file it is for, so as long as that has not changed
+ * this takes the one fstatat() of a .gz file and no lookup of the size at
+ * all. Returns 0, or -1 if the compressed file is gone and the path needs
+ * to be classified again.
+ */
+static int stat_bgzip_inode(struct inode *inode, struct stat *st)
+{
+        pthread_mutex_t *lock = attr_lock(inode);
+        const struct format *fmt;
+        struct file_id id;
+        unsigned gen;
+
+        fmt = stat_compressed(inode->path, st);
+        if (fmt == NULL) {
+                return -1;
+        }
+        set_file_id(&id, st);
+
+        pthread_mutex_lock(lock);
+        if (inode->attr_valid && same_file_id(&inode->attr_id, &id)) {
+                st->st_size = inode->attr_size;
+                pthread_mutex_unlock(lock);
+                count_stat(STAT_ATTR_HITS, 1);
+                return 0;
+        }
+        gen = inode->attr_gen;
+        pthread_mutex_unlock(lock);
+
+        get_unzipped_size(inode->path, fmt, st);
+
+        pthread_mutex_lock(lock);
+        if (inode->attr_gen == gen) {
+                inode->attr_id = id;
+                inode->attr_size = st->st_size;
+                inode->attr_valid = 1;
+        }
+        pthread_mutex_unlock(lock);
+        return 0;
+}
+
+/* Tell the kernel to drop its dentry for name in the directory parent */
+static void notify_inval_entry(fuse_ino_t parent, const char *name)
+{
+        if (session && parent) {
+                fuse_lowlevel_notify_inval_entry(session, parent, name,
+                                                 strlen(name));
+        }
+}
+
+/* Tell the kernel to drop the attributes and cached pages of ino */
+static void notify_inval_inode(fuse_ino_t ino)
+{
+        if (session && ino) {
+                fuse_lowlevel_notify_inval_inode(session, ino, 0, 0);
+        }
+}
+
+/* The index of path has been built in the background and its size is
+ * known now, make the kernel ask for it again.
+ */
+static void index_built(const char *path)
+{
+        notify_inval_inode(reset_inode(path));
+}
+
+/* Something called name changed in the watched directory dir. Forget
+ * everything we cached about the bgzip triple it may be part of, and
+ * tell the kernel to do the same so that long entry and attribute
+ * timeouts never hide a change.
+ */
+static void invalidate_path(const char *dir, const char *name, uint32_t mask)
+{
+        char path[PATH_MAX];
+        char stripped[PATH_MAX];
+        char stripped_name[PATH_MAX];
+        char tmp[PATH_MAX];
+        char key[SIZE_KEY_MAX];
+        const struct format *fmt;
+        struct stat st;
+        fuse_ino_t parent;
+
+        if (strcmp(dir, ".")) {
+                snprintf(path, PATH_MAX, "%s/%s", dir, name);
+        } else {
+                snprintf(path, PATH_MAX, "%s", name);
+        }
+        LOG_INFO("INVALIDATE [%s] 0x%x\n", path, mask);
+
+        /* The listing of the directory changed */
+        parent = reset_inode(dir);
+        notify_inval_inode(parent);
+        notify_inval_entry(parent, name);
+
+        if ((mask & IN_ISDIR) && (mask & (IN_DELETE | IN_MOVED_FROM))) {
+                /* A whole tree went away, forget all lookups below it */
+                lookup_cache_clear(&nu_cache);
+                return;
+        }
+
+        strip_bgzip_suffix(path, stripped);
+        lookup_cache_del(&nu_cache, stripped);
+        snprintf(tmp, PATH_MAX, "%s.gzi", stripped);
+        lookup_cache_del(&nu_cache, tmp);
+        for (fmt = formats; fmt->name; fmt++) {
+                snprintf(tmp, PATH_MAX, "%s%s", stripped, fmt->suffix);
+                lookup_cache_del(&nu_cache, tmp);
+                if (fstatat(dir_fd, tmp, &st, AT_NO_AUTOMOUNT) == 0) {
+                        /* Drop blocks and the size of the old content */
+                        block_cache_purge(st.st_dev, st.st_ino);
+                        size_key(stripped, &st, key, sizeof(key));
+                        lookup_cache_del(&size_cache, key);
+                }
+                if (fmt->index_suffix) {
+                        snprintf(tmp, PATH_MAX, "%s%s", stripped,
+                                 fmt->index_suffix);
+                        lookup_cache_del(&nu_cache, tmp);
+                }
+                index_cache_drop(tmp);
+        }
+
+        /* The name shown for the triple may now be a different file */
+        strip_bgzip_suffix(name, stripped_name);
+        if (strcmp(stripped_name, name)) {
+                notify_inval_entry(parent, stripped_name);
+        }
+        notify_inval_inode(reset_inode(stripped));
+        if (strcmp(stripped, path)) {
+                notify_inval_inode(reset_inode(path));
+        }
+}
+
+/* Events were lost, so nothing that was cached on the strength of the
+ * watches can be trusted any more. Every inode is classified again, the
+ * kernel drops what it has of the watched directories, and directories
+ * are only trusted again once opendir has watched them anew.
+ */
+static void watch_overflow(void)
+{
+        char **dirs;
+        size_t i;
+        int n = 0;
+
+        lookup_cache_clear(&nu_cache);
+
+        pthread_mutex_lock(&inode_mutex);
+        for (i = 0; i < inode_table_size; i++) {
+                struct inode *inode;
+
+                for (inode = inode_table[i]; inode; inode = inode->hash_next) {
+                        __atomic_store_n(&inode->bgzip, -1, __ATOMIC_RELAXED);
+                        reset_attr(inode);
+                }
+        }
+        pthread_mutex_unlock(&inode_mutex);
+
+        pthread_mutex_lock(&watch_mutex);
+        dirs = calloc(num_watch_paths + 1, sizeof(*dirs));
+        for (i = 0; dirs && i < (size_t)num_watch_paths; i++) {
+                if (watch_paths[i]) {
+                        dirs[n] = strdup(watch_paths[i]);
+                        n += dirs[n] != NULL;
+                }
+        }
+        pthread_mutex_unlock(&watch_mutex);
+        lookup_cache_clear(&watched_dirs);
+
+        while (n > 0) {
+                n--;
+                notify_inval_inode(reset_inode(dirs[n]));
+                free(dirs[n]);
+        }
+        free(dirs);
+}
+
+static void *change_watcher(void *arg)
+{
+        char buf[65536]
+                __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+
+        while ((len = read(inotify_fd, buf, sizeof(buf))) != 0) {
+                char *ptr;
+
+                if (len == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        LOG_ERROR("CHANGE_WATCHER read failed %s\n",
+                            strerror(errno));
+                        break;
+                }
+                for (ptr = buf; ptr < buf + len;) {
+                        struct inotify_event *ev = (void *)ptr;
+                        char dir[PATH_MAX];
+
+                        ptr += sizeof(*ev) + ev->len;
+                        if (ev->mask & IN_Q_OVERFLOW) {
+                                LOG_INFO("CHANGE_WATCHER event queue "
+                                    "overflow\n");
+                                watch_overflow();
+                                continue;
+                        }
+
+                        pthread_mutex_lock(&watch_mutex);
+                        if (ev->wd < 0 || ev->wd >= num_watch_paths ||
+                            watch_paths[ev->wd] == NULL) {
+                                pthread_mutex_unlock(&watch_mutex);
+                                continue;
+                        }
+                        snprintf(dir, PATH_MAX, "%s", watch_paths[ev->wd]);
+                        if (ev->mask & IN_IGNORED) {
+                                free(watch_paths[ev->wd]);
+                                watch_paths[ev->wd] = NULL;
+                        }
+                        pthread_mutex_unlock(&watch_mutex);
+
+                        if (ev->mask & IN_IGNORED) {
+                                lookup_cache_del(&watched_dirs, dir);
+                                continue;
+                        }
+                        if (ev->len) {
+                                invalidate_path(dir, ev->name, ev->mask);
+                        }
+                }
+        }
+        return NULL;
+}
+
+static void start_change_watcher(void)
+{
+        pthread_t thread;
+
+        if (!watch_changes) {
+                return;
+        }
+        inotify_fd = inotify_init1(IN_CLOEXEC);
+        if (inotify_fd == -1) {
+                LOG_ERROR("inotify_init1 failed %s, caches will not be "
+                    "invalidated\n", strerror(errno));
+                return;
+        }
+        if (pthread_create(&thread, NULL, change_watcher, NULL)) {
+                close(inotify_fd);
+                inotify_fd = -1;
+                return;
+        }
+        pthread_detach(thread);
+}
+
+/* With --prewarm the caches are filled in the background once we are
+ * mounted. The indexes of the files that were opened most recently are
+ * loaded first, as far as they fit in the index cache, then the tree is
+ * walked by PREWARM_THREADS threads that look up every .gz file the way
+ * a lookup from the kernel would, which classifies it and works out its
+ * size, mostly from the snapshot in the size database.
+ */
+#define PREWARM_THREADS 8
+
+struct prewarm_dir {
+        struct prewarm_dir *next;
+        char path[];
+};
+
+static pthread_mutex_t prewarm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prewarm_cond = PTHREAD_COND_INITIALIZER;
+static struct prewarm_dir *prewarm_dirs;
+static int prewarm_busy, prewarm_threads;
+static int prewarm_num_dirs, prewarm_num_files, prewarm_num_indexes;
+static uint64_t prewarm_start;
+
+static void queue_prewarm_dir(const char *path)
+{
+        struct prewarm_dir *d;
+
+        d = malloc(sizeof(*d) + strlen(path) + 1);
+        if (d == NULL) {
+                return;
+        }
+        strcpy(d->path, path);
+        pthread_mutex_lock(&prewarm_mutex);
+        d->next = prewarm_dirs;
+        prewarm_dirs = d;
+        prewarm_num_dirs++;
+        pthread_cond_signal(&prewarm_cond);
+        pthread_mutex_unlock(&prewarm_mutex);
+}
+
+static void prewarm_dir(const char *path)
+{
+        const struct format *fmt;
+        char child[PATH_MAX];
+        struct dirent *ent;
+        struct stat st;
+        int fd, files = 0;
+        size_t len;
+        DIR *dir;
+
+        fd = openat(dir_fd, path, O_RDONLY|O_DIRECTORY);
+        if (fd == -1) {
+                return;
+        }
+        dir = fdopendir(fd);
+        if (dir == NULL) {
+                close(fd);
+                return;
+        }
+        while ((ent = readdir(dir))) {
+                if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+                        continue;
+                }
+                if (!strcmp(path, ".")) {
+                        len = snprintf(child, PATH_MAX, "%s", ent->d_name);
+                } else {
+                        len = snprintf(child, PATH_MAX, "%s/%s", path,
+                                       ent->d_name);
+                }
+                if (len >= PATH_MAX) {
+                        continue;
+                }
+                if (ent->d_type == DT_DIR ||
+                    (ent->d_type == DT_UNKNOWN &&
+                     fstatat(dir_fd, child, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                     S_ISDIR(st.st_mode))) {
+                        queue_prewarm_dir(child);
+                        continue;
+                }
+                fmt = name_format(child, 0);
+                if (fmt == NULL) {
+                        continue;
+                }
+                child[len - strlen(fmt->suffix)] = 0;
+                if (stat_path(child, 0, &st) == 1) {
+                        files++;
+                }
+        }
+        closedir(dir);
+        __atomic_add_fetch(&prewarm_num_files, files, __ATOMIC_RELAXED);
+}
+
+static void *prewarm_walker(void *arg)
+{
+        struct prewarm_dir *d;
+
+        pthread_mutex_lock(&prewarm_mutex);
+        while (1) {
+                while (prewarm_dirs == NULL && prewarm_busy) {
+                        pthread_cond_wait(&prewarm_cond, &prewarm_mutex);
+                }
+                d = prewarm_dirs;
+                if (d == NULL) {
+                        /* Nothing queued and nobody can queue more */
+                        break;
+                }
+                prewarm_dirs = d->next;
+                prewarm_busy++;
+                pthread_mutex_unlock(&prewarm_mutex);
+
+                prewarm_dir(d->path);
+                free(d);
+
+                pthread_mutex_lock(&prewarm_mutex);
+                if (--prewarm_busy == 0 && prewarm_dirs == NULL) {
+                        pthread_cond_broadcast(&prewarm_cond);
+                }
+        }
+        if (--prewarm_threads == 0) {
+                LOG_INFO("Prewarmed %d indexes, %d directories and %d files "
+                         "in %" PRIu64 "ms\n", prewarm_num_indexes,
+                         prewarm_num_dirs,
+                         __atomic_load_n(&prewarm_num_files,
+                                         __ATOMIC_RELAXED),
+                         (now_ns() - prewarm_start) / 1000000);
+        }
+        pthread_mutex_unlock(&prewarm_mutex);
+        return NULL;
+}
+
+static int compare_hot_files(const void *a, const void *b)
+{
+        const struct hot_file *x = a, *y = b;
+
+        return x->minute < y->minute ? 1 : x->minute > y->minute ? -1 : 0;
+}
+
+/* Load the indexes of hot files, newest first, until the cache is full */
+static void prewarm_indexes(void)
+{
+        const struct format *fmt;
+        char index_file[PATH_MAX];
+        struct bgzf_index *idx;
+        struct stat st;
+        size_t idle;
+        int i;
+
+        qsort(hot_files, num_hot_files, sizeof(hot_files[0]),
+              compare_hot_files);
+        for (i = 0; i < num_hot_files; i++) {
+                pthread_mutex_lock(&index_cache_mutex);
+                idle = index_idle_size;
+                pthread_mutex_unlock(&index_cache_mutex);
+                if (idle >= index_cache_size) {
+                        break;
+                }
+                if (stat_path(hot_files[i].path, 0, &st) != 1) {
+                        continue;
+                }
+                for (fmt = formats; fmt->name; fmt++) {
+                        snprintf(index_file, PATH_MAX, "%s%s",
+                                 hot_files[i].path, fmt->index_suffix ?
+                                 fmt->index_suffix : fmt->suffix);
+                        if (faccessat(dir_fd, index_file, F_OK, 0) == 0) {
+                                break;
+                        }
+                }
+                if (fmt->name == NULL) {
+                        continue;
+                }
+                idx = get_index(index_file);
+                if (idx) {
+                        put_index(idx);
+                        prewarm_num_indexes++;
+                }
+        }
+        for (i = 0; i < num_hot_files; i++) {
+                free(hot_files[i].path);
+        }
+        free(hot_files);
+        hot_files = NULL;
+        num_hot_files = 0;
+}
+
+static void *prewarm_main(void *arg)
+{
+        pthread_t thread;
+        int i;
+
+        prewarm_indexes();
+        queue_prewarm_dir(".");
+        for (i = 1; i < PREWARM_THREADS; i++) {
+                pthread_mutex_lock(&prewarm_mutex);
+                prewarm_threads++;
+                pthread_mutex_unlock(&prewarm_mutex);
+                if (pthread_create(&thread, NULL, prewarm_walker, NULL)) {
+                        pthread_mutex_lock(&prewarm_mutex);
+                        prewarm_threads--;
+                        pthread_mutex_unlock(&prewarm_mutex);
+                        break;
+                }
+                pthread_detach(thread);
+        }
+        return prewarm_walker(arg);
+}
+
+static void start_prewarm(void)
+{
+        pthread_t thread;
+
+        if (!prewarm) {
+                return;
+        }
+        prewarm_start = now_ns();
+        prewarm_threads = 1;
+        if (pthread_create(&thread, NULL, prewarm_main, NULL) == 0) {
+                pthread_detach(thread);
+        }
+}
+
+/* Returns the control inode for name in parent, or NULL */
+static struct inode *lookup_ctl(struct inode *parent, const char *name)
+{
+        if (parent == root_inode && !strcmp(name, CTL_DIR)) {
+                return ctl_inode;
+        }
+        if (parent != ctl_inode) {
+                return NULL;
+        }
+        if (!strcmp(name, "stats")) {
+                return stats_inode;
+        }
+        if (!strcmp(name, "heat")) {
+                return heat_inode;
+        }
+        if (!strcmp(name, "pins")) {
+                return pins_inode;
+        }
+        return NULL;
+}
+
+static void stat_ctl(struct inode *inode, struct stat *st)
+{
+        memset(st, 0, sizeof(*st));
+        st->st_ino = (uintptr_t)inode;
+        if (inode == ctl_inode) {
+                st->st_mode = S_IFDIR | 0555;
+                st->st_nlink = 2;
+        } else {
+                st->st_mode = S_IFREG | 0444;
+                st->st_nlink = 1;
+        }
+        st->st_uid = getuid();
+        st->st_gid = getgid();
+        st->st_atim = st->st_mtim = st->st_ctim = start_time;
+}
+
+/* A snapshot of a file in the control directory, taken when it is opened */
+struct ctl_file {
+        char *buf;
+        size_t len;
+};
+
+static double hit_rate(uint64_t hits, uint64_t misses)
+{
+        return hits + misses ? (double)hits / (hits + misses) : 0;
+}
+
+static void print_stats(FILE *fh)
+{
+        struct thread_stats total;
+        struct thread_stats *t;
+        size_t cache_bytes = 0, pinned_bytes = 0, idle_bytes, disk_size;
+        int source_fds;
+        uint64_t *c = total.counters;
+        int i, j, last;
+
+        pthread_mutex_lock(&stats_mutex);
+        memcpy(&total, &retired_stats, sizeof(total));
+        for (t = all_stats; t; t = t->next) {
+                add_stats(&total, t);
+        }
+        pthread_mutex_unlock(&stats_mutex);
+
+        for (i = 0; block_cache_size && i < BLOCK_CACHE_SHARDS; i++) {
+                pthread_mutex_lock(&block_cache[i].mutex);
+                cache_bytes += block_cache[i].size;
+                pinned_bytes += block_cache[i].pinned_size;
+                pthread_mutex_unlock(&block_cache[i].mutex);
+        }
+        pthread_mutex_lock(&index_cache_mutex);
+        idle_bytes = index_idle_size;
+        pthread_mutex_unlock(&index_cache_mutex);
+        pthread_mutex_lock(&disk_mutex);
+        disk_size = disk_bytes;
+        pthread_mutex_unlock(&disk_mutex);
+        pthread_mutex_lock(&source_mutex);
+        source_fds = num_source_fds;
+        pthread_mutex_unlock(&source_mutex);
+
+        fprintf(fh, "uptime_s %.1f\n", (now_ns() - start_ns) / 1e9);
+        fprintf(fh, "\n%-10s %12s %10s %8s %8s\n", "op", "count", "avg_us",
+                "p50_us", "p99_us");
+        for (i = 0; i < NUM_OPS; i++) {
+                struct op_stats *o = &total.ops[i];
+
+                fprintf(fh, "%-10s %12" PRIu64 " %10.1f %8" PRIu64
+                        " %8" PRIu64 "\n", op_names[i], o->count,
+                        o->count ? o->total_ns / 1e3 / o->count : 0,
+                        latency_percentile(o, 0.5),
+                        latency_percentile(o, 0.99));
+        }
+
+        /* <limit in us>:<count> for the buckets up to the last one used */
+        fprintf(fh, "\n");
+        for (i = 0; i < NUM_OPS; i++) {
+                struct op_stats *o = &total.ops[i];
+
+                for (last = LATENCY_BUCKETS - 1; last > 0; last--) {
+                        if (o->buckets[last]) {
+                                break;
+                        }
+                }
+                fprintf(fh, "latency_%s", op_names[i]);
+                for (j = 0; j <= last; j++) {
+                        fprintf(fh, " %llu:%" PRIu64, 1ULL << j,
+                                o->buckets[j]);
+                }
+                fprintf(fh, "\n");
+        }
+
+        fprintf(fh, "\n");
+        for (i = 0; i < NUM_STATS; i++) {
+                fprintf(fh, "%s %" PRIu64 "\n", stat_names[i], c[i]);
+        }
+        fprintf(fh, "block_cache_hit_rate %.3f\n",
+                hit_rate(c[STAT_BLOCK_HITS], c[STAT_BLOCK_MISSES]));
+        fprintf(fh, "index_cache_hit_rate %.3f\n",
+                hit_rate(c[STAT_INDEX_HITS], c[STAT_INDEX_MISSES]));
+        fprintf(fh, "block_cache_bytes %zu\n", cache_bytes);
+        fprintf(fh, "block_cache_max_bytes %zu\n", block_cache_size);
+        fprintf(fh, "block_cache_pinned_bytes %zu\n", pinned_bytes);
+        fprintf(fh, "index_cache_idle_bytes %zu\n", idle_bytes);
+        fprintf(fh, "index_cache_max_bytes %zu\n", index_cache_size);
+        fprintf(fh, "disk_cache_bytes %zu\n", disk_size);
+        fprintf(fh, "disk_cache_max_bytes %zu\n", disk_cache_size);
+        fprintf(fh, "source_fds %d\n", source_fds);
+        fprintf(fh, "max_source_fds %d\n", max_source_fds);
+        fprintf(fh, "inflate_threads %d\n", inflate_threads);
+        fprintf(fh, "readahead_inflight %d\n",
+                __atomic_load_n(&readahead_inflight, __ATOMIC_RELAXED));
+}
+
+/* <file> <entry> <uaddr> <reads> for each index entry that has been read,
+ * of the files whose index is in the index cache
+ */
+static void print_heat(FILE *fh)
+{
+        char stripped[PATH_MAX];
+        struct bgzf_index *idx;
+        uint32_t *heat, n;
+        int i, e;
+
+        pthread_mutex_lock(&index_cache_mutex);
+        for (i = 0; i < INDEX_CACHE_BUCKETS; i++) {
+                for (idx = index_cache[i]; idx; idx = idx->hash_next) {
+                        heat = __atomic_load_n(&idx->heat, __ATOMIC_ACQUIRE);
+                        if (heat == NULL) {
+                                continue;
+                        }
+                        strip_bgzip_suffix(idx->path, stripped);
+                        for (e = 0; e < idx->noffs; e++) {
+                                n = __atomic_load_n(&heat[e],
+                                                    __ATOMIC_RELAXED);
+                                if (n == 0) {
+                                        continue;
+                                }
+                                fprintf(fh, "%s %d %" PRIu64 " %" PRIu32
+                                        "\n", stripped, e,
+                                        (uint64_t)index_entry(idx, e).uaddr,
+                                        n);
+                        }
+                }
+        }
+        pthread_mutex_unlock(&index_cache_mutex);
+}
+
+/* <file> all, or <file> <start>-<end>, for each pin, see set_pin() */
+static void print_pins(FILE *fh)
+{
+        struct pin *pin;
+
+        pthread_mutex_lock(&pin_mutex);
+        for (pin = pins; pin; pin = pin->next) {
+                if (pin->end == UINT64_MAX) {
+                        fprintf(fh, "%s all\n", pin->path);
+                } else {
+                        fprintf(fh, "%s %" PRIu64 "-%" PRIu64 "\n",
+                                pin->path, pin->start, pin->end);
+                }
+        }
+        pthread_mutex_unlock(&pin_mutex);
+}
+
+static struct ctl_file *open_ctl_file(struct inode *inode)
+{
+        struct ctl_file *sf = calloc(1, sizeof(*sf));
+        FILE *fh;
+
+        if (sf == NULL) {
+                return NULL;
+        }
+        fh = open_memstream(&sf->buf, &sf->len);
+        if (fh == NULL) {
+                free(sf);
+                return NULL;
+        }
+        if (inode == stats_inode) {
+                print_stats(fh);
+        } else if (inode == heat_inode) {
+                print_heat(fh);
+        } else {
+                print_pins(fh);
+        }
+        fclose(fh);
+        return sf;
+}
+
+/* Fills in e for name in the directory parent and takes a lookup
+ * reference on its inode. bgzip is passed on to stat_path().
+ */
+static int lookup_entry(struct inode *parent, const char *name, int bgzip,
+                        struct fuse_entry_param *e)
+{
+        char path[PATH_MAX];
+        struct inode *inode;
+        int ret;
+
+        memset(e, 0, sizeof(*e));
+        inode = lookup_ctl(parent, name);
+        if (inode) {
+                stat_ctl(inode, &e->attr);
+                e->ino = (uintptr_t)inode;
+                e->attr_timeout = attr_timeout;
+                e->entry_timeout = entry_timeout;
+                return 0;
+        }
+        if (parent == ctl_inode) {
+                return -ENOENT;
+        }
+
+        ret = child_path(parent, name, path);
+        if (ret) {
+                return ret;
+        }
+        ret = stat_path(path, bgzip, &e->attr);
+        if (ret < 0) {
+                return ret;
+        }
+        inode = ref_inode(path, ret);
+        if (inode == NULL) {
+                return -ENOMEM;
+        }
+        e->ino = (uintptr_t)inode;
+        e->attr_timeout = attr_timeout;
+        e->entry_timeout = entry_timeout;
+        return 0;
+}
+
+static void fuse_bgzip_lookup(fuse_req_t req, fuse_ino_t parent,
+                              const char *name)
+{
+        struct fuse_entry_param e;
+        uint64_t start = now_ns();
+        int ret;
+
+        ret = lookup_entry(get_inode(parent), name, -1, &e);
+        LOG("LOOKUP [%s] %d\n", name, ret);
+        if (ret == -ENOENT && negative_timeout > 0) {
+                /* Let the kernel cache that the name does not exist */
+                memset(&e, 0, sizeof(e));
+                e.entry_timeout = negative_timeout;
+                fuse_reply_entry(req, &e);
+        } else if (ret) {
+                fuse_reply_err(req, -ret);
+        } else {
+                fuse_reply_entry(req, &e);
+        }
+        count_op(OP_LOOKUP, start);
+}
+
+static void fuse_bgzip_forget(fuse_req_t req, fuse_ino_t ino,
+                              uint64_t nlookup)
+{
+        forget_inode(get_inode(ino), nlookup);
+        fuse_reply_none(req);
+}
+
+static void fuse_bgzip_forget_multi(fuse_req_t req, size_t count,
+                                    struct fuse_forget_data *forgets)
+{
+        size_t i;
+
+        for (i = 0; i < count; i++) {
+                forget_inode(get_inode(forgets[i].ino), forgets[i].nlookup);
+        }
+        fuse_reply_none(req);
+}
+
+static void fuse_bgzip_getattr(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *fi)
+{
+        struct inode *inode = get_inode(ino);
+        uint64_t start = now_ns();
+        struct stat st;
+        int ret;
+
+        if (is_ctl_inode(inode)) {
+                stat_ctl(inode, &st);
+                fuse_reply_attr(req, &st, attr_timeout);
+                return;
+        }
+        ret = __atomic_load_n(&inode->bgzip, __ATOMIC_RELAXED);
+        if (ret != 1 || stat_bgzip_inode(inode, &st)) {
+                ret = stat_path(inode->path, ret, &st);
+        }
+        if (ret < 0) {
+                LOG("GETATTR [%s] %s\n", inode->path, strerror(-ret));
+                fuse_reply_err(req, -ret);
+        } else {
+                __atomic_store_n(&inode->bgzip, ret, __ATOMIC_RELAXED);
+                LOG("GETATTR [%s] SUCCESS\n", inode->path);
+                fuse_reply_attr(req, &st, attr_timeout);
+        }
+        count_op(OP_GETATTR, start);
+}
+
+/* Handles are carved out of slabs of FILE_SLAB and go back on a free
+ * list when they are released, so that opening and closing many files
+ * does not churn the heap.
+ */
+#define FILE_SLAB 64
+
+static pthread_mutex_t file_slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct file *free_files;
+
+static struct file *alloc_file(void)
+{
+        struct file *file;
+        int i;
+
+        pthread_mutex_lock(&file_slab_mutex);
+        if (free_files == NULL) {
+                file = calloc(FILE_SLAB, sizeof(*file));
+                for (i = 0; file && i < FILE_SLAB; i++) {
+                        file[i].next_free = free_files;
+                        free_files = &file[i];
+                }
+        }
+        file = free_files;
+        if (file) {
+                free_files = file->next_free;
+        }
+        pthread_mutex_unlock(&file_slab_mutex);
+        if (file == NULL) {
+                return NULL;
+        }
+        memset(file, 0, sizeof(*file));
+        file->fd = -1;
+        file->refcount = 1;
+        pthread_mutex_init(&file->mutex, NULL);
+        return file;
+}
+
+static void free_file(struct file *file)
+{
+        pthread_mutex_destroy(&file->mutex);
+        pthread_mutex_lock(&file_slab_mutex);
+        file->next_free = free_files;
+        free_files = file;
+        pthread_mutex_unlock(&file_slab_mutex);
+}
+
+static void put_file(struct file *file)
+{
+        if (__atomic_sub_fetch(&file->refcount, 1, __ATOMIC_ACQ_REL)) {
+                return;
+        }
+        if (file->idx) {
+                put_index(file->idx);
+        }
+        if (file->stream) {
+                stop_stream(file->stream);
+                free(file->stream);
+        }
+        free(file->built_index);
+        if (file->src) {
+                put_source(file->src);
+        } else if (file->fd != -1) {
+                close_source(file->fd);
+        }
+        free_file(file);
+}
+
+/* Pull every block of index entry e into the block cache, with the
+ * compressed data from span if it is not NULL.
+ */
+static void prefetch_entry(struct file *file, int e, struct cspan *span)
+{
+        struct bgzf_index *idx = file->idx;
+        bgzidx1_t ent = index_entry(idx, e);
+        uint64_t caddr = ent.caddr, uaddr = ent.uaddr, end = UINT64_MAX;
+
+        if (idx->windows) {
+                struct cached_block *blk;
+
+                blk = get_zran_block(file, idx, e, uaddr);
+                if (blk) {
+                        block_cache_put(blk);
+                }
+                return;
+        }
+
+        if (e + 1 < idx->noffs) {
+                end = index_entry(idx, e + 1).uaddr;
+        }
+        do {
+                struct cached_block *blk;
+                int eof;
+
+                blk = get_span_block(file, caddr, span);
+                if (blk == NULL) {
+                        return;
+                }
+                eof = blk->clen == 0;
+                uaddr += blk->ulen;
+                caddr += blk->clen;
+                block_cache_put(blk);
+                if (eof) {
+                        return;
+                }
+        } while (uaddr < end);
+}
+
+struct readahead {
+        struct file *file;
+        int first;
+        int gen;                /* ra_gen of the file when it was started */
+        struct cspan span;
+};
+
+static void readahead_job(void *arg, int i)
+{
+        struct readahead *ra = arg;
+
+        if (__atomic_load_n(&ra->file->ra_gen, __ATOMIC_RELAXED) != ra->gen) {
+                count_stat(STAT_READAHEAD_CANCELLED, 1);
+                return;
+        }
+        if (pin_file(ra->file) == 0) {
+                prefetch_entry(ra->file, ra->first + i, &ra->span);
+                unpin_file(ra->file);
+        }
+}
+
+static void readahead_done(void *arg)
+{
+        struct readahead *ra = arg;
+
+        __atomic_sub_fetch(&readahead_inflight, 1, __ATOMIC_RELAXED);
+        free_span(&ra->span);
+        put_file(ra->file);
+        free(ra);
+}
+
+/* Track the access pattern of a handle and, once it reads sequentially,
+ * prefetch the index entries following this read into the block cache.
+ * The window grows while the reader keeps consuming prefetched data and
+ * collapses as soon as it seeks somewhere else, which also cancels the
+ * readahead that has not run yet.
+ */
+static void update_readahead(struct file *file, off_t offset, size_t size)
+{
+        struct bgzf_index *idx = __atomic_load_n(&file->idx, __ATOMIC_ACQUIRE);
+        struct readahead *ra;
+        int last, first, n;
+
+        if (max_readahead <= 0 || block_cache_size == 0 ||
+            inflate_threads <= 0 || size == 0 || idx == NULL) {
+                return;
+        }
+
+        last = find_index_entry(idx, offset + size - 1);
+
+        pthread_mutex_lock(&file->mutex);
+        if ((uint64_t)offset != file->ra_last_end) {
+                if (file->ra_next) {
+                        __atomic_add_fetch(&file->ra_gen, 1, __ATOMIC_RELAXED);
+                }
+                file->ra_last_end = offset + size;
+                file->ra_window = 0;
+                file->ra_next = 0;
+                pthread_mutex_unlock(&file->mutex);
+                return;
+        }
+        file->ra_last_end = offset + size;
+        if (file->ra_window == 0) {
+                file->ra_window = MIN_READAHEAD;
+        } else if (find_index_entry(idx, offset) < file->ra_next &&
+                   file->ra_window < max_readahead) {
+                file->ra_window *= 2;
+        }
+        if (file->ra_window > max_readahead) {
+                file->ra_window = max_readahead;
+        }
+
+        /* Only top up the window once half of it has been consumed */
+        first = last + 1;
+        if (file->ra_next > first) {
+                if (file->ra_next - first > file->ra_window / 2) {
+                        pthread_mutex_unlock(&file->mutex);
+                        return;
+                }
+                first = file->ra_next;
+        }
+        n = last + 1 + file->ra_window - first;
+        if (first + n > idx->noffs) {
+                n = idx->noffs - first;
+        }
+        if (n <= 0) {
+                pthread_mutex_unlock(&file->mutex);
+                return;
+        }
+        file->ra_next = first + n;
+        pthread_mutex_unlock(&file->mutex);
+
+        ra = malloc(sizeof(*ra));
+        if (ra == NULL) {
+                return;
+        }
+        ra->file = file;
+        ra->first = first;
+        ra->gen = __atomic_load_n(&file->ra_gen, __ATOMIC_RELAXED);
+        if (idx->windows == NULL) {
+                init_span(&ra->span, file, idx, first, n);
+        } else {
+                memset(&ra->span, 0, sizeof(ra->span));
+        }
+        __atomic_add_fetch(&file->refcount, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&readahead_inflight, 1, __ATOMIC_RELAXED);
+        count_stat(STAT_READAHEAD_ENTRIES, n);
+        if (start_batch(readahead_job, ra, n, file, readahead_done)) {
+                readahead_done(ra);
+        }
+}
+
+/* Reads are counted per index entry, for the heat file, see print_heat().
+ * Only one read in HEAT_SAMPLE of each thread is counted, so the counts
+ * are only good for telling the hot parts of a file from the rest, and
+ * the counts go when the index is dropped from the index cache.
+ */
+#define HEAT_SAMPLE 16
+
+static void count_heat(struct file *file, off_t offset, size_t size)
+{
+        struct bgzf_index *idx = __atomic_load_n(&file->idx, __ATOMIC_ACQUIRE);
+        struct thread_stats *stats = get_thread_stats();
+        uint32_t *heat, *new;
+        int e, last;
+
+        if (idx == NULL || idx->noffs == 0 || size == 0 || stats == NULL ||
+            stats->heat_tick++ % HEAT_SAMPLE) {
+                return;
+        }
+        heat = __atomic_load_n(&idx->heat, __ATOMIC_ACQUIRE);
+        if (heat == NULL) {
+                new = calloc(idx->noffs, sizeof(*new));
+                if (new == NULL) {
+                        return;
+                }
+                if (__atomic_compare_exchange_n(&idx->heat, &heat, new, 0,
+                                                __ATOMIC_ACQ_REL,
+                                                __ATOMIC_ACQUIRE)) {
+                        heat = new;
+                } else {
+                        free(new);
+                }
+        }
+        last = find_index_entry(idx, offset + size - 1);
+        for (e = find_index_entry(idx, offset); e <= last; e++) {
+                __atomic_add_fetch(&heat[e], 1, __ATOMIC_RELAXED);
+        }
+}
+
+/* The buffer a worker thread replies to reads from. fuse_reply_buf() has
+ * written it to the device by the time it returns, so every read of the
+ * thread reuses it instead of allocating its own.
+ */
+struct read_buf {
+        size_t size;
+        char data[];
+};
+
+static pthread_key_t read_buf_key;
+static pthread_once_t read_buf_once = PTHREAD_ONCE_INIT;
+
+static void create_read_buf_key(void)
+{
+        pthread_key_create(&read_buf_key, free);
+}
+
+static char *get_read_buf(size_t size)
+{
+        struct read_buf *rb;
+
+        pthread_once(&read_buf_once, create_read_buf_key);
+        rb = pthread_getspecific(read_buf_key);
+        if (rb && rb->size >= size) {
+                return rb->data;
+        }
+        free(rb);
+        pthread_setspecific(read_buf_key, NULL);
+        rb = malloc(sizeof(*rb) + size);
+        if (rb == NULL) {
+                return NULL;
+        }
+        rb->size = size;
+        pthread_setspecific(read_buf_key, rb);
+        return rb->data;
+}
+
+/* Returns the referenced block that holds all size bytes at offset, with
+ * *pos set to where they start in it, or NULL if the read does not fit
+ * in one block. Such reads are replied to straight from the block
+ * instead of being copied into a reply buffer first.
+ */
+static struct cached_block *get_read_block(struct file *file, size_t size,
+                                           off_t offset, size_t *pos)
+{
+        struct bgzf_index *idx = file->idx;
+        struct cached_block *blk;
+        uint64_t caddr, uaddr;
+        bgzidx1_t ent;
+
+        if (file->stream || idx == NULL || idx->noffs == 0 || idx->windows ||
+            size == 0 || size > BGZF_MAX_BLOCK_SIZE || pin_file(file)) {
+                return NULL;
+        }
+        ent = index_entry(idx, find_index_entry(idx, offset));
+        caddr = ent.caddr;
+        uaddr = ent.uaddr;
+        while (1) {
+                blk = get_block(file, caddr);
+                if (blk == NULL || blk->clen == 0 ||
+                    (uint64_t)offset < uaddr + blk->ulen) {
+                        break;
+                }
+                uaddr += blk->ulen;
+                caddr += blk->clen;
+                block_cache_put(blk);
+        }
+        unpin_file(file);
+        if (blk && (blk->clen == 0 || offset + size > uaddr + blk->ulen)) {
+                block_cache_put(blk);
+                return NULL;
+        }
+        *pos = offset - uaddr;
+        return blk;
+}
+
+static void fuse_bgzip_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t offset, struct fuse_file_info *fi)
+{
+        struct file *file = (void *)fi->fh;
+        struct fuse_bufvec bv = FUSE_BUFVEC_INIT(size);
+        uint64_t start = now_ns();
+        struct cached_block *blk;
+        size_t pos;
+        char *buf;
+        int ret;
+
+        if (is_ctl_inode(get_inode(ino))) {
+                struct ctl_file *sf = (void *)fi->fh;
+
+                if ((size_t)offset >= sf->len) {
+                        size = 0;
+                } else if (size > sf->len - offset) {
+                        size = sf->len - offset;
+                }
+                fuse_reply_buf(req, sf->buf + offset, size);
+                return;
+        }
+        if (file->stream == NULL && file->idx == NULL) {
+                ret = pin_file(file);
+                if (ret) {
+                        fuse_reply_err(req, -ret);
+                        return;
+                }
+                if (!is_remote_fd(file->fd)) {
+                        /* Files that are passed through are replied to
+                         * with the descriptor and offset, so that libfuse
+                         * can splice the data straight from the underlying
+                         * file into the fuse device without it ever being
+                         * copied through our buffers.
+                         */
+                        bv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                        bv.buf[0].fd = file->fd;
+                        bv.buf[0].pos = offset;
+                        fuse_reply_data(req, &bv, FUSE_BUF_SPLICE_MOVE);
+                        unpin_file(file);
+                        count_op(OP_READ, start);
+                        return;
+                }
+                unpin_file(file);
+        }
+
+        blk = get_read_block(file, size, offset, &pos);
+        if (blk) {
+                LOG("READ [%s] %jd:%zu %zu\n", get_inode(ino)->path,
+                    (intmax_t)offset, size, size);
+                update_readahead(file, offset, size);
+                count_heat(file, offset, size);
+                fuse_reply_buf(req, (char *)blk->data + pos, size);
+                block_cache_put(blk);
+                count_stat(STAT_BYTES_SERVED, size);
+                count_op(OP_READ, start);
+                return;
+        }
+
+        buf = get_read_buf(size);
+        if (buf == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+        ret = read_file(file, buf, size, offset);
+        if (ret < 0) {
+                LOG_ERROR("READ [%s] %jd:%zu %s\n", get_inode(ino)->path,
+                    (intmax_t)offset, size, strerror(-ret));
+                fuse_reply_err(req, -ret);
+                return;
+        }
+        LOG("READ [%s] %jd:%zu %d\n", get_inode(ino)->path,
+            (intmax_t)offset, size, ret);
+        /* Before replying, as the handle may be released right after */
+        update_readahead(file, offset, ret);
+        count_heat(file, offset, ret);
+        fuse_reply_buf(req, buf, ret);
+        count_stat(STAT_BYTES_SERVED, ret);
+        count_op(OP_READ, start);
+}
+
+/* All the names in a directory, with a hash set on top so the bgzip
+ * triples can be worked out from the listing alone.
+ */
+struct dir_entry {
+        char *name;
+        ino_t ino;
+        unsigned char type;
+        uint8_t need_uncompress;
+};
+
+struct dir_listing {
+        struct dir_entry *ents;
+        int num, max;
+        int *set;               /* open addressing, -1 is empty */
+        size_t set_size;
+};
+
+static void free_listing(struct dir_listing *l)
+{
+        int i;
+
+        for (i = 0; i < l->num; i++) {
+                free(l->ents[i].name);
+        }
+        free(l->ents);
+        free(l->set);
+}
+
+static int read_listing(DIR *dir, struct dir_listing *l)
+{
+        struct dirent *ent;
+        size_t i;
+
+        memset(l, 0, sizeof(*l));
+        while ((ent = readdir(dir)) != NULL) {
+                if (l->num == l->max) {
+                        struct dir_entry *ents;
+
+                        l->max = l->max ? l->max * 2 : 64;
+                        ents = realloc(l->ents, l->max * sizeof(*ents));
+                        if (ents == NULL) {
+                                return -ENOMEM;
+                        }
+                        l->ents = ents;
+                }
+                l->ents[l->num].name = strdup(ent->d_name);
+                if (l->ents[l->num].name == NULL) {
+                        return -ENOMEM;
+                }
+                l->ents[l->num].ino = ent->d_ino;
+                l->ents[l->num].type = ent->d_type;
+                l->ents[l->num].need_uncompress = 0;
+                l->num++;
+        }
+
+        for (l->set_size = 64; l->set_size < 2 * (size_t)l->num;) {
+                l->set_size <<= 1;
+        }
+        l->set = malloc(l->set_size * sizeof(int));
+        if (l->set == NULL) {
+                return -ENOMEM;
+        }
+        memset(l->set, 0xff, l->set_size * sizeof(int));
+        for (i = 0; i < (size_t)l->num; i++) {
+                size_t h = hash_path(l->ents[i].name) & (l->set_size - 1);
+
+                while (l->set[h] != -1) {
+                        h = (h + 1) & (l->set_size - 1);
+                }
+                l->set[h] = i;
+        }
+        return 0;
+}
+
+/* Returns the entry for name, or NULL if it is not in the directory */
+static struct dir_entry *find_listing(struct dir_listing *l,
+                                      const char *name)
+{
+        size_t h = hash_path(name) & (l->set_size - 1);
+
+        while (l->set[h] != -1) {
+                if (!strcmp(l->ents[l->set[h]].name, name)) {
+                        return &l->ents[l->set[h]];
+                }
+                h = (h + 1) & (l->set_size - 1);
+        }
+        return NULL;
+}
+
+/* Work out need_bgzip_uncompress() for a name from the listing instead of
+ * with fstatat(). Returns -1 if the listing can not decide, which is the
+ * case when symlinks are involved since fstatat() follows them.
+ */
+static int listing_need_uncompress(struct dir_listing *l, const char *name)
+{
+        const struct format *fmt;
+        char stripped[PATH_MAX];
+        char tmp[PATH_MAX];
+        struct dir_entry *e;
+
+        strip_bgzip_suffix(name, stripped);
+
+        e = find_listing(l, stripped);
+        if (e) {
+                return e->type == DT_LNK ? -1 : 0;
+        }
+        for (fmt = formats; fmt->name; fmt++) {
+                snprintf(tmp, PATH_MAX, "%s%s", stripped, fmt->suffix);
+                e = find_listing(l, tmp);
+                if (e == NULL) {
+                        continue;
+                }
+                if (e->type == DT_LNK || fmt->index_suffix == NULL) {
+                        /* Only the file itself can tell if it has one */
+                        return -1;
+                }
+                snprintf(tmp, PATH_MAX, "%s%s", stripped, fmt->index_suffix);
+                e = find_listing(l, tmp);
+                if (e && e->type == DT_LNK) {
+                        return -1;
+                }
+                if (e || build_indexes) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+static struct dir_listing *ctl_listing(void)
+{
+        static const char *names[] = { ".", "..", "stats", "heat", "pins" };
+        struct inode *inodes[] = {
+                ctl_inode, ctl_inode, stats_inode, heat_inode, pins_inode
+        };
+        struct dir_listing *listing;
+        int i;
+
+        listing = calloc(1, sizeof(*listing));
+        if (listing == NULL) {
+                return NULL;
+        }
+        listing->ents = calloc(5, sizeof(struct dir_entry));
+        if (listing->ents == NULL) {
+                free(listing);
+                return NULL;
+        }
+        for (i = 0; i < 5; i++) {
+                listing->ents[i].name = strdup(names[i]);
+                if (listing->ents[i].name == NULL) {
+                        free_listing(listing);
+                        free(listing);
+                        return NULL;
+                }
+                listing->ents[i].type = i < 2 ? DT_DIR : DT_REG;
+                listing->ents[i].ino = (uintptr_t)inodes[i];
+                listing->num++;
+        }
+        return listing;
+}
+
+/* The whole directory is read at opendir so that every entry can be
+ * classified from the set of names, without any per entry syscalls. The
+ * results are stored in the lookup cache in one go, ready for the lookups
+ * that follow, and the listing is cut down to the names that are shown
+ * for readdir to page through.
+ */
+static int open_listing(struct inode *inode, struct dir_listing **listingp)
+{
+        struct dir_listing *listing;
+        DIR *dir;
+        int fd, i, n, ret;
+
+        LOG("OPENDIR [%s]\n", inode->path);
+
+        listing = malloc(sizeof(*listing));
+        if (listing == NULL) {
+                return -ENOMEM;
+        }
+        fd = openat(dir_fd, inode->path, O_DIRECTORY);
+        if (fd == -1) {
+                ret = -errno;
+                free(listing);
+                return ret;
+        }
+        dir = fdopendir(fd);
+        if (dir == NULL) {
+                ret = -errno;
+                close(fd);
+                free(listing);
+                return ret;
+        }
+        watch_dir(inode->path);
+        ret = read_listing(dir, listing);
+        closedir(dir);
+        if (ret) {
+                free_listing(listing);
+                free(listing);
+                return ret;
+        }
+
+        for (i = 0; i < listing->num; i++) {
+                struct dir_entry *e = &listing->ents[i];
+                char full_path[PATH_MAX];
+                int need;
+
+                if (child_path(inode, e->name, full_path)) {
+                        continue;
+                }
+                need = listing_need_uncompress(listing, e->name);
+                if (need < 0) {
+                        need = need_bgzip_uncompress(full_path);
+                } else {
+                        store_need_uncompress(full_path, need);
+                }
+                e->need_uncompress = need;
+        }
+
+        /* Show each triple under the stripped name, with the inode number
+         * of the .gz that getattr reports. Renamed entries are marked with
+         * 2 until the other names of the triple have been dropped. With
+         * --build-index a .gz that has no .gz.gzi is renamed itself, and so
+         * is a compressed file of a format without an index file.
+         */
+        for (i = 0; i < listing->num; i++) {
+                struct dir_entry *e = &listing->ents[i];
+                const struct format *fmt;
+                char index[PATH_MAX];
+                size_t len;
+
+                fmt = name_format(e->name, 0);
+                if (e->need_uncompress != 1 || fmt == NULL) {
+                        continue;
+                }
+                len = strlen(e->name) - strlen(fmt->suffix);
+                if (fmt->index_suffix) {
+                        snprintf(index, PATH_MAX, "%.*s%s", (int)len,
+                                 e->name, fmt->index_suffix);
+                        if (!build_indexes || find_listing(listing, index)) {
+                                continue;
+                        }
+                }
+                e->name[len] = 0;
+                e->type = DT_REG;
+                e->need_uncompress = 2;
+        }
+        for (i = 0; i < listing->num; i++) {
+                struct dir_entry *e = &listing->ents[i];
+                const struct format *fmt;
+                char name[PATH_MAX];
+                struct dir_entry *gz;
+                size_t len;
+
+                fmt = name_format(e->name, 1);
+                if (!e->need_uncompress || fmt == NULL) {
+                        continue;
+                }
+                len = strlen(e->name) - strlen(fmt->index_suffix);
+                snprintf(name, PATH_MAX, "%.*s%s", (int)len, e->name,
+                         fmt->suffix);
+                gz = find_listing(listing, name);
+                if (gz) {
+                        e->ino = gz->ino;
+                }
+                e->name[len] = 0;
+                e->type = DT_REG;
+                e->need_uncompress = 2;
+        }
+        for (i = 0, n = 0; i < listing->num; i++) {
+                struct dir_entry *e = &listing->ents[i];
+
+                if (e->need_uncompress == 1) {
+                        free(e->name);
+                        continue;
+                }
+                e->need_uncompress = !!e->need_uncompress;
+                listing->ents[n++] = *e;
+        }
+        listing->num = n;
+        free(listing->set);
+        listing->set = NULL;
+
+        *listingp = listing;
+        return 0;
+}
+
+static void fuse_bgzip_opendir(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *fi)
+{
+        struct inode *inode = get_inode(ino);
+        struct dir_listing *listing;
+        uint64_t start = now_ns();
+        int64_t val;
+        int ret;
+
+        if (inode == ctl_inode) {
+                listing = ctl_listing();
+                ret = listing ? 0 : -ENOMEM;
+        } else {
+                ret = open_listing(inode, &listing);
+        }
+        if (ret) {
+                fuse_reply_err(req, -ret);
+                return;
+        }
+
+        fi->fh = (uintptr_t)listing;
+        /* The kernel may keep the listing while the watch will tell it
+         * about changes.
+         */
+        fi->cache_readdir = 1;
+        fi->keep_cache = lookup_cache_get(&watched_dirs, inode->path,
+                                          &val) == 0;
+        fuse_reply_open(req, fi);
+        count_op(OP_OPENDIR, start);
+}
+
+/* Copies the entries from offset on that fit in size into the reply. For
+ * readdirplus every entry also carries its attributes and takes a lookup
+ * reference, except for . and .. which the kernel resolves itself.
+ */
+static void reply_listing(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t offset, struct fuse_file_info *fi, int plus)
+{
+        struct dir_listing *listing = (void *)fi->fh;
+        struct inode *inode = get_inode(ino);
+        size_t pos = 0;
+        char *buf;
+        int i;
+
+        buf = malloc(size);
+        if (buf == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+        for (i = offset; i < listing->num; i++) {
+                struct dir_entry *e = &listing->ents[i];
+                struct fuse_entry_param ep;
+                size_t len;
+
+                memset(&ep, 0, sizeof(ep));
+                ep.attr.st_ino = e->ino;
+                if (e->type != DT_UNKNOWN) {
+                        ep.attr.st_mode = DTTOIF(e->type);
+                }
+                if (!plus) {
+                        len = fuse_add_direntry(req, buf + pos, size - pos,
+                                                e->name, &ep.attr, i + 1);
+                        if (len > size - pos) {
+                                break;
+                        }
+                        pos += len;
+                        continue;
+                }
+
+                /* Only look the entry up once it is known to fit */
+                len = fuse_add_direntry_plus(req, NULL, 0, e->name, NULL, 0);
+                if (len > size - pos) {
+                        break;
+                }
+                if (strcmp(e->name, ".") && strcmp(e->name, "..") &&
+                    lookup_entry(inode, e->name, e->need_uncompress, &ep)) {
+                        /* Gone since opendir */
+                        continue;
+                }
+                pos += fuse_add_direntry_plus(req, buf + pos, size - pos,
+                                              e->name, &ep, i + 1);
+        }
+        fuse_reply_buf(req, buf, pos);
+        free(buf);
+}
+
+static void fuse_bgzip_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                               off_t offset, struct fuse_file_info *fi)
+{
+        uint64_t start = now_ns();
+
+        reply_listing(req, ino, size, offset, fi, 0);
+        count_op(OP_READDIR, start);
+}
+
+static void fuse_bgzip_readdirplus(fuse_req_t req, fuse_ino_t ino,
+                                   size_t size, off_t offset,
+                                   struct fuse_file_info *fi)
+{
+        uint64_t start = now_ns();
+
+        reply_listing(req, ino, size, offset, fi, 1);
+        count_op(OP_READDIR, start);
+}
+
+static void fuse_bgzip_releasedir(fuse_req_t req, fuse_ino_t ino,
+                                  struct fuse_file_info *fi)
+{
+        struct dir_listing *listing = (void *)fi->fh;
+
+        free_listing(listing);
+        free(listing);
+        fuse_reply_err(req, 0);
+}
+
+/* Identity of the file each path had when it was last opened. The kernel
+ * is only allowed to keep the cached pages of a file from one open to the
+ * next if the file has not changed in between.
+ */
+static struct lookup_cache open_cache;
+
+static int keep_cache(const char *path, const struct file_id *id)
+{
+        int64_t digest = file_id_digest(id);
+        int64_t old;
+
+        if (lookup_cache_get(&open_cache, path, &old) == 0 && old == digest) {
+                return 1;
+        }
+        lookup_cache_set(&open_cache, path, digest);
+        return 0;
 }
 
-struct file {
-        BGZF *fh;
-        int fd;
-};
+/* Passthrough of plain files to the backing file in the kernel, if both
+ * the kernel and libfuse support it. Turned off again the first time the
+ * kernel refuses, which it does unless we have CAP_SYS_ADMIN.
+ */
+static int use_passthrough = 1;
 
-static char *logfile;
+/* Set up file, a .gz without a .gz.gzi, with a built index, or to be
+ * read sequentially until its index has been built.
+ */
+static int open_built_index(struct file *file, const char *path,
+                            const struct stat *st)
+{
+        char index[PATH_MAX];
+        int kind;
 
-static struct tdb_context *nu_tdb;
-static struct tdb_context *filesize_tdb;
+        file->builds_seen = __atomic_load_n(&index_builds_done,
+                                            __ATOMIC_ACQUIRE);
+        file->idx = get_built_index(path, file->fd, st, 1, index, &kind);
+        if (file->idx || kind != INDEX_ZRAN) {
+                return 0;
+        }
+        file->built_index = strdup(index);
+        file->stream = calloc(1, sizeof(struct gz_stream));
+        if (file->built_index == NULL || file->stream == NULL) {
+                free(file->stream);
+                file->stream = NULL;
+                return -ENOMEM;
+        }
+        return 0;
+}
 
-static char *mountpoint;
+static int open_file(struct inode *inode, struct fuse_file_info *fi,
+                     struct file **filep)
+{
+        const char *path = inode->path;
+        const struct format *fmt;
+        char tmp[PATH_MAX];
+        struct file *file;
+        struct stat st;
+        int bgzip, ret;
 
-/* descriptor for the underlying directory */
-static int dir_fd;
+        LOG("OPEN [%s]\n", path);
 
-/* This function takes a path to a file and returns true if this needs
- * bgzip unpacking.
- * For a file <file> we need to unpack the file if
- *   <file>        does not exist
- *   <file>.gz     exists
- *   <file>.gz.gzi exists
- * In that situation READDIR will just turn a single instance for the name
- * <file> and hide the entries for <file>.gz and <file>.gz.gzi
- *
- * IF all three files exist, we do not mutate any of the READDIR data
- * and return all three names. Then we just redirect all I/O to the unpacked
- * file. The reason we do not hide the <file>.gz and <file>.gz.gzi is to make
- * it possible for the user to see that something is odd/wrong and possibly
- * take action. (action == delete the unpacked file, it is redundant.)
+        bgzip = __atomic_load_n(&inode->bgzip, __ATOMIC_RELAXED);
+        if (bgzip < 0) {
+                bgzip = stat_path(path, -1, &st);
+                if (bgzip < 0) {
+                        return bgzip;
+                }
+                __atomic_store_n(&inode->bgzip, bgzip, __ATOMIC_RELAXED);
+        }
+
+        file = alloc_file();
+        if (file == NULL) {
+                return -ENOMEM;
+        }
+
+        if (!bgzip) {
+                file->src = get_source(path, &st);
+                if (file->src == NULL) {
+                        ret = -errno;
+                        LOG_INFO("OPEN FD [%s] %s\n", path, strerror(errno));
+                        put_file(file);
+                        return ret;
+                }
+                file->fd = file->src->fd;
+                set_file_id(&file->id, &st);
+                fi->keep_cache = keep_cache(path, &file->id);
+                unpin_file(file);
+                LOG("OPEN FD [%s] SUCCESS\n", path);
+                *filep = file;
+                return 0;
+        }
+
+        for (fmt = formats; fmt->name; fmt++) {
+                snprintf(tmp, PATH_MAX, "%s%s", path, fmt->suffix);
+                file->src = get_source(tmp, &st);
+                if (file->src || errno != ENOENT) {
+                        break;
+                }
+        }
+        if (file->src == NULL) {
+                ret = -errno;
+                LOG_INFO("OPEN BGZF openat [%s] %s\n", path,
+                    strerror(errno));
+                put_file(file);
+                return ret;
+        }
+        file->fmt = fmt;
+        file->fd = file->src->fd;
+        set_file_id(&file->id, &st);
+        map_source(file->src);
+
+        ret = 0;
+        if (fmt->index_suffix == NULL) {
+                file->idx = get_index(tmp);
+        } else {
+                snprintf(tmp, PATH_MAX, "%s%s", path, fmt->index_suffix);
+                if (build_indexes && faccessat(dir_fd, tmp, F_OK, 0)) {
+                        ret = open_built_index(file, path, &st);
+                } else {
+                        file->idx = get_index(tmp);
+                }
+        }
+        unpin_file(file);
+        if (ret) {
+                put_file(file);
+                return ret;
+        }
+        if (file->idx == NULL && file->stream == NULL) {
+                LOG_ERROR("OPEN BGZF load_index [%s] EIO\n", path);
+                put_file(file);
+                return -EIO;
+        }
+
+        fi->keep_cache = keep_cache(path, &file->id);
+        store_hot_file(path);
+        *filep = file;
+        return 0;
+}
+
+static void fuse_bgzip_open(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi)
+{
+        struct inode *inode = get_inode(ino);
+        uint64_t start = now_ns();
+        struct ctl_file *sf;
+        struct file *file;
+        int ret;
+
+        if (inode == ctl_inode) {
+                fuse_reply_err(req, EISDIR);
+                return;
+        }
+        if (is_ctl_inode(inode)) {
+                sf = open_ctl_file(inode);
+                if (sf == NULL) {
+                        fuse_reply_err(req, ENOMEM);
+                        return;
+                }
+                /* The size is not known up front */
+                fi->direct_io = 1;
+                fi->fh = (uint64_t)sf;
+                fuse_reply_open(req, fi);
+                return;
+        }
+
+        ret = open_file(inode, fi, &file);
+        if (ret) {
+                fuse_reply_err(req, -ret);
+                return;
+        }
+
+#ifdef FUSE_CAP_PASSTHROUGH
+        if (file->stream == NULL && file->idx == NULL &&
+            __atomic_load_n(&use_passthrough, __ATOMIC_RELAXED) &&
+            pin_file(file) == 0) {
+                /* The kernel holds on to the file, not the descriptor */
+                ret = -1;
+                if (!is_remote_fd(file->fd)) {
+                        ret = fuse_passthrough_open(req, file->fd);
+                }
+                unpin_file(file);
+                if (ret > 0) {
+                        file->backing_id = ret;
+                        fi->backing_id = ret;
+                        fi->keep_cache = 0;
+                } else if (ret == 0) {
+                        LOG_INFO("PASSTHROUGH not available, reads of plain "
+                            "files go through the daemon\n");
+                        __atomic_store_n(&use_passthrough, 0,
+                                         __ATOMIC_RELAXED);
+                }
+        }
+#endif
+
+        fi->fh = (uint64_t)file;
+        fuse_reply_open(req, fi);
+        count_op(OP_OPEN, start);
+}
+
+static void fuse_bgzip_release(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *fi)
+{
+        struct file *file = (struct file *)fi->fh;
+
+        LOG("RELEASE [%s]\n", get_inode(ino)->path);
+
+        if (is_ctl_inode(get_inode(ino))) {
+                struct ctl_file *sf = (void *)fi->fh;
+
+                free(sf->buf);
+                free(sf);
+                fuse_reply_err(req, 0);
+                return;
+        }
+
+#ifdef FUSE_CAP_PASSTHROUGH
+        if (file->backing_id) {
+                fuse_passthrough_close(req, file->backing_id);
+        }
+#endif
+        /* Nobody is going to read what has not been prefetched yet */
+        __atomic_add_fetch(&file->ra_gen, 1, __ATOMIC_RELAXED);
+        put_file(file);
+        fuse_reply_err(req, 0);
+}
+
+/* Pin path, a file that is shown uncompressed, in the block cache. value
+ * is "1" for the whole file, "<start>-<end>" for the blocks that hold
+ * that range of uncompressed bytes, or "0", or NULL, to unpin it. A new
+ * pin replaces the old one. Returns 0 or -errno.
  */
-static int need_bgzip_uncompress(const char *file) {
-        char stripped[PATH_MAX];
-        char tmp[PATH_MAX];
+static int set_pin(const char *path, const char *value, size_t size)
+{
+        uint64_t start = 0, end = UINT64_MAX, cstart = 0, cend = UINT64_MAX;
+        struct pin *pin = NULL, *old = NULL, *next, **pp;
+        const struct format *fmt;
+        struct bgzf_index *idx;
+        char tmp[PATH_MAX], buf[64];
+        struct file_id id;
         struct stat st;
-        TDB_DATA key, data;
-        uint8_t ret = 1;
+        char *p;
+        int e;
 
-        LOG("NEED_BGZIP_UNCOMPRESS [%s]\n", file);
-        key.dptr = discard_const(file);
-        key.dsize = strlen(file);
-        data = tdb_fetch(nu_tdb, key);
-        if (data.dptr) {
-                uint8_t val = data.dptr[0];
-                free(data.dptr);
-                return val;
+        if (value) {
+                if (size == 0 || size >= sizeof(buf)) {
+                        return -EINVAL;
+                }
+                memcpy(buf, value, size);
+                buf[size] = 0;
+                if (!strcmp(buf, "0")) {
+                        value = NULL;
+                } else if (strcmp(buf, "1")) {
+                        errno = 0;
+                        start = strtoull(buf, &p, 10);
+                        if (p == buf || *p++ != '-') {
+                                return -EINVAL;
+                        }
+                        end = strtoull(p, &p, 10);
+                        if (errno || *p || start >= end) {
+                                return -EINVAL;
+                        }
+                }
+        }
+        if (need_bgzip_uncompress(path) != 1) {
+                return -ENOTSUP;
         }
+        fmt = stat_compressed(path, &st);
+        if (fmt == NULL) {
+                return -errno;
+        }
+        set_file_id(&id, &st);
 
-        LOG("NEED_BGZIP_UNCOMPRESS SLOW PATH [%s]\n", file);
-        snprintf(stripped, PATH_MAX,"%s", file);
-        if (strlen(stripped) > 4 &&
-            !strcmp(stripped + strlen(stripped) - 4, ".gzi")) {
-                stripped[strlen(stripped) - 4] = 0;
+        if (value && end != UINT64_MAX) {
+                /* Only a file with an index of its own, not one built */
+                snprintf(tmp, PATH_MAX, "%s%s", path,
+                         fmt->index_suffix ? fmt->index_suffix :
+                         fmt->suffix);
+                idx = get_index(tmp);
+                if (idx == NULL) {
+                        return -ENOTSUP;
+                }
+                e = find_index_entry(idx, start);
+                cstart = index_entry(idx, e).caddr;
+                e = find_index_entry(idx, end - 1) + 1;
+                if (e < idx->noffs) {
+                        cend = index_entry(idx, e).caddr;
+                }
+                put_index(idx);
         }
-        if (strlen(stripped) > 3 &&
-            !strcmp(stripped + strlen(stripped) - 3, ".gz")) {
-                stripped[strlen(stripped) - 3] = 0;
+        if (value) {
+                pin = malloc(sizeof(*pin) + strlen(path) + 1);
+                if (pin == NULL) {
+                        return -ENOMEM;
+                }
+                pin->id = id;
+                pin->start = start;
+                pin->end = end;
+                pin->cstart = cstart;
+                pin->cend = cend;
+                strcpy(pin->path, path);
         }
 
-        if (fstatat(dir_fd, stripped, &st, AT_NO_AUTOMOUNT) == 0) {
-                ret = 0;
-                goto finished;
+        pthread_mutex_lock(&pin_mutex);
+        for (pp = &pins; *pp; ) {
+                if (strcmp((*pp)->path, path)) {
+                        pp = &(*pp)->next;
+                        continue;
+                }
+                next = (*pp)->next;
+                (*pp)->next = old;
+                old = *pp;
+                *pp = next;
+                __atomic_store_n(&num_pins, num_pins - 1, __ATOMIC_RELAXED);
         }
-        snprintf(tmp, PATH_MAX, "%s.gz", stripped);
-        if (fstatat(dir_fd, tmp, &st, AT_NO_AUTOMOUNT) != 0) {
-                ret = 0;
-                goto finished;
+        if (pin) {
+                pin->next = pins;
+                pins = pin;
+                __atomic_store_n(&num_pins, num_pins + 1, __ATOMIC_RELAXED);
         }
-        snprintf(tmp, PATH_MAX, "%s.gz.gzi", stripped);
-        if (fstatat(dir_fd, tmp, &st, AT_NO_AUTOMOUNT) != 0) {
-                ret = 0;
-                goto finished;
+        pthread_mutex_unlock(&pin_mutex);
+
+        /* The blocks already in the cache, the rest as they are read */
+        for (; old; old = next) {
+                next = old->next;
+                block_cache_pin_range(&old->id, old->cstart, old->cend, 0);
+                free(old);
         }
+        if (value) {
+                block_cache_pin_range(&id, cstart, cend, 1);
+        }
+        LOG_INFO("PIN [%s] %s\n", path, value ? buf : "0");
+        return 0;
+}
 
-finished:
-        data.dptr = &ret;
-        data.dsize = 1;
-        tdb_store(nu_tdb, key, data, TDB_REPLACE);
-        return ret;
+#define PIN_XATTR "user.fuse-bgzip.pin"
+
+static void fuse_bgzip_setxattr(fuse_req_t req, fuse_ino_t ino,
+                                const char *name, const char *value,
+                                size_t size, int flags)
+{
+        struct inode *inode = get_inode(ino);
+        int ret = -ENOTSUP;
+
+        (void)flags;
+        if (!is_ctl_inode(inode) && inode != root_inode &&
+            !strcmp(name, PIN_XATTR)) {
+                ret = set_pin(inode->path, value, size);
+        }
+        fuse_reply_err(req, -ret);
 }
 
-/* From bgzf.c */
-typedef struct
+static void fuse_bgzip_removexattr(fuse_req_t req, fuse_ino_t ino,
+                                   const char *name)
 {
-    uint64_t uaddr;  // offset w.r.t. uncompressed data
-    uint64_t caddr;  // offset w.r.t. compressed data
+        struct inode *inode = get_inode(ino);
+        int ret = -ENOTSUP;
+
+        if (!is_ctl_inode(inode) && inode != root_inode &&
+            !strcmp(name, PIN_XATTR)) {
+                ret = set_pin(inode->path, NULL, 0);
+        }
+        fuse_reply_err(req, -ret);
+}
+
+static void fuse_bgzip_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+        struct statvfs st;
+
+        if (fstatvfs(dir_fd, &st) == -1) {
+                fuse_reply_err(req, errno);
+                return;
+        }
+        fuse_reply_statfs(req, &st);
+}
+
+/* max_readahead for the kernel, 0 to leave it at what the kernel offers */
+static unsigned kernel_readahead;
+
+/* Threads must be started here and not in main() since the session is
+ * only run once we have daemonized.
+ */
+static void fuse_bgzip_init(void *userdata, struct fuse_conn_info *conn)
+{
+        /* Let libfuse splice passthrough reads into the fuse device */
+        if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+                conn->want |= FUSE_CAP_SPLICE_WRITE;
+        }
+#ifdef FUSE_CAP_PASSTHROUGH
+        if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+                conn->want |= FUSE_CAP_PASSTHROUGH;
+        } else {
+                use_passthrough = 0;
+        }
+#endif
+        if (kernel_readahead && kernel_readahead < conn->max_readahead) {
+                conn->max_readahead = kernel_readahead;
+        }
+
+        start_log_writer();
+        start_inflate_workers();
+        start_size_writer();
+        start_disk_writer();
+        start_change_watcher();
+        start_index_builder();
+        start_prewarm();
 }
-bgzidx1_t;
 
-struct __bgzidx_t
+static void fuse_bgzip_destroy(void *userdata)
 {
-    int noffs, moffs;       // the size of the index, n:used, m:allocated
-    bgzidx1_t *offs;        // offsets
-    uint64_t ublock_addr;   // offset of the current block (uncompressed data)
+        struct size_update *list;
+
+        flush_log();
+        flush_disk_writes();
+        if (filesize_tdb == NULL) {
+                return;
+        }
+        pthread_mutex_lock(&size_update_mutex);
+        list = size_updates;
+        size_updates = NULL;
+        size_writer_running = 0;
+        pthread_mutex_unlock(&size_update_mutex);
+        flush_size_updates(list);
+}
+
+static struct fuse_lowlevel_ops bgzip_oper = {
+        .init           = fuse_bgzip_init,
+        .destroy        = fuse_bgzip_destroy,
+        .lookup         = fuse_bgzip_lookup,
+        .forget         = fuse_bgzip_forget,
+        .forget_multi   = fuse_bgzip_forget_multi,
+        .getattr        = fuse_bgzip_getattr,
+        .open           = fuse_bgzip_open,
+        .release        = fuse_bgzip_release,
+        .read           = fuse_bgzip_read,
+        .opendir        = fuse_bgzip_opendir,
+        .readdir        = fuse_bgzip_readdir,
+        .readdirplus    = fuse_bgzip_readdirplus,
+        .releasedir     = fuse_bgzip_releasedir,
+        .statfs         = fuse_bgzip_statfs,
+        .setxattr       = fuse_bgzip_setxattr,
+        .removexattr    = fuse_bgzip_removexattr,
 };
 
-static uint64_t load_index_file(BGZF *fh, const char *path)
+/* Benchmarks.
+ * --bench-corpus writes a synthetic set of BGZF files with their .gzi
+ * indexes into the -m directory. --bench=fuse then runs the workloads
+ * through the kernel against a mount of that directory, and
+ * --bench=direct runs them in process by calling the read path directly,
+ * which tells the cost of decompression apart from the FUSE round trips.
+ */
+enum {BENCH_NONE, BENCH_FUSE, BENCH_DIRECT};
+
+static int bench_mode;
+static int bench_corpus;
+static int64_t bench_size = 256 * 1024 * 1024;
+static int bench_files = 2000;
+static int bench_threads = 16;
+
+#define BENCH_DIR "many"
+
+static const char *bench_large_files[] = {"text-large", "random-large"};
+#define NUM_BENCH_LARGE 2
+
+static uint64_t bench_rand(uint64_t *state)
 {
-        int fd;
-        hFILE *idx;
-
-        /* The index file consists of
-         * +------------------------------+
-         * |            count             | 8 bytes
-         * +------------------------------+
-         * followed by count + 1 blocks of
-         * +------------------------------+
-         * |      compressed offset       | 8 bytes
-         * +------------------------------+
-         * |      uncompressed offset     | 8 bytes
-         * +------------------------------+
-         * So just reading the last 8 bytes id the index file will
-         * give us a good (and valid) starting offset for finding the EOF and
-         * uncompressed file size.
-         *
-         * The HTSLIB implemnetation of index file always uses native
-         * byteorder.
-         */
+        uint64_t x = *state;
 
-        LOG("LOAD_INDEX_FILE [%s]\n", path);
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        *state = x;
+        return x * 0x2545f4914f6cdd1dULL;
+}
 
-        fd = openat(dir_fd, path, O_RDONLY);
-        if (fd == -1) {
-                return 0;
+/* Something that compresses about as well as a text file does */
+static void bench_fill_text(unsigned char *buf, size_t len, uint64_t *rng)
+{
+        static const char *words[] = {
+                "chr1", "chr2", "chrX", "read", "pair", "ACGT", "TTAG",
+                "GATTACA", "quality", "mapped", "the", "of", "and", "to",
+                "sample", "depth", "\t", "\n", "0", "60",
+        };
+        size_t pos = 0, n;
+        uint64_t r;
+        char num[24];
+
+        while (pos < len) {
+                r = bench_rand(rng);
+                if (r % 4 == 0) {
+                        n = snprintf(num, sizeof(num), "%" PRIu64 " ",
+                                     (r >> 8) % 100000);
+                        n = n > len - pos ? len - pos : n;
+                        memcpy(buf + pos, num, n);
+                } else {
+                        const char *w = words[(r >> 8) % (sizeof(words) /
+                                                          sizeof(words[0]))];
+
+                        n = strlen(w);
+                        n = n > len - pos ? len - pos : n;
+                        memcpy(buf + pos, w, n);
+                }
+                pos += n;
         }
+}
 
-        idx = hdopen(fd, "r");
-        if (idx == NULL) {
-                LOG("Failed to hdopen index file\n");
+static void bench_fill_random(unsigned char *buf, size_t len, uint64_t *rng)
+{
+        uint64_t r;
+        size_t i;
+
+        for (i = 0; i < len; i += 8) {
+                r = bench_rand(rng);
+                memcpy(buf + i, &r, len - i < 8 ? len - i : 8);
+        }
+}
+
+/* Compress len bytes into one BGZF block in out. Returns the size of the
+ * block, or 0 if it did not fit.
+ */
+static size_t bgzf_compress_block(z_stream *zs, const unsigned char *in,
+                                  size_t len, unsigned char *out)
+{
+        static const unsigned char header[BGZF_HEADER_SIZE] = {
+                0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+                0, 0,
+        };
+        uint32_t crc = crc32(0, in, len);
+        size_t bsize;
+
+        deflateReset(zs);
+        zs->next_in = (unsigned char *)in;
+        zs->avail_in = len;
+        zs->next_out = out + BGZF_HEADER_SIZE;
+        zs->avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE -
+                BGZF_FOOTER_SIZE;
+        if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
                 return 0;
         }
-        bgzf_index_load_hfile(fh, idx, "");
-        hclose(idx);
+        bsize = BGZF_MAX_BLOCK_SIZE - zs->avail_out;
 
-        LOG("LOAD_INDEX_FILE finished [%s]\n", path);
-        return fh->idx->offs[fh->idx->noffs - 1].uaddr;
+        memcpy(out, header, BGZF_HEADER_SIZE);
+        out[16] = (bsize - 1) & 0xff;
+        out[17] = (bsize - 1) >> 8;
+        out += bsize - BGZF_FOOTER_SIZE;
+        out[0] = crc;
+        out[1] = crc >> 8;
+        out[2] = crc >> 16;
+        out[3] = crc >> 24;
+        out[4] = len;
+        out[5] = len >> 8;
+        out[6] = len >> 16;
+        out[7] = len >> 24;
+        return bsize;
 }
 
-/* returns the size of the uncompressed file, or 0 if it could not be
- * determined.
+/* Write name.gz and name.gz.gzi with size bytes of generated data, the
+ * same as bgzip -i would.
  */
-static void get_unzipped_size(const char *path, struct stat *stbuf)
+static int write_bench_file(const char *name, int64_t size, int random,
+                            uint64_t seed)
 {
-        TDB_DATA key, data;
-        char file[PATH_MAX+16];
-        char gzfile[PATH_MAX];
-        BGZF *fh;
-        char index_file[PATH_MAX];
+        unsigned char in[BGZF_BLOCK_DATA], out[BGZF_MAX_BLOCK_SIZE];
+        uint64_t caddr = 0, uaddr = 0, count = 0, max = 0;
+        uint64_t *offs = NULL, *tmp;
+        char path[PATH_MAX];
+        z_stream zs = {0};
+        FILE *gz, *gzi;
+        size_t len, bsize;
+        uint64_t le;
+        int fd, ret = -1;
+
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+                return -1;
+        }
+        snprintf(path, PATH_MAX, "%s.gz", name);
+        fd = openat(dir_fd, path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd == -1 || (gz = fdopen(fd, "w")) == NULL) {
+                fprintf(stderr, "Failed to create %s %s\n", path,
+                        strerror(errno));
+                deflateEnd(&zs);
+                return -1;
+        }
+
+        while (uaddr < (uint64_t)size) {
+                len = size - uaddr < BGZF_BLOCK_DATA ?
+                        size - uaddr : BGZF_BLOCK_DATA;
+                if (random) {
+                        bench_fill_random(in, len, &seed);
+                } else {
+                        bench_fill_text(in, len, &seed);
+                }
+                if (uaddr) {
+                        if (count == max) {
+                                max = max ? max * 2 : 1024;
+                                tmp = realloc(offs, max * 2 *
+                                              sizeof(uint64_t));
+                                if (tmp == NULL) {
+                                        goto out;
+                                }
+                                offs = tmp;
+                        }
+                        offs[count * 2] = htole64(caddr);
+                        offs[count * 2 + 1] = htole64(uaddr);
+                        count++;
+                }
+                bsize = bgzf_compress_block(&zs, in, len, out);
+                if (bsize == 0 || fwrite(out, bsize, 1, gz) != 1) {
+                        goto out;
+                }
+                caddr += bsize;
+                uaddr += len;
+        }
+        if (fwrite(bgzf_eof_block, sizeof(bgzf_eof_block), 1, gz) != 1) {
+                goto out;
+        }
+
+        snprintf(path, PATH_MAX, "%s.gz.gzi", name);
+        fd = openat(dir_fd, path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd == -1 || (gzi = fdopen(fd, "w")) == NULL) {
+                goto out;
+        }
+        le = htole64(count);
+        if (fwrite(&le, sizeof(le), 1, gzi) != 1 ||
+            (count && fwrite(offs, 2 * sizeof(uint64_t), count, gzi) !=
+             count)) {
+                fclose(gzi);
+                goto out;
+        }
+        if (fclose(gzi) == 0) {
+                ret = 0;
+        }
+out:
+        if (fclose(gz) != 0) {
+                ret = -1;
+        }
+        if (ret) {
+                fprintf(stderr, "Failed to write %s\n", name);
+        }
+        free(offs);
+        deflateEnd(&zs);
+        return ret;
+}
+
+static int write_bench_corpus(void)
+{
+        char name[PATH_MAX];
+        int i;
+
+        printf("Writing %s/%s.gz\n", mountpoint, bench_large_files[0]);
+        if (write_bench_file(bench_large_files[0], bench_size, 0, 1)) {
+                return -1;
+        }
+        printf("Writing %s/%s.gz\n", mountpoint, bench_large_files[1]);
+        if (write_bench_file(bench_large_files[1], bench_size / 4, 1, 2)) {
+                return -1;
+        }
+        printf("Writing %d files in %s/%s\n", bench_files, mountpoint,
+               BENCH_DIR);
+        if (mkdirat(dir_fd, BENCH_DIR, 0755) == -1 && errno != EEXIST) {
+                fprintf(stderr, "Failed to create %s %s\n", BENCH_DIR,
+                        strerror(errno));
+                return -1;
+        }
+        for (i = 0; i < bench_files; i++) {
+                snprintf(name, PATH_MAX, BENCH_DIR "/f%05d", i);
+                if (write_bench_file(name, 16 * 1024 + i % 4096 * 16, 0,
+                                     i + 3)) {
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+/* A file opened by the benchmark, through the mount or in process */
+struct bench_file {
         int fd;
-        off_t pos;
-        uint64_t start_pos;
-        char buf[4096];
-        const char *ptr;
+        struct inode *inode;
+        struct file *file;
+};
 
-        LOG("GET_UNZIPPED_SIZE [%s]\n", path);
+static int bench_open(const char *path, struct bench_file *bf)
+{
+        struct fuse_file_info fi = {0};
+        int ret;
 
-        ptr = strrchr(path, '/');
-        if (ptr == NULL) {
-                ptr = path;
+        if (bench_mode == BENCH_FUSE) {
+                bf->fd = openat(dir_fd, path, O_RDONLY);
+                return bf->fd == -1 ? -errno : 0;
+        }
+        bf->inode = new_inode(path);
+        if (bf->inode == NULL) {
+                return -ENOMEM;
+        }
+        bf->inode->bgzip = -1;
+        ret = open_file(bf->inode, &fi, &bf->file);
+        if (ret) {
+                free(bf->inode);
+        }
+        return ret;
+}
+
+static ssize_t bench_read(struct bench_file *bf, char *buf, size_t size,
+                          off_t offset)
+{
+        ssize_t count;
+
+        if (bench_mode == BENCH_FUSE) {
+                count = pread(bf->fd, buf, size, offset);
+                return count == -1 ? -errno : count;
+        }
+        return read_file(bf->file, buf, size, offset);
+}
+
+static void bench_close(struct bench_file *bf)
+{
+        if (bench_mode == BENCH_FUSE) {
+                close(bf->fd);
+                return;
+        }
+        put_file(bf->file);
+        free(bf->inode);
+}
+
+static int bench_stat(const char *path, struct stat *st)
+{
+        int ret;
+
+        if (bench_mode == BENCH_FUSE) {
+                return fstatat(dir_fd, path, st, 0) == -1 ? -errno : 0;
         }
-        snprintf(file, sizeof(file), "%s_%zd", ptr, stbuf->st_size);
+        ret = stat_path(path, -1, st);
+        return ret < 0 ? ret : 0;
+}
+
+/* Make the next pass over the large files start cold. Through the mount
+ * this can only drop the page cache of the kernel, the block cache of
+ * the daemon stays warm unless it is restarted.
+ */
+static void bench_drop_caches(void)
+{
+        char path[PATH_MAX];
+        struct stat st;
+        int i, fd;
 
-        key.dptr = discard_const(file);
-        key.dsize = strlen(file);
-        data = tdb_fetch(filesize_tdb, key);
-        if (data.dptr) {
-                stbuf->st_size = *(off_t *)data.dptr;
-                free(data.dptr);
-                return;
+        for (i = 0; i < NUM_BENCH_LARGE; i++) {
+                if (bench_mode == BENCH_DIRECT) {
+                        snprintf(path, PATH_MAX, "%s.gz",
+                                 bench_large_files[i]);
+                        if (fstatat(dir_fd, path, &st, 0) == 0) {
+                                block_cache_purge(st.st_dev, st.st_ino);
+                        }
+                        snprintf(path, PATH_MAX, "%s.gz.gzi",
+                                 bench_large_files[i]);
+                        index_cache_drop(path);
+                        snprintf(path, PATH_MAX, "%s.gz",
+                                 bench_large_files[i]);
+                } else {
+                        snprintf(path, PATH_MAX, "%s", bench_large_files[i]);
+                }
+                fd = openat(dir_fd, path, O_RDONLY);
+                if (fd != -1) {
+                        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                        close(fd);
+                }
         }
+}
 
-        LOG("GET_UNZIPPED_SIZE SLOW PATH [%s]\n", path);
+/* Latencies and totals of one thread running a workload */
+struct bench_thread {
+        int idx;
+        uint64_t ops, bytes, errors;
+        uint64_t *lat;
+        size_t nlat, maxlat;
+        void (*fn)(struct bench_thread *t);
+};
 
-        snprintf(gzfile, PATH_MAX, "%s.gz", path);
-        fd = openat(dir_fd, gzfile, O_RDONLY);
-        if (fd == -1) {
-                return;
-        } 
+static void bench_record(struct bench_thread *t, uint64_t start,
+                         ssize_t bytes)
+{
+        uint64_t *lat;
 
-        fh = bgzf_dopen(fd, "ru");
-        if (fh == NULL) {
-                close(fd);
+        if (bytes < 0) {
+                t->errors++;
                 return;
         }
-        snprintf(index_file, PATH_MAX, "%s.gz.gzi", path);
-        start_pos = load_index_file(fh, index_file);
-
-        /* Seek to the start of the final gzip block */
-        bgzf_useek(fh, start_pos, SEEK_SET);
-        pos = start_pos;
-
-        /* And start scanning for EOF */
-        while (1) {
-                ssize_t count;
-
-                count = bgzf_read(fh, buf, sizeof(buf));
-                if (count < 0) {
-                        bgzf_close(fh);
-                        return;
-                }
-                if (count == 0) {
-                        break;
+        if (t->nlat == t->maxlat) {
+                t->maxlat = t->maxlat ? t->maxlat * 2 : 4096;
+                lat = realloc(t->lat, t->maxlat * sizeof(uint64_t));
+                if (lat == NULL) {
+                        fprintf(stderr, "Failed to allocate latencies\n");
+                        exit(1);
                 }
-                pos += count;
+                t->lat = lat;
         }
-        bgzf_close(fh);
+        t->lat[t->nlat++] = now_ns() - start;
+        t->ops++;
+        t->bytes += bytes;
+}
 
-        /* Write the size to cache */
-        stbuf->st_size = pos;
+static int compare_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return x < y ? -1 : x > y;
+}
 
-        LOG("GET_UNZIPPED_SIZE [%s] %zu\n", path, stbuf->st_size);
+static void *bench_thread_main(void *arg)
+{
+        struct bench_thread *t = arg;
 
-        data.dptr = (uint8_t *)&(stbuf->st_size);
-        data.dsize = sizeof(stbuf->st_size);
-        tdb_store(filesize_tdb, key, data, TDB_REPLACE);
+        t->fn(t);
+        return NULL;
 }
 
-static int fuse_bgzip_getattr(const char *path, struct stat *stbuf)
+static double cpu_seconds(void)
 {
-        int ret;
+        struct rusage ru;
 
-        if (path[0] == '/') {
-                path++;
-        }
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+                (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
 
-        ret = fstatat(dir_fd, path, stbuf, AT_NO_AUTOMOUNT|AT_EMPTY_PATH);
-        if (ret && errno == ENOENT) {
-                if (need_bgzip_uncompress(path)) {
-                        char tmp[PATH_MAX];
-                        int fd;
+/* Run fn in nthreads threads and print a line of results */
+static void run_workload(const char *name, int nthreads,
+                         void (*fn)(struct bench_thread *t))
+{
+        struct bench_thread *threads;
+        pthread_t *tids;
+        uint64_t start, ops = 0, bytes = 0, errors = 0, *lat;
+        size_t nlat = 0;
+        double wall, cpu;
+        int i;
 
-                        snprintf(tmp, PATH_MAX, "%s.gz", path);
-                        ret = fstatat(dir_fd, tmp, stbuf, AT_NO_AUTOMOUNT);
-                        if (ret) {
-                                LOG("GETATTR [%s] %s\n", path, strerror(errno));
-                                return -errno;
-                        }
+        threads = calloc(nthreads, sizeof(*threads));
+        tids = calloc(nthreads, sizeof(*tids));
+        if (threads == NULL || tids == NULL) {
+                fprintf(stderr, "Failed to allocate threads\n");
+                exit(1);
+        }
 
-                        get_unzipped_size(path, stbuf);
-                        LOG("GETATTR [%s] SUCCESS\n", path);
-                        return 0;
+        cpu = cpu_seconds();
+        start = now_ns();
+        for (i = 0; i < nthreads; i++) {
+                threads[i].idx = i;
+                threads[i].fn = fn;
+                if (nthreads == 1) {
+                        fn(&threads[i]);
+                } else if (pthread_create(&tids[i], NULL, bench_thread_main,
+                                          &threads[i])) {
+                        fprintf(stderr, "Failed to start thread\n");
+                        exit(1);
                 }
         }
-        if (ret) {
-                LOG("GETATTR [%s] SUCCESS\n", path);
-                return -errno;
+        for (i = 0; nthreads > 1 && i < nthreads; i++) {
+                pthread_join(tids[i], NULL);
         }
-        LOG("GETATTR [%s] SUCCESS\n", path);
-        return 0;
+        wall = (now_ns() - start) / 1e9;
+        cpu = cpu_seconds() - cpu;
+
+        for (i = 0; i < nthreads; i++) {
+                ops += threads[i].ops;
+                bytes += threads[i].bytes;
+                errors += threads[i].errors;
+                nlat += threads[i].nlat;
+        }
+        lat = malloc((nlat ? nlat : 1) * sizeof(uint64_t));
+        if (lat == NULL) {
+                fprintf(stderr, "Failed to allocate latencies\n");
+                exit(1);
+        }
+        for (nlat = 0, i = 0; i < nthreads; i++) {
+                if (threads[i].nlat == 0) {
+                        continue;
+                }
+                memcpy(lat + nlat, threads[i].lat,
+                       threads[i].nlat * sizeof(uint64_t));
+                nlat += threads[i].nlat;
+                free(threads[i].lat);
+        }
+        qsort(lat, nlat, sizeof(uint64_t), compare_u64);
+
+        printf("%-18s %9" PRIu64 " %9.1f %9.1f %9.1f %9.2f %6" PRIu64 "\n",
+               name, ops, wall > 0 ? bytes / wall / 1e6 : 0.0,
+               nlat ? lat[nlat / 2] / 1e3 : 0.0,
+               nlat ? lat[nlat * 99 / 100] / 1e3 : 0.0,
+               bytes ? cpu / (bytes / 1e9) : 0.0, errors);
+        fflush(stdout);
+
+        free(lat);
+        free(threads);
+        free(tids);
 }
 
-static int fuse_bgzip_read(const char *path, char *buf, size_t size,
-                           off_t offset, struct fuse_file_info *ffi)
+static void bench_sequential(struct bench_thread *t)
 {
-        struct file *file;
-        int fd;
-        int ret;
-        
-        if (path[0] == '/') {
-                path++;
-        }
+        size_t size = 128 * 1024;
+        struct bench_file bf;
+        uint64_t start;
+        char *buf;
+        ssize_t count;
+        off_t offset;
+        int i;
 
-        file = (void *)ffi->fh;
-        if (file->fh) {                
-                ret = bgzf_useek(file->fh, offset, SEEK_SET);
-                if (ret == -1) {
-                        LOG("READ useek:%p [%s] %jd:%zu %s\n", file->fh, path, offset, size, strerror(errno));
-                        return -errno;
+        buf = malloc(size);
+        for (i = 0; buf && i < NUM_BENCH_LARGE; i++) {
+                if (bench_open(bench_large_files[i], &bf)) {
+                        t->errors++;
+                        continue;
                 }
-                
-                ret = bgzf_read(file->fh, buf, size);
-                if (ret == -1) {
-                        LOG("READ read [%s] %jd:%zu %s\n", path, offset, size, strerror(errno));
-                        return -errno;
+                for (offset = 0;; offset += count) {
+                        start = now_ns();
+                        count = bench_read(&bf, buf, size, offset);
+                        if (count <= 0) {
+                                if (count < 0) {
+                                        t->errors++;
+                                }
+                                break;
+                        }
+                        bench_record(t, start, count);
                 }
-                LOG("READ [%s] %jd:%zu %d\n", path, offset, size, ret);
-                return ret;
+                bench_close(&bf);
         }
-        
-        /* Passthrough to underlying filesystem */
-        ret = pread(file->fd, buf, size, offset);
-        return (ret == -1) ? -errno : ret;
+        free(buf);
 }
 
-static int fuse_bgzip_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                            off_t offset, struct fuse_file_info *fi)
+/* Random reads of size bytes anywhere in the compressible large file */
+static void bench_random(struct bench_thread *t, size_t size, int num)
 {
-        DIR *dir;
-        struct dirent *ent;
-        int fd;
+        uint64_t rng = 0x9e3779b97f4a7c15ULL * (t->idx + 1), start;
+        struct bench_file bf;
+        struct stat st;
+        off_t offset;
+        char *buf;
+        int i;
 
-        if (path[0] == '/') {
-                path++;
+        if (bench_stat(bench_large_files[0], &st) ||
+            st.st_size <= (off_t)size ||
+            bench_open(bench_large_files[0], &bf)) {
+                t->errors++;
+                return;
         }
-        if (path[0] == '\0') {
-                path = ".";
+        buf = malloc(size);
+        for (i = 0; buf && i < num; i++) {
+                offset = bench_rand(&rng) % (st.st_size - size);
+                start = now_ns();
+                bench_record(t, start, bench_read(&bf, buf, size, offset));
         }
+        free(buf);
+        bench_close(&bf);
+}
 
-        LOG("READDIR [%s]\n", path);
+static void bench_random_4k(struct bench_thread *t)
+{
+        bench_random(t, 4096, 20000);
+}
 
-        fd = openat(dir_fd, path, O_DIRECTORY);
-        dir = fdopendir(fd);
-        if (dir == NULL) {
-                return -errno;
-        }
-        while ((ent = readdir(dir)) != NULL) {
-                struct ecm *e = NULL;
-                char full_path[PATH_MAX];
+static void bench_random_64k(struct bench_thread *t)
+{
+        bench_random(t, 65536, 5000);
+}
 
-                if (strcmp(path, ".")) {
-                        snprintf(full_path, PATH_MAX, "%s/%s",
-                                 path, ent->d_name);
-                } else {
-                        strcpy(full_path, ent->d_name);
-                }
+static void bench_threads_one_file(struct bench_thread *t)
+{
+        bench_random(t, 65536, 2000);
+}
 
-                if (need_bgzip_uncompress(full_path)) {
-                        char tmp[PATH_MAX];
+/* Open, read the start of and close every small file */
+static void bench_files_one_thread(struct bench_thread *t)
+{
+        char path[PATH_MAX], buf[16384];
+        struct bench_file bf;
+        uint64_t start;
+        int i;
 
-                        snprintf(tmp, PATH_MAX, "%s", ent->d_name);
-                        if (strlen(tmp) > 7 &&
-                            !strcmp(tmp + strlen(tmp) - 7, ".gz.gzi")) {
-                                tmp[strlen(tmp) - 7] = 0;
-                                filler(buf, tmp, NULL, 0);
-                        }
+        for (i = 0; i < bench_files; i++) {
+                snprintf(path, PATH_MAX, BENCH_DIR "/f%05d", i);
+                start = now_ns();
+                if (bench_open(path, &bf)) {
+                        t->errors++;
                         continue;
                 }
-
-                filler(buf, ent->d_name, NULL, 0);
+                bench_record(t, start,
+                             bench_read(&bf, buf, sizeof(buf), 0));
+                bench_close(&bf);
         }
-        closedir(dir);
-        return 0;
 }
 
-static int fuse_bgzip_open(const char *path, struct fuse_file_info *ffi)
+/* List the directory of small files and stat every entry, like ls -l */
+static void bench_list_dir(struct bench_thread *t)
 {
+        struct dir_listing *listing;
+        char path[PATH_MAX];
+        struct inode *inode;
+        struct dirent *de;
         struct stat st;
-        int ret;
-        struct file *file = malloc(sizeof(struct file));
-
-        LOG("OPEN [%s]\n", path);
-
-        file->fh = NULL;
-        file->fd = -1;
+        uint64_t start;
+        DIR *dir;
+        int fd, i;
 
-        if (path[0] == '/') {
-                path++;
+        start = now_ns();
+        if (bench_mode == BENCH_FUSE) {
+                fd = openat(dir_fd, BENCH_DIR, O_DIRECTORY);
+                if (fd == -1 || (dir = fdopendir(fd)) == NULL) {
+                        t->errors++;
+                        return;
+                }
+                while ((de = readdir(dir)) != NULL) {
+                        if (fstatat(fd, de->d_name, &st,
+                                    AT_SYMLINK_NOFOLLOW) == -1) {
+                                t->errors++;
+                        }
+                }
+                closedir(dir);
+                bench_record(t, start, 0);
+                return;
         }
 
-        ret = fstatat(dir_fd, path, &st, AT_NO_AUTOMOUNT);
-        if (ret && errno == ENOENT) {
-                if (need_bgzip_uncompress(path)) {
-                        char tmp[PATH_MAX];
-                        int fd;
+        inode = new_inode(BENCH_DIR);
+        if (inode == NULL || open_listing(inode, &listing)) {
+                t->errors++;
+                free(inode);
+                return;
+        }
+        for (i = 0; i < listing->num; i++) {
+                if (child_path(inode, listing->ents[i].name, path) ||
+                    stat_path(path, listing->ents[i].need_uncompress,
+                              &st) < 0) {
+                        t->errors++;
+                }
+        }
+        free_listing(listing);
+        free(listing);
+        free(inode);
+        bench_record(t, start, 0);
+}
 
-                        snprintf(tmp, PATH_MAX, "%s.gz", path);
-                        fd = openat(dir_fd, tmp, O_RDONLY);
-                        if (fd == -1) {
-                                free(file);
-                                LOG("OPEN BGZF openat [%s] ENOENT\n", path);
-                                return -ENOENT;
-                        }
+static void bench_ls_l(struct bench_thread *t)
+{
+        int i;
 
-                        file->fh = bgzf_dopen(fd, "ru");
-                        if (file->fh == NULL) {
-                                close(fd);
-                                free(file);
-                                LOG("OPEN BGZF bgzf_open [%s] ENOENT\n", path);
-                                return -ENOENT;
-                        }
+        for (i = 0; i < 5; i++) {
+                bench_list_dir(t);
+        }
+}
 
-                        snprintf(tmp, PATH_MAX, "%s.gz.gzi", path);
-                        load_index_file(file->fh, tmp);
+/* Open and close every small file, four times over */
+static void bench_open_close(struct bench_thread *t)
+{
+        char path[PATH_MAX];
+        struct bench_file bf;
+        uint64_t start;
+        int i;
 
-                        ffi->fh = (uint64_t)file;
-                        return 0;
+        for (i = 0; i < bench_files * 4; i++) {
+                snprintf(path, PATH_MAX, BENCH_DIR "/f%05d", i % bench_files);
+                start = now_ns();
+                if (bench_open(path, &bf)) {
+                        t->errors++;
+                        continue;
                 }
+                bench_close(&bf);
+                bench_record(t, start, 0);
         }
+}
 
-        file->fd = openat(dir_fd, path, O_RDONLY);
-        if (file->fd == -1) {
-                free(file);
-                LOG("OPEN FD [%s] %s\n", path, strerror(errno));
-                return -errno;
+static int run_bench(void)
+{
+        if (bench_mode == BENCH_DIRECT) {
+                start_log_writer();
+                start_inflate_workers();
         }
-        ffi->fh = (uint64_t)file;
-        LOG("OPEN FD [%s] SUCCESS\n", path);
+        printf("%-18s %9s %9s %9s %9s %9s %6s\n", "workload", "ops", "MB/s",
+               "p50_us", "p99_us", "cpu_s/GB", "errors");
+
+        bench_drop_caches();
+        run_workload("seq_cold", 1, bench_sequential);
+        run_workload("seq_warm", 1, bench_sequential);
+        run_workload("random_4k", 1, bench_random_4k);
+        run_workload("random_64k", 1, bench_random_64k);
+        run_workload("threads_one_file", bench_threads,
+                     bench_threads_one_file);
+        run_workload("files_one_thread", 1, bench_files_one_thread);
+        run_workload("ls_l", 1, bench_ls_l);
+        run_workload("open_close", 1, bench_open_close);
+        flush_log();
         return 0;
 }
 
-static int fuse_bgzip_release(const char *path, struct fuse_file_info *ffi)
+static void print_usage(char *name)
 {
-        struct file *file = (struct file *)ffi->fh;
-        
-        if (path[0] == '/') {
-                path++;
-        }
+        printf("Usage: %s [-?|--help] [-a|--allow-other] "
+               "[-m|--mountpoint=mountpoint] "
+               "[-l|--logfile=logfile] [-f|--foreground] "
+               "[--block-cache=size] [--index-cache=size] "
+               "[--inflate-threads=n] [--readahead=blocks] "
+               "[--inflate=zlib|libdeflate|isal] [--no-size-db] "
+               "[--no-watch] [--entry-timeout=sec] [--attr-timeout=sec] "
+               "[--negative-timeout=sec] [--max-read=size] "
+               "[--max-readahead=size] [--max-threads=n] [--clone-fd] "
+               "[--log-level=error|info|debug] [--bench-corpus] "
+               "[--bench=fuse|direct] [--bench-size=size] "
+               "[--bench-files=n] [--bench-threads=n] [--build-index] "
+               "[--no-compact-index] [--io-engine=pread|uring] "
+               "[--remote=url] [--remote-listing=url] "
+               "[--disk-cache=size] [--disk-cache-dir=directory] "
+               "[--prewarm] [--max-open-files=n] [--inflate-cpus=list] "
+               "[--verify-crc] [--mmap]",
+               name);
+        exit(0);
+}
 
-        LOG("RELEASE [%s]\n", path);
+/* Parse a size such as 512M or 2G. Returns -1 if it is not valid. */
+static int64_t parse_size(const char *str)
+{
+        char *end;
+        int64_t size;
 
-        if (file == NULL) {
-                return 0;
+        errno = 0;
+        size = strtoll(str, &end, 10);
+        if (errno || end == str || size < 0) {
+                return -1;
         }
-        if (file->fh) {
-                bgzf_close(file->fh);
+        switch (*end) {
+        case 'k': case 'K':
+                size <<= 10;
+                end++;
+                break;
+        case 'm': case 'M':
+                size <<= 20;
+                end++;
+                break;
+        case 'g': case 'G':
+                size <<= 30;
+                end++;
+                break;
+        case 't': case 'T':
+                size <<= 40;
+                end++;
+                break;
         }
-        if (file->fd != -1) {
-                close(file->fd);
+        if (*end != '\0') {
+                return -1;
         }
-        free(file);
-
-        return 0;
+        return size;
 }
 
-static int fuse_bgzip_statfs(const char *path, struct statvfs* stbuf)
+/* Returns a -o<name>=<value> option for the fuse session, or exits if
+ * value is not a valid number.
+ */
+static char *fuse_option(const char *name, const char *value)
 {
-        return fstatvfs(dir_fd, stbuf);
+        int64_t size;
+        char *opt;
+
+        size = parse_size(value);
+        if (size <= 0 || size > INT32_MAX) {
+                fprintf(stderr, "Invalid %s %s\n", name, value);
+                exit(1);
+        }
+        if (asprintf(&opt, "-o%s=%" PRId64, name, size) == -1) {
+                exit(1);
+        }
+        return opt;
 }
 
+/* Parse a number of seconds, or exit if it is not valid */
+static double parse_seconds(const char *name, const char *value)
+{
+        char *end;
+        double secs;
 
-static struct fuse_operations bgzip_oper = {
-        .getattr        = fuse_bgzip_getattr,
-        .open           = fuse_bgzip_open,
-        .release        = fuse_bgzip_release,
-        .read           = fuse_bgzip_read,
-        .readdir        = fuse_bgzip_readdir,
-        .statfs         = fuse_bgzip_statfs,
-};
+        errno = 0;
+        secs = strtod(value, &end);
+        if (errno || end == value || *end || secs < 0) {
+                fprintf(stderr, "Invalid %s %s\n", name, value);
+                exit(1);
+        }
+        return secs;
+}
 
-static void print_usage(char *name)
+#define MAX_FUSE_ARGS 32
+
+static void add_fuse_arg(char **argv, int *argc, char *arg)
 {
-        printf("Usage: %s [-?|--help] [-a|--allow-other] "
-               "[-m|--mountpoint=mountpoint] "
-               "[-l|--logfile=logfile] [-f|--foreground]", name);
-        exit(0);
+        /* Leave room for fsname, subtype and the terminating NULL */
+        if (*argc >= MAX_FUSE_ARGS - 3) {
+                fprintf(stderr, "Too many options\n");
+                exit(1);
+        }
+        argv[(*argc)++] = arg;
 }
 
+/* Options that only have a long form */
+enum {
+        OPT_BLOCK_CACHE = 256,
+        OPT_INDEX_CACHE,
+        OPT_INFLATE_THREADS,
+        OPT_READAHEAD,
+        OPT_INFLATE,
+        OPT_NO_SIZE_DB,
+        OPT_NO_WATCH,
+        OPT_ENTRY_TIMEOUT,
+        OPT_ATTR_TIMEOUT,
+        OPT_NEGATIVE_TIMEOUT,
+        OPT_MAX_READ,
+        OPT_MAX_READAHEAD,
+        OPT_MAX_THREADS,
+        OPT_CLONE_FD,
+        OPT_LOG_LEVEL,
+        OPT_BENCH,
+        OPT_BENCH_CORPUS,
+        OPT_BENCH_SIZE,
+        OPT_BENCH_FILES,
+        OPT_BENCH_THREADS,
+        OPT_BUILD_INDEX,
+        OPT_NO_COMPACT_INDEX,
+        OPT_IO_ENGINE,
+        OPT_REMOTE,
+        OPT_REMOTE_LISTING,
+        OPT_DISK_CACHE,
+        OPT_DISK_CACHE_DIR,
+        OPT_PREWARM,
+        OPT_MAX_OPEN_FILES,
+        OPT_INFLATE_CPUS,
+        OPT_VERIFY_CRC,
+        OPT_MMAP,
+};
+
 int main(int argc, char *argv[])
 {
         int c, ret = 0, opt_idx = 0;
         char tdbdir[PATH_MAX];
         char tdbfile[PATH_MAX];
+        struct rlimit rl;
         static struct option long_opts[] = {
                 { "help", no_argument, 0, '?' },
                 { "allow-other", no_argument, 0, 'a' },
                 { "logfile", required_argument, 0, 'l' },
                 { "mountpoint", required_argument, 0, 'm' },
                 { "foreground", no_argument, 0, 'f' },
+                { "block-cache", required_argument, 0, OPT_BLOCK_CACHE },
+                { "index-cache", required_argument, 0, OPT_INDEX_CACHE },
+                { "inflate-threads", required_argument, 0,
+                  OPT_INFLATE_THREADS },
+                { "readahead", required_argument, 0, OPT_READAHEAD },
+                { "inflate", required_argument, 0, OPT_INFLATE },
+                { "no-size-db", no_argument, 0, OPT_NO_SIZE_DB },
+                { "no-watch", no_argument, 0, OPT_NO_WATCH },
+                { "entry-timeout", required_argument, 0, OPT_ENTRY_TIMEOUT },
+                { "attr-timeout", required_argument, 0, OPT_ATTR_TIMEOUT },
+                { "negative-timeout", required_argument, 0,
+                  OPT_NEGATIVE_TIMEOUT },
+                { "max-read", required_argument, 0, OPT_MAX_READ },
+                { "max-readahead", required_argument, 0, OPT_MAX_READAHEAD },
+                { "max-threads", required_argument, 0, OPT_MAX_THREADS },
+                { "clone-fd", no_argument, 0, OPT_CLONE_FD },
+                { "log-level", required_argument, 0, OPT_LOG_LEVEL },
+                { "bench", required_argument, 0, OPT_BENCH },
+                { "bench-corpus", no_argument, 0, OPT_BENCH_CORPUS },
+                { "bench-size", required_argument, 0, OPT_BENCH_SIZE },
+                { "bench-files", required_argument, 0, OPT_BENCH_FILES },
+                { "bench-threads", required_argument, 0,
+                  OPT_BENCH_THREADS },
+                { "build-index", no_argument, 0, OPT_BUILD_INDEX },
+                { "no-compact-index", no_argument, 0,
+                  OPT_NO_COMPACT_INDEX },
+                { "io-engine", required_argument, 0, OPT_IO_ENGINE },
+                { "remote", required_argument, 0, OPT_REMOTE },
+                { "remote-listing", required_argument, 0,
+                  OPT_REMOTE_LISTING },
+                { "disk-cache", required_argument, 0, OPT_DISK_CACHE },
+                { "disk-cache-dir", required_argument, 0,
+                  OPT_DISK_CACHE_DIR },
+                { "prewarm", no_argument, 0, OPT_PREWARM },
+                { "max-open-files", required_argument, 0,
+                  OPT_MAX_OPEN_FILES },
+                { "inflate-cpus", required_argument, 0, OPT_INFLATE_CPUS },
+                { "verify-crc", no_argument, 0, OPT_VERIFY_CRC },
+                { "mmap", no_argument, 0, OPT_MMAP },
                 { NULL, 0, 0, 0 }
         };
-        int fuse_bgzip_argc = 5;
-        char *fuse_bgzip_argv[16] = {
+        int fuse_bgzip_argc = 3;
+        char *fuse_bgzip_argv[MAX_FUSE_ARGS] = {
                 "fuse-bgzip",
                 "<export>",
-                "-omax_write=32768",
-                "-ononempty",
                 "-odefault_permissions",
                 NULL,
-                NULL,
-                NULL,
-                NULL,
-                NULL,
-                NULL,
-                NULL,
-                NULL,
-                NULL,
-                NULL,
-                NULL,
         };
+        struct fuse_args args;
+        struct fuse_cmdline_opts opts;
+        struct fuse_loop_config *config;
+        int level = LOG_LEVEL_INFO;
+        char *fuse_opt;
         struct passwd *pw = getpwuid(getuid());
         const char *homedir = pw->pw_dir;
         struct stat st;
         char fs_name[1024], fs_type[1024];
+        int64_t size;
+        int i;
 
         while ((c = getopt_long(argc, argv, "?hafl:m:", long_opts,
                     &opt_idx)) > 0) {
@@ -543,10 +9769,11 @@ int main(int argc, char *argv[])
                         print_usage(argv[0]);
                         return 0;
                 case 'a':
-                        fuse_bgzip_argv[fuse_bgzip_argc++] = "-oallow_other";
+                        add_fuse_arg(fuse_bgzip_argv, &fuse_bgzip_argc,
+                                     "-oallow_other");
                         break;
                 case 'f':
-                        fuse_bgzip_argv[fuse_bgzip_argc++] = "-f";
+                        add_fuse_arg(fuse_bgzip_argv, &fuse_bgzip_argc, "-f");
                         break;
                 case 'l':
                         logfile = strdup(optarg);
@@ -554,6 +9781,186 @@ int main(int argc, char *argv[])
                 case 'm':
                         mountpoint = strdup(optarg);
                         break;
+                case OPT_BLOCK_CACHE:
+                        size = parse_size(optarg);
+                        if (size < 0) {
+                                fprintf(stderr, "Invalid block cache size "
+                                        "%s\n", optarg);
+                                exit(1);
+                        }
+                        block_cache_size = size;
+                        break;
+                case OPT_INDEX_CACHE:
+                        size = parse_size(optarg);
+                        if (size < 0) {
+                                fprintf(stderr, "Invalid index cache size "
+                                        "%s\n", optarg);
+                                exit(1);
+                        }
+                        index_cache_size = size;
+                        break;
+                case OPT_INFLATE_THREADS:
+                        inflate_threads = atoi(optarg);
+                        break;
+                case OPT_READAHEAD:
+                        max_readahead = atoi(optarg);
+                        break;
+                case OPT_INFLATE:
+                        for (i = 0; inflaters[i].name; i++) {
+                                if (!strcmp(inflaters[i].name, optarg)) {
+                                        break;
+                                }
+                        }
+                        if (inflaters[i].name == NULL) {
+                                fprintf(stderr, "Inflate backend %s is not "
+                                        "supported by this build\n", optarg);
+                                exit(1);
+                        }
+                        inflater = &inflaters[i];
+                        break;
+                case OPT_NO_SIZE_DB:
+                        use_size_db = 0;
+                        break;
+                case OPT_NO_WATCH:
+                        watch_changes = 0;
+                        break;
+                case OPT_ENTRY_TIMEOUT:
+                        entry_timeout = parse_seconds("entry timeout", optarg);
+                        break;
+                case OPT_ATTR_TIMEOUT:
+                        attr_timeout = parse_seconds("attr timeout", optarg);
+                        break;
+                case OPT_NEGATIVE_TIMEOUT:
+                        negative_timeout = parse_seconds("negative timeout",
+                                                         optarg);
+                        break;
+                case OPT_MAX_READ:
+                        fuse_opt = fuse_option("max_read", optarg);
+                        add_fuse_arg(fuse_bgzip_argv, &fuse_bgzip_argc,
+                                     fuse_opt);
+                        break;
+                case OPT_MAX_READAHEAD:
+                        size = parse_size(optarg);
+                        if (size <= 0 || size > INT32_MAX) {
+                                fprintf(stderr, "Invalid max readahead "
+                                        "%s\n", optarg);
+                                exit(1);
+                        }
+                        kernel_readahead = size;
+                        break;
+                case OPT_MAX_THREADS:
+                        fuse_opt = fuse_option("max_threads", optarg);
+                        add_fuse_arg(fuse_bgzip_argv, &fuse_bgzip_argc,
+                                     fuse_opt);
+                        break;
+                case OPT_CLONE_FD:
+                        add_fuse_arg(fuse_bgzip_argv, &fuse_bgzip_argc,
+                                     "-oclone_fd");
+                        break;
+                case OPT_LOG_LEVEL:
+                        for (i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+                                if (!strcasecmp(log_level_names[i], optarg)) {
+                                        break;
+                                }
+                        }
+                        if (i > LOG_LEVEL_DEBUG) {
+                                fprintf(stderr, "Invalid log level %s\n",
+                                        optarg);
+                                exit(1);
+                        }
+                        level = i;
+                        break;
+                case OPT_BENCH:
+                        if (!strcmp(optarg, "fuse")) {
+                                bench_mode = BENCH_FUSE;
+                        } else if (!strcmp(optarg, "direct")) {
+                                bench_mode = BENCH_DIRECT;
+                        } else {
+                                fprintf(stderr, "Invalid benchmark mode "
+                                        "%s\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case OPT_BENCH_CORPUS:
+                        bench_corpus = 1;
+                        break;
+                case OPT_BENCH_SIZE:
+                        bench_size = parse_size(optarg);
+                        if (bench_size <= 0) {
+                                fprintf(stderr, "Invalid benchmark size "
+                                        "%s\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case OPT_BENCH_FILES:
+                        bench_files = atoi(optarg);
+                        break;
+                case OPT_BENCH_THREADS:
+                        bench_threads = atoi(optarg);
+                        if (bench_threads < 1) {
+                                bench_threads = 1;
+                        }
+                        break;
+                case OPT_BUILD_INDEX:
+                        build_indexes = 1;
+                        break;
+                case OPT_NO_COMPACT_INDEX:
+                        compact_indexes = 0;
+                        break;
+                case OPT_IO_ENGINE:
+                        if (!strcmp(optarg, "pread")) {
+                                io_engine = IO_PREAD;
+#ifdef HAVE_LIBURING
+                        } else if (!strcmp(optarg, "uring")) {
+                                io_engine = IO_URING;
+#endif
+                        } else {
+                                fprintf(stderr, "I/O engine %s is not "
+                                        "supported by this build\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case OPT_REMOTE:
+                        remote_base = strdup(optarg);
+                        i = strlen(remote_base);
+                        while (i > 1 && remote_base[i - 1] == '/') {
+                                remote_base[--i] = 0;
+                        }
+                        break;
+                case OPT_REMOTE_LISTING:
+                        remote_listing = strdup(optarg);
+                        break;
+                case OPT_DISK_CACHE:
+                        size = parse_size(optarg);
+                        if (size < 0) {
+                                fprintf(stderr, "Invalid disk cache size "
+                                        "%s\n", optarg);
+                                exit(1);
+                        }
+                        disk_cache_size = size;
+                        break;
+                case OPT_DISK_CACHE_DIR:
+                        disk_cache_dir = strdup(optarg);
+                        break;
+                case OPT_PREWARM:
+                        prewarm = 1;
+                        break;
+                case OPT_MAX_OPEN_FILES:
+                        max_source_fds = atoi(optarg);
+                        break;
+                case OPT_INFLATE_CPUS:
+                        if (parse_cpu_list(optarg, &inflate_cpus)) {
+                                fprintf(stderr, "Invalid CPU list %s\n",
+                                        optarg);
+                                exit(1);
+                        }
+                        break;
+                case OPT_VERIFY_CRC:
+                        verify_crc = 1;
+                        break;
+                case OPT_MMAP:
+                        use_mmap = 1;
+                        break;
                 }
         }
 
@@ -571,9 +9978,35 @@ int main(int argc, char *argv[])
         }
 
 
+        /* Opened before we daemonize, a relative path would not work
+         * afterwards.
+         */
+        if (logfile) {
+                log_fh = fopen(logfile, "a");
+                if (log_fh == NULL) {
+                        fprintf(stderr, "Failed to open log file %s %s\n",
+                                logfile, strerror(errno));
+                        exit(1);
+                }
+                log_level = level;
+        }
+
         dir_fd = open(mountpoint, O_DIRECTORY);
         fuse_bgzip_argv[1] = mountpoint;
 
+        /* Through the mount the daemon does all the work, so none of the
+         * set up below is needed.
+         */
+        if (bench_corpus && write_bench_corpus()) {
+                exit(1);
+        }
+        if (bench_mode == BENCH_FUSE) {
+                exit(run_bench() ? 1 : 0);
+        }
+        if (bench_corpus) {
+                exit(0);
+        }
+
         snprintf(tdbdir, sizeof(tdbdir), "%s/.fuse-bgzip",
                  getpwuid(getuid())->pw_dir);
         if (stat(tdbdir, &st) == -1 && errno == ENOENT) {
@@ -583,20 +10016,139 @@ int main(int argc, char *argv[])
                         exit(1);
                 }
         }
-                
-        nu_tdb = tdb_open(NULL, 10000001, TDB_INTERNAL, O_RDWR, 0);
-        if (nu_tdb == NULL) {
-                printf("Failed to open TDB\n");
-                exit(1);
+        if (remote_base) {
+                snprintf(remote_dir, sizeof(remote_dir), "%s/remote",
+                         tdbdir);
+                mkdir(remote_dir, 0700);
+                snprintf(remote_dir, sizeof(remote_dir), "%s/remote/%08x",
+                         tdbdir, hash_path(remote_base));
+                if (mkdir(remote_dir, 0700) == -1 && errno != EEXIST) {
+                        fprintf(stderr, "failed to create %s %s\n",
+                                remote_dir, strerror(errno));
+                        exit(1);
+                }
+                if (sync_remote() < 0) {
+                        exit(1);
+                }
+                close(dir_fd);
+                dir_fd = open(remote_dir, O_DIRECTORY);
+        }
+        if (build_indexes || compact_indexes) {
+                snprintf(index_dir, sizeof(index_dir), "%s/index", tdbdir);
+                if (mkdir(index_dir, 0700) == -1 && errno != EEXIST) {
+                        fprintf(stderr, "failed to create index directory "
+                                "%s %s\n", index_dir, strerror(errno));
+                        if (build_indexes) {
+                                exit(1);
+                        }
+                        /* Just read the .gz.gzi files as they are */
+                        index_dir[0] = 0;
+                }
         }
 
-        snprintf(tdbfile, sizeof(tdbfile), "%s/file_size.tdb", tdbdir);
-        errno = 0;
-        filesize_tdb = tdb_open(tdbfile, 10000001, 0, O_CREAT|O_RDWR, 0600);
-        if (filesize_tdb == NULL) {
-                printf("Failed to open FILE-SIZE TDB : %s\n", strerror(errno));
+        init_block_crc32();
+        if (verify_crc) {
+                LOG_INFO("Verifying blocks with %s crc32\n",
+                    block_crc32_name);
+        }
+
+        /* Leave the other half for the fuse device, tdb and our caches */
+        if (max_source_fds <= 0) {
+                max_source_fds = 1024;
+                if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+                    rl.rlim_cur != RLIM_INFINITY) {
+                        max_source_fds = rl.rlim_cur / 2 < (1 << 20) ?
+                                rl.rlim_cur / 2 : 1 << 20;
+                }
+                if (max_source_fds < 64) {
+                        max_source_fds = 64;
+                }
+        }
+
+        for (i = 0; i < ATTR_LOCKS; i++) {
+                pthread_mutex_init(&attr_locks[i], NULL);
+        }
+        lookup_cache_init(&nu_cache);
+        lookup_cache_init(&size_cache);
+        lookup_cache_init(&watched_dirs);
+        lookup_cache_init(&open_cache);
+        lookup_cache_init(&nu_snapshot);
+        lookup_cache_init(&hot_cache);
+
+        if (use_size_db) {
+                snprintf(tdbfile, sizeof(tdbfile), "%s/file_size.tdb",
+                         tdbdir);
+                errno = 0;
+                filesize_tdb = tdb_open(tdbfile, 10000001, 0,
+                                        O_CREAT|O_RDWR, 0600);
+                if (filesize_tdb == NULL) {
+                        printf("Failed to open FILE-SIZE TDB : %s\n",
+                               strerror(errno));
+                        exit(1);
+                }
+                load_size_db();
+        }
+
+        block_cache_init();
+        if (use_mmap) {
+                init_map_sigbus();
+        }
+        if (disk_cache_size) {
+                snprintf(tdbfile, sizeof(tdbfile), "%s/blocks", tdbdir);
+                if (disk_cache_dir == NULL) {
+                        disk_cache_dir = strdup(tdbfile);
+                }
+                if (disk_cache_init(disk_cache_dir)) {
+                        fprintf(stderr, "Failed to open disk cache %s %s\n",
+                                disk_cache_dir, strerror(errno));
+                        exit(1);
+                }
+        }
+
+        root_inode = alloc_inode(".");
+        ctl_inode = alloc_inode(CTL_DIR);
+        stats_inode = alloc_inode(CTL_DIR "/stats");
+        heat_inode = alloc_inode(CTL_DIR "/heat");
+        pins_inode = alloc_inode(CTL_DIR "/pins");
+        clock_gettime(CLOCK_REALTIME, &start_time);
+        start_ns = now_ns();
+
+        if (bench_mode == BENCH_DIRECT) {
+                exit(run_bench() ? 1 : 0);
+        }
+
+        args = (struct fuse_args)FUSE_ARGS_INIT(fuse_bgzip_argc,
+                                                fuse_bgzip_argv);
+        if (fuse_parse_cmdline(&args, &opts) != 0) {
                 exit(1);
         }
+        session = fuse_session_new(&args, &bgzip_oper, sizeof(bgzip_oper),
+                                   NULL);
+        if (session == NULL) {
+                exit(1);
+        }
+        if (fuse_set_signal_handlers(session) != 0) {
+                exit(1);
+        }
+        if (fuse_session_mount(session, opts.mountpoint) != 0) {
+                exit(1);
+        }
+        fuse_daemonize(opts.foreground);
+
+        if (opts.singlethread) {
+                ret = fuse_session_loop(session);
+        } else {
+                config = fuse_loop_cfg_create();
+                fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+                fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+                ret = fuse_session_loop_mt(session, config);
+                fuse_loop_cfg_destroy(config);
+        }
 
-        return fuse_main(fuse_bgzip_argc, fuse_bgzip_argv, &bgzip_oper, NULL);
+        fuse_session_unmount(session);
+        fuse_remove_signal_handlers(session);
+        fuse_session_destroy(session);
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return ret ? 1 : 0;
 }